@@ -5,107 +5,233 @@
          http://tldp.org/HOWTO/NCURSES-Programming-HOWTO/
 */
 
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <ctype.h>
+#include "a4.h"
 #ifndef NOGRAPHICS
-#include <unistd.h>
 #include <ncurses.h>
 #endif
 
-#define MAXVARNAME 10
-#define MAXVAR 1000
-#define SCREENSIZE 200
-
-// Syntax flags for the interpreter
-#define INT 1
-#define SET 2
-#define BEGIN 3
-#define END 4
-#define ADD 5
-#define SUB 6
-#define MULT 7
-#define DIV 8
-#define PRINT 9
-#define GOTO 10
-#define IF 11
-
-// Command structure
+#ifndef NOGRAPHICS
+// Off-screen copy of the terminal that PRINT draws into
+// Only the cells that changed since the last flush are sent to ncurses
 typedef struct
 {
-   // line number of the command
-   int line_number;
-
-   // type of command, see syntax flags above
-   int command_type;
+   int rows;
+   int cols;
 
-   // arguments are stored as strings for the command only
-   // Values are stored as integers in the runtime structure once the program is executed
-   char *args[3];
-} Command;
+   // What the program has drawn and what is currently on the terminal, rows * cols characters each
+   char *cells;
+   char *shown;
 
-// Runtime structure
-typedef struct
-{
-   // Realistically I would have used a HashMap for this by using the line number as the key and the command as the value
-   Command **commands;
-   int commandsLen;
+   // Range of columns in each row written since the last flush, lo > hi when the row is clean
+   int *dirty_lo;
+   int *dirty_hi;
 
-   // Track the length of the int names and int values arrays
-   int intNamesLen;
-   int intValuesLen;
+   // Flush after this many prints, 0 only flushes at the end of the program
+   int interval;
+   int prints;
+} Frame;
 
-   // Used to store the names of the int variables
-   char *intNames[MAXVAR];
+static Frame screen;
 
-   // Used to store the values of the int variables
-   int intValues[MAXVAR];
+// Size the frame buffer to the terminal, call after initscr
+int init_frame(int interval)
+{
+   screen.rows = LINES;
+   screen.cols = COLS;
+   screen.interval = interval;
+   screen.prints = 0;
+
+   size_t cells = (size_t)screen.rows * screen.cols;
+   screen.cells = malloc(cells);
+   screen.shown = malloc(cells);
+   screen.dirty_lo = malloc(sizeof(int) * screen.rows);
+   screen.dirty_hi = malloc(sizeof(int) * screen.rows);
+   if (screen.cells == NULL || screen.shown == NULL || screen.dirty_lo == NULL || screen.dirty_hi == NULL)
+      return -1;
 
-   // If a variable is set, the value is 1, otherwise it is 0
-   int intValuesSet[MAXVAR];
+   // The terminal starts out blank
+   memset(screen.cells, ' ', cells);
+   memset(screen.shown, ' ', cells);
+   for (int r = 0; r < screen.rows; r++)
+   {
+      screen.dirty_lo[r] = screen.cols;
+      screen.dirty_hi[r] = -1;
+   }
 
-   // Program counter and begin and end line numbers
-   int pc;
-   int begin_line;
-   int end_line;
+   return 1;
+}
 
-   // Flags to check if begin and end commands are present
-   int begin_flag;
-   int end_flag;
+// Send the changed cells to ncurses and refresh the terminal
+void flush_frame(void)
+{
+   if (screen.cells == NULL)
+   {
+      return;
+   }
 
-} Runtime;
+   for (int r = 0; r < screen.rows; r++)
+   {
+      for (int col = screen.dirty_lo[r]; col <= screen.dirty_hi[r]; col++)
+      {
+         size_t i = (size_t)r * screen.cols + col;
+         if (screen.cells[i] != screen.shown[i])
+         {
+            mvaddch(r, col, (unsigned char)screen.cells[i]);
+            screen.shown[i] = screen.cells[i];
+         }
+      }
 
-// Runtime functions
-Runtime *build_runtime_from_file(const char *filename);
-void execute_runtime(Runtime *runtime);
-void free_runtime(Runtime *runtime);
+      screen.dirty_lo[r] = screen.cols;
+      screen.dirty_hi[r] = -1;
+   }
 
-// Parse functions
-int parse_line(Runtime *runtime, int n, char *line);
-int parse_arg(Runtime *runtime, int n, char *token, int i);
+   refresh();
+   screen.prints = 0;
+}
 
-// Helper functions
-void print_runtime(Runtime *runtime);
-int is_defined(Runtime *runtime, char *arg);
-int is_set(Runtime *runtime, char *arg);
-int evaluate(Runtime *runtime, int n, char *op, int val1, int val2);
-int check_arguments(int command_type, int argc, int line_number);
-int determine_command_type(char *token);
-int get_command_by_line_number(Runtime *runtime, int line_number);
-const char *command_type_to_string(int command_type);
-int is_integer(char *token);
+// Release the frame buffer
+void free_frame(void)
+{
+   free(screen.cells);
+   free(screen.shown);
+   free(screen.dirty_lo);
+   free(screen.dirty_hi);
+   screen.cells = NULL;
+}
 
-#ifndef NOGRAPHICS
 // curses output
 // row indicates in which row the output will start - larger numbers
 //      move down
 // col indicates in which column the output will start - larger numbers
 //      move to the right
 // when row,col == 0,0 it is the upper left hand corner of the window
-void print(int row, int col, char *str)
+// The string is drawn into the frame buffer the way mvaddnstr would draw it, wrapping at the right edge and
+// stopping at the bottom right corner, and reaches the terminal on the next flush
+void print(Value row_value, Value col_value, const char *str, int len)
+{
+   if (row_value < 0 || row_value >= screen.rows || col_value < 0 || col_value >= screen.cols)
+   {
+      return;
+   }
+
+   int row = (int)row_value;
+   int col = (int)col_value;
+
+   for (int i = 0; i < len; i++)
+   {
+      if (col < screen.dirty_lo[row])
+         screen.dirty_lo[row] = col;
+      if (col > screen.dirty_hi[row])
+         screen.dirty_hi[row] = col;
+
+      screen.cells[(size_t)row * screen.cols + col] = str[i];
+
+      if (++col == screen.cols)
+      {
+         col = 0;
+         if (++row == screen.rows)
+            break;
+      }
+   }
+
+   if (screen.interval > 0 && ++screen.prints >= screen.interval)
+   {
+      flush_frame();
+   }
+}
+#endif
+
+// a4.c can be built without main to link the interpreter into another program, see the bench target
+#ifndef A4_NO_MAIN
+// Output sink for stdout
+static Output stdout_output = {.len = 0, .fd = STDOUT_FILENO, .line_buffered = 0, .callback = NULL, .memory = NULL};
+
+// Compile filename and write it to emit_file as C for --emit-c
+// The C compiler does fusion and loops itself, so of the passes only constant propagation runs first
+static int emit_program(const char *filename, const char *emit_file, int passes, int overflow)
+{
+   Runtime *runtime = build_runtime_from_file(filename);
+   if (runtime == NULL)
+   {
+      report("Error: Could not build runtime\n");
+      return -1;
+   }
+
+   runtime->overflow = overflow;
+
+   optimize_runtime(runtime, passes & OPT_CONSTANTS);
+
+   FILE *file = strcmp(emit_file, "-") == 0 ? stdout : fopen(emit_file, "w");
+   if (file == NULL)
+   {
+      report("Error opening file %s\n", emit_file);
+      free_runtime(runtime);
+      return -1;
+   }
+
+   int result = emit_c(runtime, filename, file);
+   if (file != stdout)
+      fclose(file);
+
+   free_runtime(runtime);
+   return result == -1 ? -1 : 0;
+}
+
+// Finish writing stdout compressed for --compress and write out what is left, passing result through
+static int finish_output(int result)
+{
+   if (stdout_output.pack != NULL)
+   {
+      free_pack(&stdout_output);
+      flush_output(&stdout_output);
+      set_report_output(NULL);
+   }
+   return result;
+}
+
+static void usage(const char *name)
+{
+#ifndef NOGRAPHICS
+   printf("Usage: %s [-l] [-f <prints>] [-p] [-P <file>] [-d <pass>] [-j] [--emit-c <file>] [--no-cache]\n", name);
+#else
+   printf("Usage: %s [-l] [-p] [-P <file>] [-d <pass>] [-j] [--emit-c <file>] [--no-cache]\n", name);
+#endif
+   printf("       %*s [--trace <file>] [--trace-events <events>] [--overflow <policy>] <filename>\n", (int)strlen(name), "");
+
+   // Batch mode, serving, sweeps and compressed output are only built into a4ng
+#ifdef NOGRAPHICS
+   printf("       %s [-d <pass>] [-j] [--no-cache] [--overflow <policy>] [-t <threads>] -b <filename>... | -m <manifest>\n", name);
+   printf("       %s [-d <pass>] [-j] [--no-cache] [--overflow <policy>] --serve <socket>\n", name);
+   printf("       %s [--no-cache] [--overflow <policy>] --sweep <variable>=<values> <filename>\n", name);
+   printf("       %s [options] --compress <filename>\n", name);
+#endif
+}
+
+#ifdef NOGRAPHICS
+// Run filename once for every value of a variable for --sweep, see sweep.c
+// Constant propagation would fold the variable's value into the program and loops computed in one step work on a
+// single run, so of the passes only fusion is used
+static int sweep_program(const char *filename, const char *spec, int passes, int use_cache, int overflow)
 {
-   mvprintw(row, col, str);
+   char *name;
+   Value *values;
+   int count;
+   if (parse_sweep(spec, &name, &values, &count) == -1)
+      return -1;
+
+   Runtime *runtime = load_program(filename, passes & OPT_FUSE, use_cache);
+   int result = -1;
+   if (runtime != NULL)
+   {
+      runtime->output = &stdout_output;
+      runtime->overflow = overflow;
+      result = run_sweep(runtime, name, values, count);
+      free_runtime(runtime);
+   }
+
+   free(name);
+   free(values);
+   return result == -1 ? -1 : 0;
 }
 #endif
 
@@ -113,14 +239,262 @@ int main(int argc, char *argv[])
 {
    int c;
 
+#ifndef NOGRAPHICS
+   // Number of prints between redraws of the terminal, 0 only redraws at the end
+   int frame_interval = 0;
+#endif
+
+   // Profiling is on when a report or a profile file is asked for
+   int profile_report = 0;
+   const char *profile_file = NULL;
+
+   // Optimization passes run over the compiled program
+   int passes = OPT_ALL;
+
+   // Compile the program to native code before running it
+   int native = 0;
+
+   // Keep compiled programs in the cache, see cache.c
+   int use_cache = 1;
+
+   // Run every file named on the command line, or listed in a manifest, on a pool of threads
+   int batch = 0;
+   const char *manifest = NULL;
+#ifdef NOGRAPHICS
+   int threads = 0;
+#endif
+
+   // Listen on a Unix socket and run the programs sent to it
+   const char *socket_path = NULL;
+
+   // Write the program out as C instead of running it, "-" for stdout
+   const char *emit_file = NULL;
+
+   // Record the last trace_events instructions run to a trace file, see trace.c
+   const char *trace_file = NULL;
+   long long trace_events = TRACE_EVENTS;
+
+   // What arithmetic does when it overflows, see overflow_from_name
+   int overflow = OVERFLOW_WRAP;
+
+   // Run the program once for every value of a variable, see sweep.c
+   const char *sweep = NULL;
+
+   // Write the output of the program compressed, see pack.c
+   int compress = 0;
+
+   static struct option long_options[] = {
+      {"emit-c", required_argument, NULL, 'c'},
+      {"no-cache", no_argument, NULL, 'n'},
+      {"serve", required_argument, NULL, 's'},
+      {"trace", required_argument, NULL, 'r'},
+      {"trace-events", required_argument, NULL, 'e'},
+      {"overflow", required_argument, NULL, 'o'},
+      {"sweep", required_argument, NULL, 'w'},
+      {"compress", no_argument, NULL, 'z'},
+      {NULL, 0, NULL, 0},
+   };
+
+   // -l writes every PRINT line out immediately, for interactive use
+   // -f <prints> redraws the terminal every <prints> prints in the graphics build
+   // -p prints a profile of the hottest lines to stderr once the program ends
+   // -P <file> writes the profile to file, as JSON if it ends in .json and as collapsed stacks otherwise
+   // -d <pass> disables an optimization pass, see optimization_from_name
+   // -j runs the program as native code where the machine is supported, see jit.c
+   // --emit-c <file> writes the program to file as a C program, see emit.c
+   // --no-cache always parses and compiles the program instead of loading or saving its cached image
+   // -b runs every file given in batch mode, -m <manifest> every file listed in manifest, see batch.c
+   // -t <threads> sets the number of threads batch mode runs programs on, by default one per CPU
+   // --serve <socket> runs the programs requested on a Unix socket, see serve.c
+   // --trace <file> records the instructions run to file, --trace-events <events> how many of the last are kept
+   // --overflow <policy> wraps, traps or saturates arithmetic that overflows
+   // --sweep <variable>=<values> runs the program once for every value of variable, in lockstep
+   // --compress writes the output compressed, for a4unpack to decode
+   while ((c = getopt_long(argc, argv, "lf:pP:d:jbm:t:", long_options, NULL)) != -1)
+   {
+      switch (c)
+      {
+         case 'l':
+            stdout_output.line_buffered = 1;
+            break;
+         case 'f':
+#ifndef NOGRAPHICS
+            frame_interval = atoi(optarg);
+            break;
+#else
+            printf("Error: -f is only available in a4\n");
+            return -1;
+#endif
+         case 'p':
+            profile_report = 1;
+            break;
+         case 'P':
+            profile_file = optarg;
+            break;
+         case 'd':
+         {
+            int pass = optimization_from_name(optarg);
+            if (pass == -1)
+            {
+               report("Error: Unknown optimization %s\n", optarg);
+               return -1;
+            }
+            passes &= ~pass;
+            break;
+         }
+         case 'j':
+            native = 1;
+            break;
+         case 'c':
+            emit_file = optarg;
+            break;
+         case 'n':
+            use_cache = 0;
+            break;
+         case 'b':
+            batch = 1;
+            break;
+         case 'm':
+            manifest = optarg;
+            break;
+         case 't':
+#ifndef NOGRAPHICS
+            printf("Error: -t is only available in a4ng\n");
+            return -1;
+#else
+            threads = atoi(optarg);
+            break;
+#endif
+         case 's':
+            socket_path = optarg;
+            break;
+         case 'r':
+            trace_file = optarg;
+            break;
+         case 'e':
+            trace_events = atoll(optarg);
+            if (trace_events < 1)
+            {
+               report("Error: --trace-events must be positive\n");
+               return -1;
+            }
+            break;
+         case 'o':
+            overflow = overflow_from_name(optarg);
+            if (overflow == -1)
+            {
+               report("Error: Unknown overflow policy %s\n", optarg);
+               return -1;
+            }
+            break;
+         case 'w':
+            sweep = optarg;
+            break;
+         case 'z':
+            compress = 1;
+            break;
+         default:
+            usage(argv[0]);
+            return -1;
+      }
+   }
+
+   // Native code runs if/goto sequences just as well without superinstructions, which it leaves to the interpreter
+   if (native)
+      passes &= ~OPT_FUSE;
+
+   if (compress && (socket_path != NULL || batch || manifest != NULL || emit_file != NULL))
+   {
+      printf("Error: Only the output of a single program can be compressed\n");
+      return -1;
+   }
+
+   if (socket_path != NULL)
+   {
+#ifndef NOGRAPHICS
+      printf("Error: Server mode is only available in a4ng\n");
+      return -1;
+#else
+      if (argc - optind != 0)
+      {
+         usage(argv[0]);
+         return -1;
+      }
+      return run_server(socket_path, passes, native, use_cache, overflow);
+#endif
+   }
+
+   if (batch || manifest != NULL)
+   {
+#ifndef NOGRAPHICS
+      printf("Error: Batch mode is only available in a4ng\n");
+      return -1;
+#else
+      char **files = argv + optind;
+      int count = argc - optind;
+      if (manifest != NULL && (count != 0 || read_manifest(manifest, &files, &count) == -1))
+      {
+         if (count != 0)
+            usage(argv[0]);
+         return -1;
+      }
+
+      int result = run_batch(files, count, threads, passes, native, use_cache, overflow);
+      if (manifest != NULL)
+         free(files);
+      return result;
+#endif
+   }
+
    // check for correct number of arguments
-   if (argc != 2)
+   if (argc - optind != 1)
+   {
+      usage(argv[0]);
+      return -1;
+   }
+
+   const char *filename = argv[optind];
+
+   if (emit_file != NULL)
+      return emit_program(filename, emit_file, passes, overflow);
+
+   int profiling = profile_report || profile_file != NULL;
+   if (profiling && trace_file != NULL)
+   {
+      report("Error: A program can not be profiled and traced at once\n");
+      return -1;
+   }
+
+   // Errors are written into the compressed output along with everything else
+   if (compress)
    {
-      printf("Usage: %s <filename>\n", argv[0]);
+#ifndef NOGRAPHICS
+      printf("Error: Compressed output is only available in a4ng\n");
       return -1;
+#else
+      if (pack_output(&stdout_output, 1) == -1)
+      {
+         report("Error: Could not allocate memory for compressed output\n");
+         return -1;
+      }
+      set_report_output(&stdout_output);
+#endif
    }
 
-   const char *filename = argv[1];
+   if (sweep != NULL)
+   {
+#ifndef NOGRAPHICS
+      printf("Error: Sweeps are only available in a4ng\n");
+      return -1;
+#else
+      if (profiling || trace_file != NULL)
+      {
+         report("Error: A sweep can not be profiled or traced\n");
+         return finish_output(-1);
+      }
+      return finish_output(sweep_program(filename, sweep, passes, use_cache, overflow));
+#endif
+   }
 
 #ifndef NOGRAPHICS
    // initialize ncurses
@@ -129,15 +503,48 @@ int main(int argc, char *argv[])
    cbreak();
    timeout(0);
    curs_set(FALSE);
+
+   if (init_frame(frame_interval) == -1)
+   {
+      endwin();
+      report("Error: Could not allocate memory for the frame buffer\n");
+      return -1;
+   }
 #endif
 
-   /* read and interpret the file starting here */
-   Runtime *runtime = build_runtime_from_file(filename);
+   // The profile is kept per line, so the program is profiled as written rather than optimized
+   // Profiles name the commands of the program, which a cached image does not have
+   // Traces are kept per command in the same way
+   if (profiling || trace_file != NULL)
+   {
+      passes = 0;
+      native = 0;
+      use_cache = 0;
+   }
 
+   /* read and interpret the file starting here */
+   Runtime *runtime = load_program(filename, passes, use_cache);
    if (runtime == NULL)
+      return finish_output(-1);
+
+   runtime->output = &stdout_output;
+   runtime->overflow = overflow;
+
+   // The interpreter runs the program when there is no native code for it
+   if (native)
+      jit_compile(runtime);
+
+   if (profiling && enable_profile(runtime) == -1)
    {
-      printf("Error: Could not build runtime\n");
-      return -1;
+      report("Error: Could not allocate memory for the profile\n");
+      free_runtime(runtime);
+      return finish_output(-1);
+   }
+
+   if (trace_file != NULL && enable_trace(runtime, trace_file, trace_events) == -1)
+   {
+      free_runtime(runtime);
+      return finish_output(-1);
    }
 
    // Print the runtime structure
@@ -159,111 +566,188 @@ int main(int argc, char *argv[])
 
    // shut down ncurses
    endwin();
+   free_frame();
 #endif
 
+   if (profile_report)
+      print_profile(runtime, stderr);
+   if (profile_file != NULL)
+      write_profile(runtime, profile_file);
+
+   // The string table of compressed output points into the program, so it is finished first
+   finish_output(0);
+
    // Free the runtime structure
    free_runtime(runtime);
    return 0;
 }
+#endif
 
 # pragma region Runtime Functions
 
-// read the file and build the runtime structure
-Runtime *build_runtime_from_file(const char *filename)
+// Create an empty runtime
+// The runtime structure is the first allocation in its own arena, everything parsed into it is allocated from there too
+Runtime *create_runtime(void)
 {
-   FILE *fp;
-   char *line = NULL;
-   size_t len = 0;
-   ssize_t read;
+   Arena arena = {NULL};
 
-   // open the file, return -1 if the file cannot be opened
-   fp = fopen(filename, "r");
-   if (fp == NULL)
+   // Initialize program runtime
+   Runtime *runtime = arena_alloc(&arena, sizeof(Runtime));
+   if (runtime == NULL)
    {
-      printf("Error opening file %s\n", filename);
+      report("Error: Could not allocate memory for runtime\n");
       return NULL;
    }
 
-   // Number of lines read
-   int n = 0;
+   // From here on the arena lives in the runtime
+   runtime->arena = arena;
+
+   runtime->source = NULL;
+   runtime->sourceLen = 0;
+   runtime->sourceMapped = 0;
+   runtime->image = NULL;
+   runtime->imageLen = 0;
+   runtime->begin_flag = 0;
+   runtime->end_flag = 0;
+   runtime->program = NULL;
+   runtime->programLen = 0;
+   runtime->lineTable = NULL;
+   runtime->lineTableLen = 0;
+   runtime->output = NULL;
+   runtime->profile = NULL;
+   runtime->trace = NULL;
+   runtime->loops = NULL;
+   runtime->loopsLen = 0;
+   runtime->loopsCapacity = 0;
+   runtime->overflow = OVERFLOW_WRAP;
+   runtime->verified = 0;
+   runtime->native = NULL;
+   runtime->nativeSize = 0;
+   runtime->status = A4_READY;
+   runtime->next = 0;
+   runtime->budget = -1;
+   runtime->deadline = 0;
+
+   // Initialize the array of commands, it grows as lines are parsed
+   runtime->commandsLen = 0;
+   runtime->commandsCapacity = INITIAL_COMMANDS;
+   runtime->commands = arena_alloc(&runtime->arena, sizeof(Command) * INITIAL_COMMANDS);
+
+   // Set current lengths for int names and int values
+   runtime->intNamesLen = 0;
+   runtime->intValuesLen = 0;
 
-   // Count the number of valid lines in the file to initialize the command array
-   while ((read = getline(&line, &len, fp)) != -1)
+   // Variable storage and the symbol table start small and grow as int commands are parsed
+   runtime->intCapacity = 0;
+   runtime->intNames = NULL;
+   runtime->intValues = NULL;
+   runtime->intValuesSet = NULL;
+   runtime->symbolsLen = 0;
+   runtime->symbolsCapacity = INITIAL_SYMBOLS;
+   runtime->symbols = arena_alloc(&runtime->arena, sizeof(Symbol) * INITIAL_SYMBOLS);
+   runtime->constants = NULL;
+   runtime->constantsLen = 0;
+   runtime->constantsCapacity = 0;
+
+   // Check if the allocations failed
+   if (runtime->commands == NULL || runtime->symbols == NULL || grow_variables(runtime, INITIAL_VARIABLES) == -1)
    {
-      // Check if the line is not an empty newline
-      if(line[0] != '\n')
-         n++;
+      report("Error: Could not allocate memory for runtime\n");
+      free_runtime(runtime);
+      return NULL;
    }
 
-   // Reset the file pointer to the beginning of the file
-   fseek(fp, 0, SEEK_SET);
-
-   // Initialize program runtime
-   Runtime *runtime = malloc(sizeof(Runtime));
-
-   // Initialize the array of commands
-   runtime->commands = malloc(sizeof(Command *) * n);
-
-   // Initialize the individual commands
-   for (int i = 0; i < n; i++)
+   for (int i = 0; i < INITIAL_SYMBOLS; i++)
    {
-      runtime->commands[i] = malloc(sizeof(Command));
+      runtime->symbols[i].index = -1;
    }
 
-   // Set current lengths for int names and int values
-   runtime->intNamesLen = 0;
-   runtime->intValuesLen = 0;
-   runtime->commandsLen = n;
+   return runtime;
+}
 
-   for(int i = 0; i < MAXVAR; i++)
+// read the file and build the runtime structure
+// The file is read once, mapped into memory when possible, and the commands point straight into it
+Runtime *build_runtime_from_file(const char *filename)
+{
+   // open the file, return NULL if the file cannot be opened
+   // "-" reads the program from a copy of stdin, so it can be closed like any other file
+   int fd = strcmp(filename, "-") == 0 ? dup(STDIN_FILENO) : open(filename, O_RDONLY);
+   if (fd == -1)
    {
-      runtime->intValuesSet[i] = 0;
+      report("Error opening file %s\n", filename);
+      return NULL;
    }
 
-   // Check if malloc failed
-   if (runtime->commands == NULL)
+   Runtime *runtime = create_runtime();
+   if (runtime == NULL)
    {
-      printf("Error: Could not allocate memory for commands\n");
-
-      // Close the file
-      fclose(fp);
+      close(fd);
       return NULL;
    }
 
-   // reset n to 0 so that it can be used as an index
-   n = 0;
+   char *source = NULL;
+   size_t len = 0;
+
+   // Map regular files, the mapping is never written to
+   struct stat st;
+   if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+   {
+      source = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (source == MAP_FAILED)
+      {
+         source = NULL;
+      }
+      else
+      {
+         len = st.st_size;
+         runtime->sourceMapped = 1;
+      }
+   }
 
-   // Read the file line by line
-   while ((read = getline(&line, &len, fp)) != -1)
+   // Read everything else (pipes, empty files, failed mappings) into one growing buffer in the arena
+   if (source == NULL)
    {
-      if (line[0] == '\n')
-         continue;
+      size_t capacity = 0;
+      ssize_t bytes;
 
-      // Parse the line
-      if (parse_line(runtime, n, line) == -1)
+      do
+      {
+         if (len == capacity)
+         {
+            size_t new_capacity = capacity > 0 ? capacity * 2 : 4096;
+            source = arena_grow(&runtime->arena, source, capacity, new_capacity);
+            if (source == NULL)
+            {
+               report("Error: Could not allocate memory for file %s\n", filename);
+               free_runtime(runtime);
+               close(fd);
+               return NULL;
+            }
+            capacity = new_capacity;
+         }
+
+         bytes = read(fd, source + len, capacity - len);
+         if (bytes > 0)
+            len += bytes;
+      } while (bytes > 0);
+
+      if (bytes == -1)
       {
-         // Close the file
-         fclose(fp);
+         report("Error reading file %s\n", filename);
+         free_runtime(runtime);
+         close(fd);
          return NULL;
       }
-      n++;
    }
 
-   free(line);
-   fclose(fp);
+   close(fd);
 
-   // Check if the begin command is present
-   if (runtime->begin_flag == 0)
-   {
-      printf("Error: No begin command\n");
-      free_runtime(runtime);
-      return NULL;
-   }
+   // The runtime owns the source since its commands point into it
+   runtime->source = source;
+   runtime->sourceLen = len;
 
-   // Check if the end command is present
-   if (runtime->end_flag == 0)
+   if (parse_source(runtime, source, len) == -1)
    {
-      printf("Error: No end command\n");
       free_runtime(runtime);
       return NULL;
    }
@@ -271,326 +755,484 @@ Runtime *build_runtime_from_file(const char *filename)
    return runtime;
 }
 
-// Execute runtime and step through commands
-void execute_runtime(Runtime *runtime)
+// Build, compile and optimize the program in filename, or load its cached image when use_cache is set
+// Programs that are compiled are cached for the next run when use_cache is set
+Runtime *load_program(const char *filename, int passes, int use_cache)
 {
+   // A cached image of the program is already optimized and runs without parsing the source
+   Runtime *runtime = use_cache ? load_cached_runtime(filename, passes) : NULL;
+   if (runtime != NULL)
+      return runtime;
+
+   runtime = build_runtime_from_file(filename);
    if (runtime == NULL)
    {
-      return;
+      report("Error: Could not build runtime\n");
+      return NULL;
    }
 
-   // Set the program counter to the begin line
-   runtime->pc = runtime->begin_line;
+   optimize_runtime(runtime, passes);
 
-   int expression_flag;
+   if (use_cache)
+      save_cached_runtime(runtime, filename, passes);
 
-   //Loop through commands while runtime->pc is less than the end line
-   while(runtime->pc < runtime->end_line)
-   {
-      // Get command at program counter
-      int command_id = get_command_by_line_number(runtime, runtime->pc);
-      if (command_id == -1)
-      {
-         printf("Error: Command at line %d not found\n", runtime->pc);
-         return;
-      }
-      Command *cur_command = runtime->commands[command_id];
+   return runtime;
+}
+
+// Parse a program from a buffer and build the runtime structure
+// The buffer is not modified and must stay valid for as long as the runtime is used
+Runtime *build_runtime_from_buffer(const char *source, size_t len)
+{
+   Runtime *runtime = create_runtime();
+   if (runtime == NULL)
+   {
+      return NULL;
+   }
+
+   if (parse_source(runtime, source, len) == -1)
+   {
+      free_runtime(runtime);
+      return NULL;
+   }
+
+   return runtime;
+}
 
-      int next_idx = command_id + 1;
+// Parse the lines of the source one after another into the commands of the runtime
+int parse_lines(Runtime *runtime, const char *source, size_t len)
+{
+   // Number of commands parsed
+   int n = 0;
 
-      // Used to see if we skip the next line if the current command is an if statement (true = run next, false = skip next)
-      expression_flag = 1;
+   const char *end = source + len;
+   const char *line = source;
 
-      // Get the command type
-      int command_type = cur_command->command_type;
+   // Walk the buffer line by line
+   while (line < end)
+   {
+      const char *newline = memchr(line, '\n', end - line);
+      const char *line_end = newline != NULL ? newline : end;
 
-      // Execute the command
-      switch (command_type)
+      // Skip empty lines
+      if (line_end == line)
       {
-         case INT:
+         line = line_end + 1;
+         continue;
+      }
+
+      // Grow the array of commands, in place when nothing else was allocated after it
+      if (n == runtime->commandsCapacity)
+      {
+         size_t size = sizeof(Command) * runtime->commandsCapacity;
+         Command *commands = arena_grow(&runtime->arena, runtime->commands, size, size * 2);
+         if (commands == NULL)
          {
-            // Do nothing
-            // All int variables are initialized in parse_int, we just go to the next command
-            break;
+            report("Error: Could not allocate memory for commands\n");
+            return -1;
          }
-         case SET:
-         {
-            // Check if the variable is defined
-            int index = is_defined(runtime, cur_command->args[0]);
-            if (index == -1)
-            {
-               printf("Error at line %d: Variable %s is not defined\n", runtime->pc, cur_command->args[0]);
-               return;
-            }
+         runtime->commands = commands;
+         runtime->commandsCapacity *= 2;
+      }
 
-            // Set the value of the variable
-            runtime->intValues[index] = atoi(cur_command->args[1]);
-            runtime->intValuesSet[index] = 1;
-            runtime->intValuesLen = runtime->intValuesLen + 1;
+      runtime->commandsLen = n + 1;
 
-            break;
-         }
-         case BEGIN:
-         {
-            // Do nothing, we just go to the next command
-            break;
-         }
-         case END:
-         {
-            // Do nothing, we should never reach this point
-            break;
-         }
-         case ADD:
-         {
-            // Check if the variable is set
-            int index = is_set(runtime, cur_command->args[0]);
-            if (index == -1)
-            {
-               printf("Error at line %d: Variable %s is not set\n", runtime->pc, cur_command->args[0]);
-               return;
-            }
+      // Parse the line
+      if (parse_line(runtime, n, line, line_end - line) == -1)
+      {
+         return -1;
+      }
+      n++;
 
-            // Val_check = (-1 = not an int, 0 = positive integer, 1 = negative integer)
-            int val_check = is_integer(cur_command->args[1]);
-            int val = atoi(cur_command->args[1]);
+      line = line_end + 1;
+   }
 
-            // If val_check is 1, then the value is negative
-            if (val_check == 1)
-            {
-               val = -val;
-            }
-            // Add the value to the variable
-            runtime->intValues[index] += atoi(cur_command->args[1]);
-            break;
-         }
-         case SUB:
-         {
-            // Check if the variable is set
-            int index = is_set(runtime, cur_command->args[0]);
-            if (index == -1)
-            {
-               printf("Error at line %d: Variable %s is not set\n", runtime->pc, cur_command->args[0]);
-               return;
-            }
+   return 1;
+}
+
+// Parse the source, check it and compile it
+int parse_source(Runtime *runtime, const char *source, size_t len)
+{
+   // Large sources are split into commands on several threads, see parse.c
+   int threads = parse_threads(len);
+   if ((threads > 1 ? parse_parallel(runtime, source, len, threads) : parse_lines(runtime, source, len)) == -1)
+   {
+      return -1;
+   }
 
-            // Check value to see if it is negative
-            int val_check = is_integer(cur_command->args[1]);
-            int val = atoi(cur_command->args[1]);
+   // Check if the begin command is present
+   if (runtime->begin_flag == 0)
+   {
+      report("Error: No begin command\n");
+      return -1;
+   }
 
-            // If val_check is 2, then the value is negative
-            if (val_check == 2)
-            {
-               val = -val;
-            }
-            // Subtract the value from the variable
-            runtime->intValues[index] -= atoi(cur_command->args[1]);
-            break;
-         }
-         case MULT:
-         {
-            // Check if the variable is set
-            int index = is_set(runtime, cur_command->args[0]);
-            if (index == -1)
-            {
-               printf("Error at line %d: Variable %s is not set\n", runtime->pc, cur_command->args[0]);
-               return;
-            }
+   // Check if the end command is present
+   if (runtime->end_flag == 0)
+   {
+      report("Error: No end command\n");
+      return -1;
+   }
+
+   // Build the line number lookup used to resolve goto targets
+   if (build_line_table(runtime) == -1)
+   {
+      return -1;
+   }
 
-            int val_check = is_integer(cur_command->args[1]);
-            int val = atoi(cur_command->args[1]);
+   // Compile the commands so that execute_runtime never has to look at the argument strings
+   if (compile_runtime(runtime) == -1)
+   {
+      return -1;
+   }
 
-            // If val_check is 2, then the value is negative
-            if (val_check == 2)
-            {
-               val = -val;
-            }
-            // Multiply the variable by the value
-            runtime->intValues[index] *= atoi(cur_command->args[1]);
+   return 1;
+}
+
+// Used by qsort to order command indices by line number, ties keep file order
+// Per thread, since batch mode builds runtimes on several threads at once
+static __thread Runtime *sort_runtime;
+
+static int compare_command_lines(const void *p1, const void *p2)
+{
+   int i1 = *(const int *)p1;
+   int i2 = *(const int *)p2;
+   int line1 = sort_runtime->commands[i1].line_number;
+   int line2 = sort_runtime->commands[i2].line_number;
+
+   if (line1 != line2)
+      return line1 < line2 ? -1 : 1;
+   return i1 - i2;
+}
+
+// Build the line number to command index lookup
+// A dense table is used when the line numbers are close together, otherwise a sorted index that is binary searched
+int build_line_table(Runtime *runtime)
+{
+   if (runtime == NULL || runtime->commandsLen == 0)
+   {
+      return -1;
+   }
+
+   // Find the range of line numbers in the program
+   int min = runtime->commands[0].line_number;
+   int max = min;
+   for (int i = 1; i < runtime->commandsLen; i++)
+   {
+      int line_number = runtime->commands[i].line_number;
+      if (line_number < min)
+         min = line_number;
+      if (line_number > max)
+         max = line_number;
+   }
+
+   long span = (long)max - min + 1;
+   runtime->lineBase = min;
+   runtime->lineTableDense = span <= (long)runtime->commandsLen * LINETABLE_SPARSITY;
+   runtime->lineTableLen = runtime->lineTableDense ? (int)span : runtime->commandsLen;
+   runtime->lineTable = arena_alloc(&runtime->arena, sizeof(int) * runtime->lineTableLen);
+
+   if (runtime->lineTable == NULL)
+   {
+      report("Error: Could not allocate memory for line table\n");
+      return -1;
+   }
+
+   if (runtime->lineTableDense)
+   {
+      for (int i = 0; i < runtime->lineTableLen; i++)
+         runtime->lineTable[i] = -1;
+
+      // Walk backwards so the first command with a given line number wins, like the old linear scan
+      for (int i = runtime->commandsLen - 1; i >= 0; i--)
+         runtime->lineTable[runtime->commands[i].line_number - min] = i;
+   }
+   else
+   {
+      for (int i = 0; i < runtime->commandsLen; i++)
+         runtime->lineTable[i] = i;
+
+      sort_runtime = runtime;
+      qsort(runtime->lineTable, runtime->commandsLen, sizeof(int), compare_command_lines);
+   }
+
+   return 1;
+}
+
+// Lower the parsed commands into the instruction stream run by execute_runtime
+// Variable names, immediates, comparison operators and goto targets are all resolved here once
+int compile_runtime(Runtime *runtime)
+{
+   if (runtime == NULL)
+   {
+      return -1;
+   }
+
+   // One instruction per command, plus two halt sentinels so that stepping past the last command
+   // (or an if skipping over it) stops the program instead of running off the end of the array
+   runtime->programLen = runtime->commandsLen + 2;
+   runtime->program = arena_alloc(&runtime->arena, sizeof(Instruction) * runtime->programLen);
+   if (runtime->program == NULL)
+   {
+      report("Error: Could not allocate memory for program\n");
+      return -1;
+   }
+
+   // Constant slots are appended after the variables
+   runtime->intValuesLen = runtime->intNamesLen;
+
+   for (int i = 0; i < runtime->programLen; i++)
+   {
+      Instruction *ins = &runtime->program[i];
+      ins->opcode = OP_HALT;
+      ins->a = 0;
+      ins->b = 0;
+      ins->target = i + 1;
+      ins->str.str = NULL;
+      ins->str.len = 0;
+      ins->line_number = runtime->end_line;
+      ins->proven = 0;
+
+      if (i >= runtime->commandsLen)
+         continue;
+
+      Command *command = &runtime->commands[i];
+      ins->line_number = command->line_number;
+
+      // The program stops as soon as the program counter reaches the end line
+      if (command->line_number >= runtime->end_line)
+         continue;
+
+      switch (command->command_type)
+      {
+         case INT:
+         case BEGIN:
+         case END:
+         {
+            ins->opcode = OP_NOP;
             break;
          }
+         case SET:
+         case ADD:
+         case SUB:
+         case MULT:
          case DIV:
          {
-            // Check if the variable is set
-            int index = is_set(runtime, cur_command->args[0]);
-            if (index == -1)
-            {
-               printf("Error at line %d: Variable %s is not set\n", runtime->pc, cur_command->args[0]);
-               return;
-            }
+            // ADD, SUB, MULT and DIV are in the same order as their opcodes
+            ins->opcode = command->command_type == SET ? OP_SET : OP_ADD + (command->command_type - ADD);
+            ins->a = is_defined(runtime, command->args[0]);
 
-            int val_check = is_integer(cur_command->args[1]);
-            int val = atoi(cur_command->args[1]);
-
-            // If val_check is 2, then the value is negative
-            if (val_check == 2)
+            // The second operand is either an immediate or a variable, parse_arg has checked that it is defined
+            if (scan_integer(command->args[1], &ins->b) == -1)
             {
-               val = -val;
+               ins->opcode += OP_VAR_OFFSET;
+               ins->b = is_defined(runtime, command->args[1]);
             }
-            // Divide the variable by the value
-            runtime->intValues[index] /= atoi(cur_command->args[1]);
             break;
          }
          case PRINT:
          {
-            // Check if the variable is set
-            int index1 = is_set(runtime, cur_command->args[0]);
-            if (index1 == -1)
-            {
-               printf("Error at line %d: Variable %s is not set\n", runtime->pc, cur_command->args[0]);
-               return;
-            }
-
-            // Check if the variable is set
-            int index2 = is_set(runtime, cur_command->args[1]);
-            if (index2 == -1)
-            {
-               printf("Error at line %d: Variable %s is not set\n", runtime->pc, cur_command->args[1]);
-               return;
-            }
-
-            #ifndef NOGRAPHICS
-            // Print the string to the screen at the specified coordinates (row, col)
-            print(runtime->intValues[index1], runtime->intValues[index2], cur_command->args[2]);
-            #else
-            // Print the variable values
-            printf("%d %d %s\n", runtime->intValues[index1], runtime->intValues[index2], cur_command->args[2]);
-            #endif
-
+            ins->opcode = OP_PRINT;
+            ins->a = is_defined(runtime, command->args[0]);
+            ins->b = is_defined(runtime, command->args[1]);
+            ins->str = command->args[2];
             break;
          }
          case GOTO:
          {
-            // Check if the line number is valid
-            int line_number = atoi(cur_command->args[0]);
+            int line_number = token_to_int(command->args[0]);
             if (line_number < runtime->begin_line || line_number > runtime->end_line)
             {
-               printf("Error at line %d: Invalid line number %d\n", runtime->pc, line_number);
-               return;
+               ins->opcode = OP_TRAP;
+               ins->a = TRAP_INVALID_LINE;
+               ins->b = line_number;
+               break;
             }
 
-            // Set next_idx to the index of the command with the line number
             int id = get_command_by_line_number(runtime, line_number);
             if (id == -1)
             {
-               printf("Error: Command at line %d not found\n", line_number);
-               return;
+               ins->opcode = OP_TRAP;
+               ins->a = TRAP_MISSING_LINE;
+               ins->b = line_number;
+               break;
             }
-            next_idx = id;
+
+            ins->opcode = OP_GOTO;
+            ins->target = id;
             break;
          }
          case IF:
          {
-            int val1, val2;
-
-            // Check if the variable is set
-            int index1 = is_set(runtime, cur_command->args[0]);
-            if (index1 == -1)
-            {
-               // Check if the value is an integer
-               int is_int = is_integer(cur_command->args[0]);
-               if (is_int == -1)
-               {
-                  printf("Error at line %d: %s is not defined\n", runtime->pc, cur_command->args[0]);
-                  return;
-               }
-               else
-               {
-                  // Set val1 to the integer value
-                  val1 = atoi(cur_command->args[0]);
-
-                  // Check if the value is negative, if so apply the negative sign
-                  if (is_int == 2)
-                  {
-                     val1 = -val1;
-                  }
-               }
-            }
-            else
-            {
-               // Set val1 to the value of the variable
-               val1 = runtime->intValues[index1];
-            }
-
-            // Check if the variable is set
-            int index2 = is_set(runtime, cur_command->args[2]);
-            if (index2 == -1)
-            {
-               // Check if the value is an integer
-               int is_int = is_integer(cur_command->args[2]);
-               if (is_int == -1)
-               {
-                  printf("Error at line %d: %s is not defined\n", runtime->pc, cur_command->args[2]);
-                  return;
-               }
-               else
-               {
-                  // Set val2 to the integer value
-                  val2 = atoi(cur_command->args[2]);
-
-                  // Check if the value is negative, if so apply the negative sign
-                  if (is_int == 2)
-                  {
-                     val2 = -val2;
-                  }
-               }
-            }
-            else
-            {
-               // Set val2 to the value of the variable
-               val2 = runtime->intValues[index2];
-            }
+            ins->opcode = determine_if_opcode(command->args[1]);
+            ins->a = resolve_operand(runtime, command->args[0]);
+            ins->b = resolve_operand(runtime, command->args[2]);
+            if (ins->a == -1 || ins->b == -1)
+               return -1;
 
-            // If the expression is false, skip the next line
-            if(evaluate(runtime, command_id, cur_command->args[1], val1, val2) == 0)
-               next_idx++;
+            // A false expression skips over the next command
+            ins->target = i + 2;
+            break;
          }
       }
+   }
+
+   // Execution starts at the begin command
+   runtime->entry = get_command_by_line_number(runtime, runtime->begin_line);
+
+   return 1;
+}
+
+// The interpreter loop lives in execute.h and is compiled once for every variant, so profiling, tracing and set
+// checks only cost anything in the loops that need them
+// The plain loop is generated for every overflow policy, with and without set checks
+#define EXECUTE_FUNCTION execute_program
+#define EXECUTE_OVERFLOW OVERFLOW_WRAP
+#include "execute.h"
+
+#define EXECUTE_FUNCTION execute_program_verified
+#define EXECUTE_OVERFLOW OVERFLOW_WRAP
+#define EXECUTE_VERIFIED
+#include "execute.h"
+
+#define EXECUTE_FUNCTION execute_program_trapping
+#define EXECUTE_OVERFLOW OVERFLOW_TRAP
+#include "execute.h"
+
+#define EXECUTE_FUNCTION execute_program_trapping_verified
+#define EXECUTE_OVERFLOW OVERFLOW_TRAP
+#define EXECUTE_VERIFIED
+#include "execute.h"
+
+#define EXECUTE_FUNCTION execute_program_saturating
+#define EXECUTE_OVERFLOW OVERFLOW_SATURATE
+#include "execute.h"
+
+#define EXECUTE_FUNCTION execute_program_saturating_verified
+#define EXECUTE_OVERFLOW OVERFLOW_SATURATE
+#define EXECUTE_VERIFIED
+#include "execute.h"
+
+// Plain loop for every overflow policy, indexed by policy and then by whether every instruction is proven
+static int (*const execute_programs[3][2])(Runtime *runtime, int start) = {
+   [OVERFLOW_WRAP] = {execute_program, execute_program_verified},
+   [OVERFLOW_TRAP] = {execute_program_trapping, execute_program_trapping_verified},
+   [OVERFLOW_SATURATE] = {execute_program_saturating, execute_program_saturating_verified},
+};
+
+// The profiled, traced and budgeted loops follow the overflow policy of the runtime as they run
+
+#define EXECUTE_FUNCTION execute_program_profiled
+#define EXECUTE_PROFILE
+#include "execute.h"
+
+#define EXECUTE_FUNCTION execute_program_traced
+#define EXECUTE_TRACE
+#include "execute.h"
+
+// CLOCK_MONOTONIC time in nanoseconds, deadlines are given in it
+static uint64_t clock_ns(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Instructions the budgeted loop runs before calling charge_slice, never more than are left in the budget and
+// only DEADLINE_INTERVAL when there is a deadline, so the clock is read once every that many instructions
+static long long next_slice(Runtime *runtime)
+{
+   long long slice = runtime->deadline != 0 ? DEADLINE_INTERVAL : LLONG_MAX;
+   if (runtime->budget >= 0 && runtime->budget < slice)
+      slice = runtime->budget;
+
+   return slice;
+}
 
-      // Go to the next command
-      runtime->pc = runtime->commands[next_idx]->line_number;
+// Take a slice that has been run off the budget, returns the status to stop with or A4_READY to carry on
+static int charge_slice(Runtime *runtime, long long slice)
+{
+   if (runtime->budget >= 0)
+   {
+      runtime->budget -= slice;
+      if (runtime->budget == 0)
+         return A4_BUDGET;
    }
 
-   return;
+   if (runtime->deadline != 0 && clock_ns() >= runtime->deadline)
+      return A4_DEADLINE;
+
+   return A4_READY;
 }
 
-// Free the runtime structure
-void free_runtime(Runtime *runtime)
+// Only a4_run counts instructions, the other loops pay nothing for it
+#define EXECUTE_FUNCTION execute_program_budgeted
+#define EXECUTE_BUDGET
+#include "execute.h"
+
+// Execute runtime and step through the compiled instructions
+// Executions and ticks are counted per instruction when a profile has been enabled with enable_profile, and every
+// instruction is recorded when a trace has been enabled with enable_trace
+// Programs compiled to native code with jit_compile run natively until they halt or hit something the native code
+// leaves to the interpreter, such as an error, and the interpreter carries on from there
+void execute_runtime(Runtime *runtime)
 {
-   if (runtime == NULL)
+   if (runtime == NULL || runtime->program == NULL)
    {
       return;
    }
 
-   // Free the array of commands
-   for (int i = 0; i < runtime->commandsLen; i++)
+   if (runtime->profile != NULL)
    {
-      int command_type = runtime->commands[i]->command_type;
+      execute_program_profiled(runtime, runtime->entry);
+      return;
+   }
 
-      // Free malloc'd char pointer for INT, SET, ADD, SUB, MULT, DIV, PRINT, IF
-      if (command_type == INT || command_type == SET || command_type == ADD || command_type == SUB || command_type == MULT || command_type == DIV || command_type == PRINT || command_type == IF || command_type == GOTO)
-      {
-         free(runtime->commands[i]->args[0]);
-      }
+   if (runtime->trace != NULL)
+   {
+      execute_program_traced(runtime, runtime->entry);
+      return;
+   }
 
-      // Free malloc'd char pointer for SET, ADD, SUB, MULT, DIV, PRINT, IF
-      if (command_type == SET || command_type == ADD || command_type == SUB || command_type == MULT || command_type == DIV || command_type == PRINT || command_type == IF)
-      {
-         free(runtime->commands[i]->args[1]);
-      }
+   int start = runtime->entry;
+   if (runtime->native != NULL)
+      start = runtime->native(runtime->intValues, runtime->intValuesSet, runtime);
 
-      // Free malloc'd char pointer for PRINT, IF
-      if (command_type == PRINT || command_type == IF)
-      {
-         free(runtime->commands[i]->args[2]);
-      }
+   // Native code only hands back at instructions reached from the entry, where the verified sets still hold
+   execute_programs[runtime->overflow][runtime->verified](runtime, start);
+}
+
+// Run the PRINT at instruction idx for native code, which has already checked that both variables are set
+void jit_print(Runtime *runtime, int idx)
+{
+   Instruction *ins = &runtime->program[idx];
+
+#ifndef NOGRAPHICS
+   print(runtime->intValues[ins->a], runtime->intValues[ins->b], ins->str.str, ins->str.len);
+#else
+   output_print(runtime->output, runtime->intValues[ins->a], runtime->intValues[ins->b], ins->str.str, ins->str.len);
+#endif
+}
 
-      // Free command
-      free(runtime->commands[i]);
+// Free the runtime structure
+void free_runtime(Runtime *runtime)
+{
+   if (runtime == NULL)
+   {
+      return;
    }
-   free(runtime->commands);
 
-   // Free the runtime structure
-   free(runtime);
+   // Unmap the source the commands were parsed from
+   if (runtime->sourceMapped)
+      munmap(runtime->source, runtime->sourceLen);
+   if (runtime->image != NULL)
+      munmap(runtime->image, runtime->imageLen);
+
+   jit_free(runtime);
+   free_trace(runtime);
+
+   // Everything else lives in the arena, including the runtime structure, so copy the arena out before freeing it
+   Arena arena = runtime->arena;
+   arena_free(&arena);
 }
 
 // Print the runtime structure
@@ -607,16 +1249,16 @@ void print_runtime(Runtime *runtime)
    for (int i = 0; i < runtime->commandsLen; i++)
    {  
       printf("%d\t\t", i);
-      Command *command = runtime->commands[i];
+      Command *command = &runtime->commands[i];
       int command_type = command->command_type;
       printf("%d\t\t\t", command->line_number);
       printf("%s\t\t", command_type_to_string(command_type));
       if (command_type == INT || command_type == SET || command_type == ADD || command_type == SUB || command_type == MULT || command_type == DIV || command_type == PRINT || command_type == IF || command_type == GOTO)
-         printf("%s\t\t", command->args[0]);
+         printf("%.*s\t\t", command->args[0].len, command->args[0].str);
       if (command_type == SET || command_type == ADD || command_type == SUB || command_type == MULT || command_type == DIV || command_type == PRINT || command_type == IF)
-         printf("%s\t\t", command->args[1]);
+         printf("%.*s\t\t", command->args[1].len, command->args[1].str);
       if (command_type == PRINT || command_type == IF)
-         printf("%s\t\t", command->args[2]);
+         printf("%.*s\t\t", command->args[2].len, command->args[2].str);
 
       printf("\n");
    }
@@ -624,566 +1266,2367 @@ void print_runtime(Runtime *runtime)
 
 # pragma endregion
 
-# pragma region Parser Functions
+# pragma region Optimizer Functions
 
-// Parse the line
-int parse_line(Runtime *runtime, int n, char *line)
+// Run the optimization passes selected by passes (OPT_* flags) over a compiled runtime, then verify it
+// Passes rewrite the compiled program in place and never change what the program prints or which errors it reports
+int optimize_runtime(Runtime *runtime, int passes)
 {
-   // Check if the line is NULL
-   if (line == NULL)
+   if (runtime == NULL || runtime->program == NULL)
    {
       return -1;
    }
 
-   int i = 0;
+   // Folding goes first as it works on the program as compiled, one instruction per command
+   if (passes & OPT_CONSTANTS)
+   {
+      if (fold_program(runtime) == -1)
+         return -1;
+   }
 
-   // Get tokens from the line
-   char *token = strtok(line, " ");
+   // Loops are found before fusing, fuse_program does not touch OP_LOOP
+   if (passes & OPT_LOOPS)
+   {
+      if (loop_program(runtime) == -1)
+         return -1;
+   }
 
-   // Initialize line number
-   int line_number;
+   if (passes & OPT_FUSE)
+   {
+      if (fuse_program(runtime) == -1)
+         return -1;
+   }
 
-   // Reference to the command
-   Command *command = runtime->commands[n];
+   // Verified last, on the instructions that run
+   verify_program(runtime);
 
-   // Iterate through the tokens
-   while (token != NULL)
-   {
-      // Remove the newline character from the token
-      if (token[strlen(token) - 1] == '\n')
-      {
-         token[strlen(token) - 1] = '\0';
-      }
+   return 1;
+}
 
-      // Check if the token is not a space or newline
-      if (isspace(*token) || *token == '\n')
-         continue;
+// Largest number of blocks times variables fold_program keeps state for, bigger programs are left as they are
+#define MAX_FOLD_STATES (1 << 22)
 
-      // Determine the line number of the command
-      if (i == 0)
-      {
-         // Check if the line number is an integer
-         int is_int = is_integer(token);
+// Basic blocks of a program, a block is a run of instructions that is only entered at its first instruction and
+// only leaves from its last one
+typedef struct
+{
+   int *start;
+   int *end;
+   int *block;
+   int len;
 
-         if (is_int == -1)
-         {
-            printf("Error at line %d: %s is not an integer\n", n, token);
-            return -1;
-         }
-         if (is_int == 2)
-         {
-            printf("Error at line %d: %s is not a positive integer\n", n, token);
-            return -1;
-         }
+   // 1 for blocks that can be reached from the entry
+   char *reachable;
+} Blocks;
 
-         // Convert the line number to an integer
-         line_number = atoi(token);
-         command->line_number = line_number;
+// Instructions control can go to after instruction i, returns how many there are
+static int next_instructions(Instruction *ins, int i, int next[2])
+{
+   if (ins->opcode == OP_HALT || ins->opcode == OP_TRAP)
+   {
+      return 0;
+   }
+   if (ins->opcode == OP_GOTO)
+   {
+      next[0] = ins->target;
+      return 1;
+   }
+
+   next[0] = i + 1;
+   if (ins->opcode >= OP_IF_EQ && ins->opcode <= OP_IF_LTE)
+   {
+      next[1] = ins->target;
+      return 2;
+   }
+   return 1;
+}
+
+// Split the program into basic blocks and find the ones reachable from the entry
+static int find_blocks(Runtime *runtime, Blocks *blocks)
+{
+   Instruction *program = runtime->program;
+   int n = runtime->programLen;
+
+   blocks->start = malloc(sizeof(int) * n);
+   blocks->end = malloc(sizeof(int) * n);
+   blocks->block = malloc(sizeof(int) * n);
+   blocks->reachable = calloc(n, 1);
+   char *leader = calloc(n, 1);
+   int *stack = malloc(sizeof(int) * n);
+   if (blocks->start == NULL || blocks->end == NULL || blocks->block == NULL || blocks->reachable == NULL || leader == NULL || stack == NULL)
+   {
+      free(leader);
+      free(stack);
+      return -1;
+   }
+
+   // Blocks start at the entry, at every jump target and after every jump or halt
+   leader[0] = 1;
+   leader[runtime->entry] = 1;
+   for (int i = 0; i < n; i++)
+   {
+      int next[2];
+      int count = next_instructions(&program[i], i, next);
+      if ((count != 1 || program[i].opcode == OP_GOTO) && i + 1 < n)
+         leader[i + 1] = 1;
+      for (int k = 0; k < count; k++)
+      {
+         if (next[k] != i + 1)
+            leader[next[k]] = 1;
       }
-      // Determine the type of command
-      else if (i == 1)
+   }
+
+   blocks->len = 0;
+   for (int i = 0; i < n; i++)
+   {
+      if (leader[i])
       {
-         int command_type = determine_command_type(token);
-         if (command_type == -1)
-         {
-            printf("Error at line %d: Invalid command\n", line_number);
-            return -1;
-         }
-         command->command_type = command_type;
+         if (blocks->len > 0)
+            blocks->end[blocks->len - 1] = i;
+         blocks->start[blocks->len++] = i;
+      }
+      blocks->block[i] = blocks->len - 1;
+   }
+   blocks->end[blocks->len - 1] = n;
 
-         // Set begin and end line numbers
-         if (command_type == BEGIN)
-         {
-            runtime->begin_line = line_number;
-            runtime->begin_flag = 1;
-         }
-         else if (command_type == END)
+   // Depth first search from the block holding the entry
+   int top = 0;
+   stack[top++] = blocks->block[runtime->entry];
+   blocks->reachable[stack[0]] = 1;
+   while (top > 0)
+   {
+      int b = stack[--top];
+      int last = blocks->end[b] - 1;
+      int next[2];
+      int count = next_instructions(&program[last], last, next);
+      for (int k = 0; k < count; k++)
+      {
+         int successor = blocks->block[next[k]];
+         if (!blocks->reachable[successor])
          {
-            runtime->end_line = line_number;
-            runtime->end_flag = 1;
+            blocks->reachable[successor] = 1;
+            stack[top++] = successor;
          }
       }
-      // Determine the arguments for the command
-      else
-      {
-         // Parse the arguments (subtracts 2 from i since the first two tokens are the line number and command type)
-         parse_arg(runtime, n, token, i - 2);
-      }
-
-      // Get the next token
-      token = strtok(NULL, " ");
-      i++;
    }
 
-   // Check if command has the correct number of arguments
-   if (check_arguments(command->command_type, i - 2, line_number) == -1)
-      return -1;
+   free(leader);
+   free(stack);
+   return 1;
+}
 
-   // If the command is an int command we have to add the int name to the array of int names and increment the length
-   if (command->command_type == INT)
-      runtime->intNames[runtime->intNamesLen++] = command->args[0];
+static void free_blocks(Blocks *blocks)
+{
+   free(blocks->start);
+   free(blocks->end);
+   free(blocks->block);
+   free(blocks->reachable);
+}
+
+// Result of an arithmetic instruction on a known value
+// Returns 0 for results that do not fit in an int, which are left to the overflow policy at run time, and for
+// divisions by zero, which are errors
+static int fold_arithmetic(int opcode, int value, int operand, int *result)
+{
+   long long folded;
+   switch (opcode)
+   {
+      case OP_ADD:
+         folded = (long long)value + operand;
+         break;
+      case OP_SUB:
+         folded = (long long)value - operand;
+         break;
+      case OP_MULT:
+         folded = (long long)value * operand;
+         break;
+      case OP_DIV:
+         if (operand == 0)
+            return 0;
+         folded = (long long)value / operand;
+         break;
+      default:
+         return 0;
+   }
+
+   if (folded < INT_MIN || folded > INT_MAX)
+      return 0;
 
+   *result = (int)folded;
    return 1;
 }
 
-// Parse an argument depending on the command type and the argument index (i)
-int parse_arg(Runtime *runtime, int n, char *token, int i)
+// Apply an instruction to the known values of the variables, known[v] is 1 when variable v is set to value[v]
+static void fold_step(Instruction *ins, char *known, int *value)
 {
-   if (runtime == NULL)
+   if (ins->opcode == OP_SET)
    {
-      return -1;
+      known[ins->a] = 1;
+      value[ins->a] = ins->b;
+   }
+   else if (ins->opcode >= OP_ADD && ins->opcode <= OP_DIV && known[ins->a])
+   {
+      known[ins->a] = fold_arithmetic(ins->opcode, value[ins->a], ins->b, &value[ins->a]);
+   }
+   else if (ins->opcode == OP_SET_VAR)
+   {
+      known[ins->a] = known[ins->b];
+      value[ins->a] = value[ins->b];
+   }
+   else if (ins->opcode >= OP_ADD_VAR && ins->opcode <= OP_DIV_VAR && known[ins->a])
+   {
+      known[ins->a] = known[ins->b] && fold_arithmetic(ins->opcode - OP_VAR_OFFSET, value[ins->a], value[ins->b], &value[ins->a]);
    }
+}
 
-   int line_number = runtime->commands[n]->line_number;
-   int command_type = runtime->commands[n]->command_type;
+// Constant slot for an operand whose value is known, or the operand itself
+static int fold_operand(Runtime *runtime, int slot, char *known, int *value)
+{
+   if (slot < runtime->intNamesLen && known[slot])
+      return constant_slot(runtime, value[slot]);
 
-   if (command_type == INT)
+   return slot;
+}
+
+// Variables live on leaving block b, the union of what is live on entry to its successors
+static void block_live_out(Instruction *program, Blocks *blocks, uint64_t *live_in, int words, int b, uint64_t *live)
+{
+   memset(live, 0, sizeof(uint64_t) * words);
+
+   int last = blocks->end[b] - 1;
+   int next[2];
+   int successors = next_instructions(&program[last], last, next);
+   for (int k = 0; k < successors; k++)
    {
-      // Check if the variable name is too long
-      if (strlen(token) > MAXVARNAME + 1)
+      uint64_t *s_live = &live_in[(size_t)blocks->block[next[k]] * words];
+      for (int w = 0; w < words; w++)
       {
-         printf("Error at line %d: Variable name %s is too long\n", line_number, token);
-         return -1;
+         live[w] |= s_live[w];
       }
+   }
+}
 
-      // Check if the variable is already defined
-      if (is_defined(runtime, token) >= 0)
-      {
-         printf("Error at line %d: Variable %s is already defined\n", line_number, token);
-         return -1;
-      }
+// Step backwards over an instruction, updating the variables that are live before it
+// Returns 0 for a set of a variable that is not read afterwards, 1 otherwise
+static int live_step(Instruction *ins, uint64_t *live, int vars)
+{
+   if (ins->opcode == OP_SET)
+   {
+      int read = TEST_BIT(live, ins->a);
+      CLEAR_BIT(live, ins->a);
+      return read;
+   }
 
-      // We have to make a copy of the variable name since strtok pointer is ever changing
-      char *var_name = malloc(sizeof(char) * (strlen(token) + 1));
-      strcpy(var_name, token);
+   // Arithmetic reads the variable it writes, and reports it when it is not set
+   if (ins->opcode >= OP_ADD && ins->opcode <= OP_DIV)
+   {
+      SET_BIT(live, ins->a);
+   }
 
-      // Set arg1
-      runtime->commands[n]->args[i] = var_name;
+   // A set from a variable reports the variable when it is not set, so it stays even when its result is never read
+   else if (ins->opcode == OP_SET_VAR)
+   {
+      CLEAR_BIT(live, ins->a);
+      SET_BIT(live, ins->b);
+   }
+   else if (ins->opcode >= OP_ADD_VAR && ins->opcode <= OP_DIV_VAR)
+   {
+      SET_BIT(live, ins->a);
+      SET_BIT(live, ins->b);
+   }
+   else if (ins->opcode == OP_PRINT || (ins->opcode >= OP_IF_EQ && ins->opcode <= OP_IF_LTE))
+   {
+      if (ins->a < vars)
+         SET_BIT(live, ins->a);
+      if (ins->b < vars)
+         SET_BIT(live, ins->b);
+   }
 
-      return 1;
+   return 1;
+}
+
+// Constant propagation and dead command elimination over the basic blocks of the program
+// Values known to be constant are folded into the instructions that use them: arithmetic on a known value becomes a
+// set, print and if operands become constant slots and an if between two constants becomes a goto or falls through
+// Afterwards sets that are never read, nops and unreachable instructions are removed and the program is compacted
+// A variable is only known once it is certainly set, so every read that could report an unset variable stays
+int fold_program(Runtime *runtime)
+{
+   if (runtime == NULL || runtime->program == NULL)
+   {
+      return -1;
    }
-   else if (command_type == SET || command_type == ADD || command_type == SUB || command_type == MULT || command_type == DIV)
+
+   Instruction *program = runtime->program;
+   int n = runtime->programLen;
+   int vars = runtime->intNamesLen;
+
+   // The pass needs the program as compiled, before any other pass
+   for (int i = 0; i < n; i++)
    {
-      // Handle the first argument
-      if (i == 0)
-      {
-         // Check if the variable name is too long
-         if (strlen(token) > MAXVARNAME + 1)
-         {
-            printf("Error at line %d: Variable name %s is too long\n", line_number, token);
-            return -1;
-         }
+      if (program[i].opcode >= OP_BRANCH_EQ && program[i].opcode <= OP_LOOP)
+         return 1;
+   }
 
-         // Check if the variable is already defined
-         if (is_defined(runtime, token) == -1)
-         {
-            printf("Error at line %d: Variable %s is not defined\n", line_number, token);
-            return -1;
-         }
+   Blocks blocks;
+   if (find_blocks(runtime, &blocks) == -1)
+   {
+      free_blocks(&blocks);
+      report("Error: Could not allocate memory for the constant folder\n");
+      return -1;
+   }
 
-         // We have to make a copy of the variable name since strtok pointer is ever changing
-         char *var_name = malloc(sizeof(char) * (strlen(token) + 1));
-         strcpy(var_name, token);
+   if ((long long)blocks.len * (vars + 1) > MAX_FOLD_STATES)
+   {
+      free_blocks(&blocks);
+      return 1;
+   }
 
-         // Set arg1
-         runtime->commands[n]->args[i] = var_name;
+   // Known values on entry to every block, a block is visited once something flows into it
+   size_t states = (size_t)blocks.len * vars + 1;
+   char *in_known = calloc(states, 1);
+   int *in_value = calloc(states, sizeof(int));
+   char *visited = calloc(blocks.len, 1);
+   int *queued = calloc(blocks.len, sizeof(int));
+   int *queue = malloc(sizeof(int) * (blocks.len + 1));
+   char *known = calloc(vars + 1, 1);
+   int *value = calloc(vars + 1, sizeof(int));
+   if (in_known == NULL || in_value == NULL || visited == NULL || queued == NULL || queue == NULL || known == NULL || value == NULL)
+   {
+      free(in_known);
+      free(in_value);
+      free(visited);
+      free(queued);
+      free(queue);
+      free(known);
+      free(value);
+      free_blocks(&blocks);
+      report("Error: Could not allocate memory for the constant folder\n");
+      return -1;
+   }
+
+   // Nothing is set when the program starts, the queue is circular with every block in it at most once
+   int head = 0;
+   int count = 0;
+   int entry = blocks.block[runtime->entry];
+   visited[entry] = 1;
+   queue[0] = entry;
+   queued[entry] = 1;
+   count = 1;
+
+   while (count > 0)
+   {
+      int b = queue[head];
+      head = (head + 1) % (blocks.len + 1);
+      count--;
+      queued[b] = 0;
+
+      memcpy(known, &in_known[(size_t)b * vars], vars);
+      memcpy(value, &in_value[(size_t)b * vars], sizeof(int) * vars);
+      for (int i = blocks.start[b]; i < blocks.end[b]; i++)
+      {
+         fold_step(&program[i], known, value);
       }
-      // Handle the second argument
-      else if (i == 1)
+
+      // Merge into the successors, a variable stays known only if it has the same value on every path
+      int last = blocks.end[b] - 1;
+      int next[2];
+      int successors = next_instructions(&program[last], last, next);
+      for (int k = 0; k < successors; k++)
       {
-         // Check if value is an integer
-         int is_int = is_integer(token);
+         int s = blocks.block[next[k]];
+         char *s_known = &in_known[(size_t)s * vars];
+         int *s_value = &in_value[(size_t)s * vars];
+         int changed = 0;
 
-         if (is_int == -1)
+         if (!visited[s])
          {
-            // Check if the value is a variable
-            if (is_defined(runtime, token) == -1)
+            memcpy(s_known, known, vars);
+            memcpy(s_value, value, sizeof(int) * vars);
+            visited[s] = 1;
+            changed = 1;
+         }
+         else
+         {
+            for (int v = 0; v < vars; v++)
             {
-               printf("Error at line %d: %s is not defined\n", n, token);
-               return -1;
+               if (s_known[v] && (!known[v] || s_value[v] != value[v]))
+               {
+                  s_known[v] = 0;
+                  changed = 1;
+               }
             }
          }
 
-         // Write copy of token to args[1]
-         char *val = malloc(sizeof(char) * strlen(token) + 1);
-         strcpy(val, token);
-
-         runtime->commands[n]->args[i] = val;
+         if (changed && !queued[s])
+         {
+            queue[(head + count) % (blocks.len + 1)] = s;
+            queued[s] = 1;
+            count++;
+         }
       }
-
-      return 1;
    }
-   else if (command_type == PRINT)
+
+   // Rewrite the instructions with what is known before each of them
+   int failed = 0;
+   for (int b = 0; b < blocks.len && !failed; b++)
    {
-      // Handle the first argument
-      if (i == 0)
+      if (!visited[b])
+         continue;
+
+      memcpy(known, &in_known[(size_t)b * vars], vars);
+      memcpy(value, &in_value[(size_t)b * vars], sizeof(int) * vars);
+      for (int i = blocks.start[b]; i < blocks.end[b]; i++)
       {
-         // Check if the variable name is too long
-         if (strlen(token) > MAXVARNAME + 1)
+         Instruction *ins = &program[i];
+         int result;
+
+         // A variable operand with a known value becomes an immediate, which may then fold below
+         if (ins->opcode >= OP_SET_VAR && ins->opcode <= OP_DIV_VAR && known[ins->b])
          {
-            printf("Error at line %d: Variable name %s is too long\n", line_number, token);
-            return -1;
+            ins->opcode -= OP_VAR_OFFSET;
+            ins->b = value[ins->b];
          }
 
-         // Check if the variable is already defined
-         if (is_defined(runtime, token) == -1)
+         if (ins->opcode >= OP_ADD && ins->opcode <= OP_DIV && known[ins->a] && fold_arithmetic(ins->opcode, value[ins->a], ins->b, &result))
          {
-            printf("Error at line %d: Variable %s is not defined\n", line_number, token);
-            return -1;
+            ins->opcode = OP_SET;
+            ins->b = result;
          }
-
-         // We have to make a copy of the variable name since strtok pointer is ever changing
-         char *var_name = malloc(sizeof(char) * (strlen(token) + 1));
-         strcpy(var_name, token);
-
-         // Set arg1
-         runtime->commands[n]->args[i] = var_name;
-      }
-      // Handle the second argument
-      else if (i == 1)
-      {
-         // Check if the variable name is too long
-         if (strlen(token) > MAXVARNAME + 1)
+         else if (ins->opcode == OP_PRINT || (ins->opcode >= OP_IF_EQ && ins->opcode <= OP_IF_LTE))
          {
-            printf("Error at line %d: Variable name %s is too long\n", line_number, token);
-            return -1;
+            int slot_a = fold_operand(runtime, ins->a, known, value);
+            int slot_b = fold_operand(runtime, ins->b, known, value);
+            if (slot_a == -1 || slot_b == -1)
+            {
+               failed = 1;
+               break;
+            }
+            ins->a = slot_a;
+            ins->b = slot_b;
          }
 
-         // Check if the variable is already defined
-         if (is_defined(runtime, token) == -1)
+         // An if between two constants always goes the same way
+         if (ins->opcode >= OP_IF_EQ && ins->opcode <= OP_IF_LTE && ins->a >= vars && ins->b >= vars &&
+             runtime->intNames[ins->a].str == NULL && runtime->intNames[ins->b].str == NULL)
          {
-            printf("Error at line %d: Variable %s is not defined\n", line_number, token);
-            return -1;
+            Value left = runtime->intValues[ins->a];
+            Value right = runtime->intValues[ins->b];
+            int taken = 0;
+            switch (ins->opcode)
+            {
+               case OP_IF_EQ: taken = left == right; break;
+               case OP_IF_NE: taken = left != right; break;
+               case OP_IF_GT: taken = left > right; break;
+               case OP_IF_GTE: taken = left >= right; break;
+               case OP_IF_LT: taken = left < right; break;
+               case OP_IF_LTE: taken = left <= right; break;
+            }
+            ins->opcode = taken ? OP_NOP : OP_GOTO;
          }
 
-         // We have to make a copy of the variable name since strtok pointer is ever changing
-         char *var_name = malloc(sizeof(char) * (strlen(token) + 1));
-         strcpy(var_name, token);
-
-         // Set arg1
-         runtime->commands[n]->args[i] = var_name;
+         fold_step(ins, known, value);
       }
-      // Handle the third argument
-      else if (i == 2)
-      {
-         // Write copy of token to args[2], this token cannot contain spaces since it was tokenized by spaces
-         char *val = malloc(sizeof(char) * strlen(token) + 1);
-         strcpy(val, token);
+   }
 
-         runtime->commands[n]->args[i] = val;
-      }
+   free(in_known);
+   free(in_value);
+   free(visited);
+   free(queued);
+   free(queue);
+   free(known);
+   free(value);
+   free_blocks(&blocks);
 
-      return 1;
+   if (failed)
+   {
+      return -1;
    }
-   else if (command_type == GOTO)
+
+   // Static ifs changed the control flow, so the blocks are found again for the liveness analysis
+   program = runtime->program;
+   if (find_blocks(runtime, &blocks) == -1)
    {
-      int is_int = is_integer(token);
+      free_blocks(&blocks);
+      report("Error: Could not allocate memory for the constant folder\n");
+      return -1;
+   }
 
-      if (is_int == -1)
-      {
-         printf("Error at line %d: %s is not an integer\n", n, token);
-         return -1;
-      }
+   // Variables that may be read before they are written again, on entry to every block
+   int words = BITSET_WORDS(vars);
+   uint64_t *live_in = calloc((size_t)blocks.len * words + 1, sizeof(uint64_t));
+   uint64_t *live = calloc(words + 1, sizeof(uint64_t));
+   char *keep = malloc(n);
+   int *map = malloc(sizeof(int) * n);
+   if (live_in == NULL || live == NULL || keep == NULL || map == NULL)
+   {
+      free(live_in);
+      free(live);
+      free(keep);
+      free(map);
+      free_blocks(&blocks);
+      report("Error: Could not allocate memory for the constant folder\n");
+      return -1;
+   }
 
-      if (is_int == 2)
+   // Iterate backwards over the blocks until nothing changes
+   int changed = 1;
+   while (changed)
+   {
+      changed = 0;
+      for (int b = blocks.len - 1; b >= 0; b--)
       {
-         printf("Error at line %d: %s is not a positive integer\n", n, token);
-         return -1;
-      }
+         if (!blocks.reachable[b])
+            continue;
 
-      // We have to make a copy of the variable name since strtok pointer is ever changing
-      char *val = malloc(sizeof(char) * (strlen(token) + 1));
-      strcpy(val, token);
-
-      // Set arg1
-      runtime->commands[n]->args[i] = val;
+         block_live_out(program, &blocks, live_in, words, b, live);
+         for (int i = blocks.end[b] - 1; i >= blocks.start[b]; i--)
+         {
+            live_step(&program[i], live, vars);
+         }
 
-      return 1;
+         uint64_t *b_live = &live_in[(size_t)b * words];
+         for (int w = 0; w < words; w++)
+         {
+            if (b_live[w] != live[w])
+            {
+               b_live[w] = live[w];
+               changed = 1;
+            }
+         }
+      }
    }
-   else if (command_type == IF)
+
+   // Mark what stays, the halt sentinels always do
+   for (int b = 0; b < blocks.len; b++)
    {
-      // Handle the first argument
-      if (i == 0)
+      if (!blocks.reachable[b])
       {
-         // Check if the variable name is too long
-         if (strlen(token) > MAXVARNAME + 1)
+         for (int i = blocks.start[b]; i < blocks.end[b]; i++)
          {
-            printf("Error at line %d: Variable name %s is too long\n", line_number, token);
-            return -1;
+            keep[i] = 0;
          }
-
-         // We have to make a copy of the variable name since strtok pointer is ever changing
-         char *var_name = malloc(sizeof(char) * (strlen(token) + 1));
-         strcpy(var_name, token);
-
-         // Set arg1
-         runtime->commands[n]->args[i] = var_name;
+         continue;
       }
-      // Handle the second argument
-      else if (i == 1)
-      {
-         // We have to make a copy of the variable name since strtok pointer is ever changing
-         char *op = malloc(sizeof(char) * (strlen(token) + 1));
-         strcpy(op, token);
 
-         // Check if the operator is valid
-         if (strcmp(op, "eq") == 0 || strcmp(op, "ne") == 0 || strcmp(op, "gt") == 0 || strcmp(op, "gte") == 0 || strcmp(op, "lt") == 0 || strcmp(op, "lte") == 0)
+      block_live_out(program, &blocks, live_in, words, b, live);
+      for (int i = blocks.end[b] - 1; i >= blocks.start[b]; i--)
+      {
+         keep[i] = live_step(&program[i], live, vars) && program[i].opcode != OP_NOP;
+      }
+   }
+   keep[n - 2] = 1;
+   keep[n - 1] = 1;
+
+   // A removed instruction maps to the next one that stays, which is where control would have ended up
+   int len = 0;
+   for (int i = 0; i < n; i++)
+   {
+      len += keep[i];
+   }
+   int next_kept = len;
+   for (int i = n - 1; i >= 0; i--)
+   {
+      if (keep[i])
+         next_kept--;
+      map[i] = next_kept;
+   }
+
+   Instruction *compacted = arena_alloc(&runtime->arena, sizeof(Instruction) * len);
+   if (compacted == NULL)
+   {
+      free(live_in);
+      free(live);
+      free(keep);
+      free(map);
+      free_blocks(&blocks);
+      report("Error: Could not allocate memory for program\n");
+      return -1;
+   }
+
+   for (int i = 0; i < n; i++)
+   {
+      if (!keep[i])
+         continue;
+
+      Instruction *ins = &compacted[map[i]];
+      *ins = program[i];
+      if (ins->opcode == OP_GOTO || (ins->opcode >= OP_IF_EQ && ins->opcode <= OP_IF_LTE))
+         ins->target = map[ins->target];
+      else
+         ins->target = map[i] + 1;
+   }
+
+   runtime->program = compacted;
+   runtime->programLen = len;
+   runtime->entry = map[runtime->entry];
+
+   free(live_in);
+   free(live);
+   free(keep);
+   free(map);
+   free_blocks(&blocks);
+
+   return 1;
+}
+
+// Peephole pass that writes superinstructions over the first instruction of if/goto and add/if/goto sequences
+// Only the first instruction of a sequence is replaced, the rest stay as they were, so a goto that lands in the middle
+// of a sequence runs the remaining instructions on their own exactly as before
+int fuse_program(Runtime *runtime)
+{
+   if (runtime == NULL || runtime->program == NULL)
+   {
+      return -1;
+   }
+
+   Instruction *program = runtime->program;
+
+   // The last two instructions are the halt sentinels, so i + 2 is always in range below
+   // A false if has to land right after the goto, which fold_program may have changed by removing instructions
+   for (int i = 0; i < runtime->programLen - 2; i++)
+   {
+      Instruction *ins = &program[i];
+      Instruction *next = &program[i + 1];
+
+      // add, if, goto: the target of the add-branch is the target of the goto
+      // The if operands are read from the instruction after it at run time, see ADD_BRANCH in execute.h
+      if (ins->opcode == OP_ADD && next->opcode >= OP_IF_EQ && next->opcode <= OP_IF_LTE && next->target == i + 3 && program[i + 2].opcode == OP_GOTO)
+      {
+         ins->opcode = OP_ADD_BRANCH_EQ + (next->opcode - OP_IF_EQ);
+         ins->target = program[i + 2].target;
+      }
+      // if, goto: a true expression jumps to the target of the goto, a false one skips over it
+      // The if after a fused add is still an if when the loop gets to it, so it is fused as well
+      else if (ins->opcode >= OP_IF_EQ && ins->opcode <= OP_IF_LTE && ins->target == i + 2 && next->opcode == OP_GOTO)
+      {
+         ins->opcode = OP_BRANCH_EQ + (ins->opcode - OP_IF_EQ);
+         ins->target = next->target;
+      }
+   }
+
+   return 1;
+}
+
+// Longest loop body loop_program looks at, keeps the partial sums of the changes well inside a long long
+#define MAX_LOOP_BODY (1 << 20)
+
+// Find counted loops and replace the first instruction of each with OP_LOOP
+// A loop is a goto back to an earlier instruction, preceded by an if, where everything in between is an add or a sub
+// and the if compares at most one variable the body changes; nothing in the body prints, jumps or divides
+// The instructions of the body stay in place, so jumps into the middle of the loop and loops that can not be computed
+// when they are reached run exactly as before
+int loop_program(Runtime *runtime)
+{
+   if (runtime == NULL || runtime->program == NULL)
+   {
+      return -1;
+   }
+
+   Instruction *program = runtime->program;
+
+   // Position of each slot in the loop being looked at, -1 when the body does not change it
+   int *position = malloc(sizeof(int) * (runtime->intValuesLen + 1));
+   if (position == NULL)
+   {
+      report("Error: Could not allocate memory for the loop optimizer\n");
+      return -1;
+   }
+   for (int i = 0; i < runtime->intValuesLen; i++)
+   {
+      position[i] = -1;
+   }
+
+   for (int g = 0; g < runtime->programLen - 2; g++)
+   {
+      Instruction *jump = &program[g];
+      int top = jump->target;
+      if (jump->opcode != OP_GOTO || top > g - 2 || g - top > MAX_LOOP_BODY)
+         continue;
+
+      // A false if has to leave the loop
+      Instruction *test = &program[g - 1];
+      if (test->opcode < OP_IF_EQ || test->opcode > OP_IF_LTE || test->target != g + 1)
+         continue;
+
+      // The body has to be nothing but adds and subs, a head replaced by an earlier loop does not count
+      int body = 1;
+      for (int i = top; i < g - 1 && body; i++)
+      {
+         body = program[i].opcode == OP_ADD || program[i].opcode == OP_SUB;
+      }
+      if (!body)
+         continue;
+
+      // Count the variables changed by the body
+      int len = 0;
+      for (int i = top; i < g - 1; i++)
+      {
+         if (position[program[i].a] == -1)
+            position[program[i].a] = len++;
+      }
+
+      // When the body changes neither operand the left one is treated as a counter that does not move
+      int counter = -1;
+      int limit = -1;
+      int compare = test->opcode;
+      if (position[test->b] == -1)
+      {
+         counter = test->a;
+         limit = test->b;
+      }
+      else if (position[test->a] == -1)
+      {
+         // Mirror the comparison so the counter is on the left
+         counter = test->b;
+         limit = test->a;
+         if (compare == OP_IF_GT)
+            compare = OP_IF_LT;
+         else if (compare == OP_IF_GTE)
+            compare = OP_IF_LTE;
+         else if (compare == OP_IF_LT)
+            compare = OP_IF_GT;
+         else if (compare == OP_IF_LTE)
+            compare = OP_IF_GTE;
+      }
+
+      if (counter != -1)
+      {
+         if (runtime->loopsLen == runtime->loopsCapacity)
          {
-            // Set arg1
-            runtime->commands[n]->args[i] = op;
+            int capacity = runtime->loopsCapacity ? runtime->loopsCapacity * 2 : 8;
+            Loop *loops = arena_grow(&runtime->arena, runtime->loops, sizeof(Loop) * runtime->loopsCapacity, sizeof(Loop) * capacity);
+            if (loops == NULL)
+            {
+               free(position);
+               report("Error: Could not allocate memory for the loop optimizer\n");
+               return -1;
+            }
+            runtime->loops = loops;
+            runtime->loopsCapacity = capacity;
          }
-         else
+
+         Loop *loop = &runtime->loops[runtime->loopsLen];
+         loop->slots = arena_alloc(&runtime->arena, sizeof(int) * len);
+         loop->deltas = arena_alloc(&runtime->arena, sizeof(long long) * len);
+         loop->lows = arena_alloc(&runtime->arena, sizeof(long long) * len);
+         loop->highs = arena_alloc(&runtime->arena, sizeof(long long) * len);
+         if (loop->slots == NULL || loop->deltas == NULL || loop->lows == NULL || loop->highs == NULL)
          {
-            printf("Error at line %d: Invalid operator %s\n", line_number, op);
+            free(position);
+            report("Error: Could not allocate memory for the loop optimizer\n");
             return -1;
          }
+
+         for (int k = 0; k < len; k++)
+         {
+            loop->deltas[k] = 0;
+            loop->lows[k] = 0;
+            loop->highs[k] = 0;
+         }
+
+         // Sum up the changes in order, tracking how far each variable strays within an iteration
+         for (int i = top; i < g - 1; i++)
+         {
+            int k = position[program[i].a];
+            loop->slots[k] = program[i].a;
+            loop->deltas[k] += program[i].opcode == OP_ADD ? (long long)program[i].b : -(long long)program[i].b;
+            if (loop->deltas[k] < loop->lows[k])
+               loop->lows[k] = loop->deltas[k];
+            if (loop->deltas[k] > loop->highs[k])
+               loop->highs[k] = loop->deltas[k];
+         }
+
+         loop->head = program[top];
+         loop->counter = counter;
+         loop->limit = limit;
+         loop->compare = compare;
+         loop->exit = g + 1;
+         loop->len = len;
+
+         program[top].opcode = OP_LOOP;
+         program[top].b = runtime->loopsLen;
+         runtime->loopsLen++;
       }
-      // Handle the third argument
-      else if (i == 2)
+
+      // Clear the positions for the next loop, OP_LOOP keeps the slot of the instruction it replaced in a
+      for (int i = top; i < g - 1; i++)
       {
-         // Check if the variable name is too long
-         if (strlen(token) > MAXVARNAME + 1)
+         position[program[i].a] = -1;
+      }
+   }
+
+   free(position);
+   return 1;
+}
+
+// Number of iterations of a loop whose counter starts at start and changes by step every iteration, running until
+// compare (counter on the left) with limit is false after an iteration, counting the first iteration that always runs
+// The arithmetic is done in 128 bits, as 64 bit values negated or stepped past the limit do not fit in a long long
+// Returns -1 when the loop would only end by overflowing the counter, or never, or when start, step or limit are at
+// the extremes of a long long
+long long loop_trip_count(long long start, long long step, long long limit, int compare)
+{
+   if (start == LLONG_MIN || start == LLONG_MAX || step == LLONG_MIN || step == LLONG_MAX ||
+       limit == LLONG_MIN || limit == LLONG_MAX)
+      return -1;
+
+   __int128 from = start;
+   __int128 by = step;
+   __int128 to = limit;
+
+   // Turn greater than into less than by negating everything, and lte into lt
+   if (compare == OP_IF_GT || compare == OP_IF_GTE)
+   {
+      from = -from;
+      by = -by;
+      to = -to;
+      compare = compare == OP_IF_GT ? OP_IF_LT : OP_IF_LTE;
+   }
+   if (compare == OP_IF_LTE)
+   {
+      to++;
+      compare = OP_IF_LT;
+   }
+
+   __int128 first = from + by;
+   __int128 count;
+
+   switch (compare)
+   {
+      case OP_IF_LT:
+      {
+         if (first >= to)
+            return 1;
+         if (by <= 0)
+            return -1;
+         count = (to - from + by - 1) / by;
+         break;
+      }
+      case OP_IF_NE:
+      {
+         if (first == to)
+            return 1;
+         if (by == 0 || (to - from) % by != 0 || (to - from) / by < 1)
+            return -1;
+         count = (to - from) / by;
+         break;
+      }
+      case OP_IF_EQ:
+      {
+         if (first != to)
+            return 1;
+         if (by == 0)
+            return -1;
+         return 2;
+      }
+      default:
+      {
+         return -1;
+      }
+   }
+
+   return count > LLONG_MAX ? -1 : (long long)count;
+}
+
+// Run a loop found by loop_program, returns 1 when the values after the loop have been computed and 0 when the
+// loop has to be stepped through instead because a variable is not set, it would overflow or it does not end
+int run_loop(Runtime *runtime, Loop *loop)
+{
+   Value *values = runtime->intValues;
+   uint64_t *set = runtime->intValuesSet;
+
+   // Unset variables are reported by the instructions themselves
+   for (int k = 0; k < loop->len; k++)
+   {
+      if (!TEST_BIT(set, loop->slots[k]))
+         return 0;
+   }
+   if (!TEST_BIT(set, loop->counter) || !TEST_BIT(set, loop->limit))
+      return 0;
+
+   // A counter the body does not change has a step of 0
+   long long step = 0;
+   for (int k = 0; k < loop->len; k++)
+   {
+      if (loop->slots[k] == loop->counter)
+         step = loop->deltas[k];
+   }
+
+   long long iterations = loop_trip_count(values[loop->counter], step, values[loop->limit], loop->compare);
+   if (iterations == -1)
+      return 0;
+
+   // Keep the products below well inside a long long, loops this long overflow anything they change anyway
+   if (iterations > INT32_MAX)
+      return 0;
+
+   // Every value the variables take on has to fit in a Value, the extremes are reached in the first or last iteration
+   // Anything that would overflow is left to the loop run line by line, under the overflow policy
+   for (int k = 0; k < loop->len; k++)
+   {
+      long long value = values[loop->slots[k]];
+      long long delta = loop->deltas[k];
+      if (delta > INT32_MAX || delta < INT32_MIN)
+         return 0;
+
+      long long before_last, low, high;
+      if (__builtin_mul_overflow(iterations - 1, delta, &before_last) || __builtin_add_overflow(value, before_last, &before_last))
+         return 0;
+      if (__builtin_add_overflow(value < before_last ? value : before_last, loop->lows[k], &low) ||
+          __builtin_add_overflow(value > before_last ? value : before_last, loop->highs[k], &high))
+         return 0;
+      if (low < VALUE_MIN || high > VALUE_MAX)
+         return 0;
+   }
+
+   for (int k = 0; k < loop->len; k++)
+   {
+      values[loop->slots[k]] = (Value)(values[loop->slots[k]] + iterations * loop->deltas[k]);
+   }
+
+   return 1;
+}
+
+// Optimization flag for a pass name given on the command line, or -1 if there is no such pass
+int optimization_from_name(const char *name)
+{
+   if (strcmp(name, "fuse") == 0)
+   {
+      return OPT_FUSE;
+   }
+   else if (strcmp(name, "loops") == 0)
+   {
+      return OPT_LOOPS;
+   }
+   else if (strcmp(name, "constants") == 0)
+   {
+      return OPT_CONSTANTS;
+   }
+   else if (strcmp(name, "all") == 0)
+   {
+      return OPT_ALL;
+   }
+   else
+   {
+      return -1;
+   }
+}
+
+# pragma endregion
+
+# pragma region Parser Functions
+
+// Parse the line, in one pass that splits it into tokens as it goes
+int parse_line(Runtime *runtime, int n, const char *line, int len)
+{
+   // Check if the line is NULL
+   if (line == NULL)
+   {
+      return -1;
+   }
+
+   int i = 0;
+
+   // Initialize line number
+   int line_number = 0;
+
+   // Reference to the command
+   Command *command = &runtime->commands[n];
+   command->line_number = 0;
+   command->command_type = -1;
+   for (int j = 0; j < 3; j++)
+   {
+      command->args[j].str = NULL;
+      command->args[j].len = 0;
+   }
+
+   const char *c = line;
+   const char *end = line + len;
+
+   // Iterate through the tokens
+   while (1)
+   {
+      // Skip the whitespace separating the tokens
+      while (c < end && IS_BLANK(*c))
+         c++;
+
+      if (c == end)
+         break;
+
+      // Get the next token
+      Token token;
+      token.str = c;
+      while (c < end && !IS_BLANK(*c))
+         c++;
+      token.len = c - token.str;
+
+      // Determine the line number of the command
+      if (i == 0)
+      {
+         // Check if the line number is an integer, converting it on the way
+         int is_int = scan_integer(token, &line_number);
+
+         if (is_int == -1)
+         {
+            report("Error at line %d: %.*s is not an integer\n", n, token.len, token.str);
+            return -1;
+         }
+         if (is_int == 2)
          {
-            printf("Error at line %d: Variable name %s is too long\n", line_number, token);
+            report("Error at line %d: %.*s is not a positive integer\n", n, token.len, token.str);
             return -1;
          }
 
-         // We have to make a copy of the variable name since strtok pointer is ever changing
-         char *var_name = malloc(sizeof(char) * (strlen(token) + 1));
-         strcpy(var_name, token);
+         command->line_number = line_number;
+      }
+      // Determine the type of command
+      else if (i == 1)
+      {
+         int command_type = determine_command_type(token);
+         if (command_type == -1)
+         {
+            report("Error at line %d: Invalid command\n", line_number);
+            return -1;
+         }
+         command->command_type = command_type;
 
-         // Set arg2
-         runtime->commands[n]->args[i] = var_name;
+         // Set begin and end line numbers
+         if (command_type == BEGIN)
+         {
+            runtime->begin_line = line_number;
+            runtime->begin_flag = 1;
+         }
+         else if (command_type == END)
+         {
+            runtime->end_line = line_number;
+            runtime->end_flag = 1;
+         }
+      }
+      // Determine the arguments for the command, extra arguments are only counted for check_arguments
+      else if (i - 2 < 3)
+      {
+         // Parse the arguments (subtracts 2 from i since the first two tokens are the line number and command type)
+         if (parse_arg(runtime, n, token, i - 2) == -1)
+            return -1;
       }
 
-      return 1;
+      i++;
    }
-   else
+
+   // Check if command has the correct number of arguments
+   if (check_arguments(command->command_type, i - 2, line_number) == -1)
+      return -1;
+
+   // If the command is an int command we have to add the int name to the array of int names and the symbol table
+   if (command->command_type == INT)
+      return declare_variable(runtime, command->args[0]);
+
+   return 1;
+}
+
+// Add a variable declared by an int command to the array of int names and the symbol table
+int declare_variable(Runtime *runtime, Token name)
+{
+   if (grow_variables(runtime, runtime->intNamesLen + 1) == -1 || define_symbol(runtime, name, runtime->intNamesLen) == -1)
+   {
+      report("Error: Could not allocate memory for variables\n");
+      return -1;
+   }
+
+   runtime->intNames[runtime->intNamesLen] = name;
+   runtime->intNamesLen++;
+   return 1;
+}
+
+// Parse an argument depending on the command type and the argument index (i)
+// Arguments are kept as views into the source, nothing is copied
+int parse_arg(Runtime *runtime, int n, Token token, int i)
+{
+   if (runtime == NULL)
    {
-      printf("Error at line %d: Invalid command\n", line_number);
       return -1;
    }
+
+   int line_number = runtime->commands[n].line_number;
+   int command_type = runtime->commands[n].command_type;
+
+   if (command_type == INT)
+   {
+      // Check if the variable name is too long
+      if (token.len > MAXVARNAME + 1)
+      {
+         report("Error at line %d: Variable name %.*s is too long\n", line_number, token.len, token.str);
+         return -1;
+      }
+
+      // Check if the variable is already defined
+      if (is_defined(runtime, token) >= 0)
+      {
+         report("Error at line %d: Variable %.*s is already defined\n", line_number, token.len, token.str);
+         return -1;
+      }
+
+      // Set arg1
+      runtime->commands[n].args[i] = token;
+
+      return 1;
+   }
+   else if (command_type == SET || command_type == ADD || command_type == SUB || command_type == MULT || command_type == DIV)
+   {
+      // Handle the first argument
+      if (i == 0)
+      {
+         // Check if the variable name is too long
+         if (token.len > MAXVARNAME + 1)
+         {
+            report("Error at line %d: Variable name %.*s is too long\n", line_number, token.len, token.str);
+            return -1;
+         }
+
+         // Check if the variable is already defined
+         if (is_defined(runtime, token) == -1)
+         {
+            report("Error at line %d: Variable %.*s is not defined\n", line_number, token.len, token.str);
+            return -1;
+         }
+
+         // Set arg1
+         runtime->commands[n].args[i] = token;
+      }
+      // Handle the second argument
+      else if (i == 1)
+      {
+         // Check if value is an integer
+         int is_int = is_integer(token);
+
+         if (is_int == -1)
+         {
+            // Check if the value is a variable
+            if (is_defined(runtime, token) == -1)
+            {
+               report("Error at line %d: %.*s is not defined\n", n, token.len, token.str);
+               return -1;
+            }
+         }
+
+         runtime->commands[n].args[i] = token;
+      }
+
+      return 1;
+   }
+   else if (command_type == PRINT)
+   {
+      // Handle the first and second arguments
+      if (i == 0 || i == 1)
+      {
+         // Check if the variable name is too long
+         if (token.len > MAXVARNAME + 1)
+         {
+            report("Error at line %d: Variable name %.*s is too long\n", line_number, token.len, token.str);
+            return -1;
+         }
+
+         // Check if the variable is already defined
+         if (is_defined(runtime, token) == -1)
+         {
+            report("Error at line %d: Variable %.*s is not defined\n", line_number, token.len, token.str);
+            return -1;
+         }
+
+         runtime->commands[n].args[i] = token;
+      }
+      // Handle the third argument
+      else if (i == 2)
+      {
+         // This token cannot contain spaces since it was tokenized by spaces
+         runtime->commands[n].args[i] = token;
+      }
+
+      return 1;
+   }
+   else if (command_type == GOTO)
+   {
+      int is_int = is_integer(token);
+
+      if (is_int == -1)
+      {
+         report("Error at line %d: %.*s is not an integer\n", n, token.len, token.str);
+         return -1;
+      }
+
+      if (is_int == 2)
+      {
+         report("Error at line %d: %.*s is not a positive integer\n", n, token.len, token.str);
+         return -1;
+      }
+
+      // Set arg1
+      runtime->commands[n].args[i] = token;
+
+      return 1;
+   }
+   else if (command_type == IF)
+   {
+      // Handle the first and third arguments
+      if (i == 0 || i == 2)
+      {
+         // Check if the variable name is too long
+         if (token.len > MAXVARNAME + 1)
+         {
+            report("Error at line %d: Variable name %.*s is too long\n", line_number, token.len, token.str);
+            return -1;
+         }
+
+         runtime->commands[n].args[i] = token;
+      }
+      // Handle the second argument
+      else if (i == 1)
+      {
+         // Check if the operator is valid
+         if (determine_if_opcode(token) == -1)
+         {
+            report("Error at line %d: Invalid operator %.*s\n", line_number, token.len, token.str);
+            return -1;
+         }
+
+         runtime->commands[n].args[i] = token;
+      }
+
+      return 1;
+   }
+   else
+   {
+      report("Error at line %d: Invalid command\n", line_number);
+      return -1;
+   }
+}
+
+# pragma endregion
+
+# pragma region Helper Functions
+
+// FNV-1a hash of a variable name
+unsigned int hash_name(Token name)
+{
+   unsigned int hash = 2166136261u;
+   for (int i = 0; i < name.len; i++)
+   {
+      hash ^= (unsigned char)name.str[i];
+      hash *= 16777619u;
+   }
+   return hash;
+}
+
+// Insert a hash and index into a symbol table using linear probing
+static void insert_symbol(Symbol *symbols, int capacity, unsigned int hash, int index)
+{
+   unsigned int mask = capacity - 1;
+   unsigned int i = hash & mask;
+   while (symbols[i].index != -1)
+   {
+      i = (i + 1) & mask;
+   }
+
+   symbols[i].hash = hash;
+   symbols[i].index = index;
+}
+
+// Add a variable name to the symbol table, doubling the table to keep it less than half full
+int define_symbol(Runtime *runtime, Token arg, int index)
+{
+   if ((runtime->symbolsLen + 1) * 2 > runtime->symbolsCapacity)
+   {
+      int capacity = runtime->symbolsCapacity * 2;
+      Symbol *symbols = arena_alloc(&runtime->arena, sizeof(Symbol) * capacity);
+      if (symbols == NULL)
+         return -1;
+
+      for (int i = 0; i < capacity; i++)
+         symbols[i].index = -1;
+
+      // Rehash using the stored hashes
+      for (int i = 0; i < runtime->symbolsCapacity; i++)
+      {
+         if (runtime->symbols[i].index != -1)
+            insert_symbol(symbols, capacity, runtime->symbols[i].hash, runtime->symbols[i].index);
+      }
+
+      runtime->symbols = symbols;
+      runtime->symbolsCapacity = capacity;
+   }
+
+   insert_symbol(runtime->symbols, runtime->symbolsCapacity, hash_name(arg), index);
+   runtime->symbolsLen++;
+   return 1;
+}
+
+// Check if the variable is defined, return the index of the variable if it is defined
+int is_defined(Runtime *runtime, Token arg)
+{
+   unsigned int hash = hash_name(arg);
+   unsigned int mask = runtime->symbolsCapacity - 1;
+
+   // Probe until we find the name or an empty entry
+   for (unsigned int i = hash & mask; runtime->symbols[i].index != -1; i = (i + 1) & mask)
+   {
+      Symbol *symbol = &runtime->symbols[i];
+      Token name = runtime->intNames[symbol->index];
+      if (symbol->hash == hash && name.len == arg.len && memcmp(name.str, arg.str, arg.len) == 0)
+      {
+         return symbol->index;
+      }
+   }
+   return -1;
+}
+
+// Check if the value of the variable is set, and return the index of the variable
+int is_set(Runtime *runtime, Token arg)
+{
+   int index = is_defined(runtime, arg);
+
+   // Check if the variable is set
+   if (index >= 0 && TEST_BIT(runtime->intValuesSet, index))
+   {
+      return index;
+   }
+
+   // Variable is not set
+   return -1;
+}
+
+// Append a slot after the variables in intValues and return its index
+// Constant slots have no name and are always set, undefined names get a slot that is never set
+int add_slot(Runtime *runtime, Token name, int value, int set)
+{
+   int index = runtime->intValuesLen;
+   if (grow_variables(runtime, index + 1) == -1)
+   {
+      report("Error: Could not allocate memory for variables\n");
+      return -1;
+   }
+
+   runtime->intValuesLen++;
+   runtime->intNames[index] = name;
+   runtime->intValues[index] = value;
+   if (set)
+      SET_BIT(runtime->intValuesSet, index);
+
+   return index;
+}
+
+// Make sure there is room for at least needed entries in intNames, intValues and intValuesSet
+// Capacity doubles so parsing n variables costs O(n) copies overall
+int grow_variables(Runtime *runtime, int needed)
+{
+   if (needed <= runtime->intCapacity)
+   {
+      return 1;
+   }
+
+   int capacity = runtime->intCapacity > 0 ? runtime->intCapacity : INITIAL_VARIABLES;
+   while (capacity < needed)
+      capacity *= 2;
+
+   Token *names = arena_grow(&runtime->arena, runtime->intNames, sizeof(Token) * runtime->intCapacity, sizeof(Token) * capacity);
+   if (names == NULL)
+      return -1;
+   runtime->intNames = names;
+
+   Value *values = arena_grow(&runtime->arena, runtime->intValues, sizeof(Value) * runtime->intCapacity, sizeof(Value) * capacity);
+   if (values == NULL)
+      return -1;
+   runtime->intValues = values;
+
+   uint64_t *set = arena_grow(&runtime->arena, runtime->intValuesSet, sizeof(uint64_t) * BITSET_WORDS(runtime->intCapacity), sizeof(uint64_t) * BITSET_WORDS(capacity));
+   if (set == NULL)
+      return -1;
+   runtime->intValuesSet = set;
+
+   // New set flags start cleared
+   int old_words = BITSET_WORDS(runtime->intCapacity);
+   memset(set + old_words, 0, sizeof(uint64_t) * (BITSET_WORDS(capacity) - old_words));
+
+   runtime->intCapacity = capacity;
+   return 1;
+}
+
+// Resolve an if operand to a variable, a constant slot or a slot for an undefined name
+int resolve_operand(Runtime *runtime, Token arg)
+{
+   // Check if the operand is a variable
+   int index = is_defined(runtime, arg);
+   if (index >= 0)
+   {
+      return index;
+   }
+
+   int value;
+   if (scan_integer(arg, &value) != -1)
+   {
+      return constant_slot(runtime, value);
+   }
+
+   // Reuse an existing slot for the same undefined name
+   for (int i = runtime->intNamesLen; i < runtime->intValuesLen; i++)
+   {
+      Token name = runtime->intNames[i];
+      if (name.str != NULL && name.len == arg.len && memcmp(name.str, arg.str, arg.len) == 0)
+         return i;
+   }
+
+   // The error is reported when the if is executed
+   return add_slot(runtime, arg, 0, 0);
+}
+
+// Hash of a constant in the constant table
+static unsigned int hash_constant(int value)
+{
+   return (unsigned int)value * 2654435761u;
+}
+
+// Rebuild the constant table with room for one more constant, keeping it less than half full
+// The table is built from the constant slots themselves, so a runtime loaded from the cache gets one on first use
+static int grow_constants(Runtime *runtime)
+{
+   int needed = 1;
+   for (int i = runtime->intNamesLen; i < runtime->intValuesLen; i++)
+   {
+      if (runtime->intNames[i].str == NULL)
+         needed++;
+   }
+
+   int capacity = runtime->constantsCapacity > 0 ? runtime->constantsCapacity : INITIAL_SYMBOLS;
+   while (needed * 2 > capacity)
+      capacity *= 2;
+
+   Symbol *constants = arena_alloc(&runtime->arena, sizeof(Symbol) * capacity);
+   if (constants == NULL)
+      return -1;
+
+   for (int i = 0; i < capacity; i++)
+      constants[i].index = -1;
+
+   runtime->constantsLen = 0;
+   for (int i = runtime->intNamesLen; i < runtime->intValuesLen; i++)
+   {
+      if (runtime->intNames[i].str == NULL)
+      {
+         insert_symbol(constants, capacity, hash_constant(runtime->intValues[i]), i);
+         runtime->constantsLen++;
+      }
+   }
+
+   runtime->constants = constants;
+   runtime->constantsCapacity = capacity;
+   return 1;
+}
+
+// Find or add the constant slot holding value
+int constant_slot(Runtime *runtime, int value)
+{
+   if (runtime->constants == NULL || (runtime->constantsLen + 1) * 2 > runtime->constantsCapacity)
+   {
+      if (grow_constants(runtime) == -1)
+      {
+         report("Error: Could not allocate memory for variables\n");
+         return -1;
+      }
+   }
+
+   unsigned int hash = hash_constant(value);
+   unsigned int mask = runtime->constantsCapacity - 1;
+   for (unsigned int i = hash & mask; runtime->constants[i].index != -1; i = (i + 1) & mask)
+   {
+      Symbol *constant = &runtime->constants[i];
+      if (constant->hash == hash && runtime->intValues[constant->index] == value)
+         return constant->index;
+   }
+
+   Token none = {NULL, 0};
+   int index = add_slot(runtime, none, value, 1);
+   if (index == -1)
+      return -1;
+
+   insert_symbol(runtime->constants, runtime->constantsCapacity, hash, index);
+   runtime->constantsLen++;
+   return index;
+}
+
+// Determine the opcode of an if command from its operator, like determine_command_type
+int determine_if_opcode(Token op)
+{
+   const char *str = op.str;
+
+   if (op.len == 2)
+   {
+      switch (str[0])
+      {
+         case 'e':
+            return str[1] == 'q' ? OP_IF_EQ : -1;
+         case 'n':
+            return str[1] == 'e' ? OP_IF_NE : -1;
+         case 'g':
+            return str[1] == 't' ? OP_IF_GT : -1;
+         case 'l':
+            return str[1] == 't' ? OP_IF_LT : -1;
+         default:
+            return -1;
+      }
+   }
+
+   if (op.len == 3 && str[2] == 'e')
+   {
+      if (str[0] == 'g' && str[1] == 't')
+         return OP_IF_GTE;
+      if (str[0] == 'l' && str[1] == 't')
+         return OP_IF_LTE;
+   }
+
+   return -1;
+}
+
+// Check if the number of arguments is correct for the command
+int check_arguments(int command_type, int argc, int line_number)
+{
+   // Check to see if the correct number of arguments are provided
+   switch (command_type)
+   {
+   case INT:
+      if (argc != 1)
+      {
+         report("Error at line %d: Incorrect number of arguments for command 'int'\n\tint <var>\n", line_number);
+         return -1;
+      }
+      break;
+   case SET:
+      if (argc != 2)
+      {
+         report("Error at line %d: Incorrect number of arguments for command 'set'\n\tset <var> #\n", line_number);
+         return -1;
+      }
+      break;
+   case BEGIN:
+      if (argc != 0)
+      {
+         report("Error at line %d: Incorrect number of arguments for command 'begin'\n\tbegin\n", line_number);
+         return -1;
+      }
+      break;
+   case END:
+      if (argc != 0)
+      {
+         report("Error at line %d: Incorrect number of arguments for command 'end'\n\tend\n", line_number);
+         return -1;
+      }
+      break;
+   case ADD:
+      if (argc != 2)
+      {
+         report("Error at line %d: Incorrect number of arguments for command 'add'\n\tadd <var> #\n", line_number);
+         return -1;
+      }
+      break;
+   case SUB:
+      if (argc != 2)
+      {
+         report("Error at line %d: Incorrect number of arguments for command 'sub'\n\tsub <var> #\n", line_number);
+         return -1;
+      }
+      break;
+   case MULT:
+      if (argc != 2)
+      {
+         report("Error at line %d: Incorrect number of arguments for command 'mult'\n\tmult <var> #\n", line_number);
+         return -1;
+      }
+      break;
+   case DIV:
+      if (argc != 2)
+      {
+         report("Error at line %d: Incorrect number of arguments for command 'div'\n\tdiv <var> #\n", line_number);
+         return -1;
+      }
+      break;
+   case PRINT:
+      if (argc != 3)
+      {
+         report("Error at line %d: Incorrect number of arguments for command 'print'\n\tprint <var1> <var2> string\n", line_number);
+         return -1;
+      }
+      break;
+   case GOTO:
+      if (argc != 1)
+      {
+         report("Error at line %d: Incorrect number of arguments for command 'goto'\n\tgoto <lineNumber>\n", line_number);
+         return -1;
+      }
+      break;
+   case IF:
+      if (argc != 3)
+      {
+         report("Error at line %d: Incorrect number of arguments for command 'if'\n\tif <var> <op> <var>\n", line_number);
+         return -1;
+      }
+      break;
+   default:
+      report("Error at line %d: Invalid command\n", line_number);
+      return -1;
+   }
+
+   return 1;
+}
+
+// Determine the syntax flag of the command
+// Keywords are told apart by their length and first letter, so at most one comparison is made per token
+int determine_command_type(Token token)
+{
+   const char *str = token.str;
+
+   switch (token.len)
+   {
+      case 2:
+         return memcmp(str, "if", 2) == 0 ? IF : -1;
+      case 3:
+         switch (str[0])
+         {
+            case 'i':
+               return memcmp(str, "int", 3) == 0 ? INT : -1;
+            case 's':
+               if (memcmp(str, "set", 3) == 0)
+                  return SET;
+               return memcmp(str, "sub", 3) == 0 ? SUB : -1;
+            case 'e':
+               return memcmp(str, "end", 3) == 0 ? END : -1;
+            case 'a':
+               return memcmp(str, "add", 3) == 0 ? ADD : -1;
+            case 'd':
+               return memcmp(str, "div", 3) == 0 ? DIV : -1;
+            default:
+               return -1;
+         }
+      case 4:
+         if (memcmp(str, "mult", 4) == 0)
+            return MULT;
+         return memcmp(str, "goto", 4) == 0 ? GOTO : -1;
+      case 5:
+         if (memcmp(str, "begin", 5) == 0)
+            return BEGIN;
+         return memcmp(str, "print", 5) == 0 ? PRINT : -1;
+      default:
+         return -1;
+   }
+}
+
+// Return the index of the command with the given line number
+int get_command_by_line_number(Runtime *runtime, int line_number)
+{
+   if (runtime == NULL || runtime->lineTable == NULL)
+   {
+      return -1;
+   }
+
+   // Dense table, one entry per line number in range
+   if (runtime->lineTableDense)
+   {
+      long offset = (long)line_number - runtime->lineBase;
+      if (offset < 0 || offset >= runtime->lineTableLen)
+         return -1;
+      return runtime->lineTable[offset];
+   }
+
+   // Sparse index, find the first command whose line number is not less than the one we are looking for
+   int lo = 0;
+   int hi = runtime->lineTableLen;
+   while (lo < hi)
+   {
+      int mid = lo + (hi - lo) / 2;
+      if (runtime->commands[runtime->lineTable[mid]].line_number < line_number)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   if (lo < runtime->lineTableLen && runtime->commands[runtime->lineTable[lo]].line_number == line_number)
+      return runtime->lineTable[lo];
+
+   // Line number not found
+   return -1;
+}
+
+// Return string representation of the command
+const char *command_type_to_string(int command_type)
+{
+   switch (command_type)
+   {
+   case INT:
+      return "int";
+   case SET:
+      return "set";
+   case BEGIN:
+      return "begin";
+   case END:
+      return "end";
+   case ADD:
+      return "add";
+   case SUB:
+      return "sub";
+   case MULT:
+      return "mult";
+   case DIV:
+      return "div";
+   case PRINT:
+      return "print";
+   case GOTO:
+      return "goto";
+   case IF:
+      return "if";
+   default:
+      return "invalid";
+   }
+}
+
+// Check if the value is an integer (-1 = not an integer, 0 = positive integer, 1 = negative integer)
+int is_integer(Token token)
+{
+   int value;
+   return scan_integer(token, &value);
+}
+
+// is_integer and token_to_int in one pass over the token, value is only set when the token is an integer
+int scan_integer(Token token, int *value)
+{
+   int i = 0;
+   int negative = 0;
+   unsigned int digits = 0;
+
+   // Check if the value is a negative number
+   if (token.len > 0 && token.str[0] == '-')
+   {
+      negative = 1;
+      i++;
+   }
+
+   for (; i < token.len; i++)
+   {
+      // Check if the value is actually a number
+      unsigned int digit = (unsigned char)token.str[i] - '0';
+      if (digit > 9)
+      {
+         return -1;
+      }
+      digits = digits * 10 + digit;
+   }
+
+   *value = negative ? (int)-digits : (int)digits;
+   return negative;
+}
+
+// Check if the token is exactly the given string
+int token_equals(Token token, const char *str)
+{
+   return strncmp(token.str, str, token.len) == 0 && str[token.len] == '\0';
+}
+
+// Convert the token to an integer the same way atoi would, reading an optional sign and leading digits
+int token_to_int(Token token)
+{
+   int i = 0;
+   int negative = 0;
+   unsigned int value = 0;
+
+   if (i < token.len && (token.str[i] == '-' || token.str[i] == '+'))
+   {
+      negative = token.str[i] == '-';
+      i++;
+   }
+
+   for (; i < token.len && isdigit((unsigned char)token.str[i]); i++)
+   {
+      value = value * 10 + (token.str[i] - '0');
+   }
+
+   return negative ? (int)-value : (int)value;
+}
+
+# pragma endregion
+
+# pragma region Profile Functions
+
+// Allocate the profile of a compiled runtime, execute_runtime fills it in from then on
+int enable_profile(Runtime *runtime)
+{
+   if (runtime == NULL || runtime->program == NULL)
+   {
+      return -1;
+   }
+
+   Profile *profile = arena_alloc(&runtime->arena, sizeof(Profile));
+   if (profile == NULL)
+   {
+      return -1;
+   }
+
+   profile->len = runtime->programLen;
+   profile->counts = arena_alloc(&runtime->arena, sizeof(long long) * profile->len);
+   profile->ticks = arena_alloc(&runtime->arena, sizeof(uint64_t) * profile->len);
+   if (profile->counts == NULL || profile->ticks == NULL)
+   {
+      return -1;
+   }
+
+   memset(profile->counts, 0, sizeof(long long) * profile->len);
+   memset(profile->ticks, 0, sizeof(uint64_t) * profile->len);
+   runtime->profile = profile;
+
+   return 1;
+}
+
+// Command type an instruction was compiled from, the sentinels after the last command halt like end
+static int profile_command_type(Runtime *runtime, int i)
+{
+   return i < runtime->commandsLen ? runtime->commands[i].command_type : END;
+}
+
+// Totals per command type, indexed by the syntax flags
+static void profile_by_type(Runtime *runtime, long long counts[], uint64_t ticks[])
+{
+   for (int t = 0; t <= IF; t++)
+   {
+      counts[t] = 0;
+      ticks[t] = 0;
+   }
+
+   for (int i = 0; i < runtime->profile->len; i++)
+   {
+      int t = profile_command_type(runtime, i);
+      counts[t] += runtime->profile->counts[i];
+      ticks[t] += runtime->profile->ticks[i];
+   }
+}
+
+// Profile being sorted by compare_profile_ticks, qsort has no context argument
+static __thread Profile *sort_profile;
+
+static int compare_profile_ticks(const void *p1, const void *p2)
+{
+   uint64_t t1 = sort_profile->ticks[*(const int *)p1];
+   uint64_t t2 = sort_profile->ticks[*(const int *)p2];
+
+   // Hottest first
+   return (t1 < t2) - (t1 > t2);
+}
+
+// Print the hottest lines and the totals per command type
+void print_profile(Runtime *runtime, FILE *file)
+{
+   if (runtime == NULL || runtime->profile == NULL)
+   {
+      return;
+   }
+
+   Profile *profile = runtime->profile;
+
+   // Only instructions that ran are listed
+   int *order = malloc(sizeof(int) * profile->len);
+   if (order == NULL)
+   {
+      report("Error: Could not allocate memory for the profile report\n");
+      return;
+   }
+
+   int ran = 0;
+   uint64_t total = 0;
+   long long executed = 0;
+   for (int i = 0; i < profile->len; i++)
+   {
+      if (profile->counts[i] > 0)
+         order[ran++] = i;
+      total += profile->ticks[i];
+      executed += profile->counts[i];
+   }
+
+   sort_profile = profile;
+   qsort(order, ran, sizeof(int), compare_profile_ticks);
+
+   fprintf(file, "\nProfile: %lld instructions, %llu %s\n\n", executed, (unsigned long long)total, TICK_UNIT);
+   fprintf(file, "%8s  %-7s %14s %16s %7s %12s\n", "line", "command", "count", TICK_UNIT, "%", TICK_UNIT "/exec");
+
+   for (int k = 0; k < ran && k < PROFILE_HOT_LINES; k++)
+   {
+      int i = order[k];
+      fprintf(file, "%8d  %-7s %14lld %16llu %6.2f%% %12.1f\n",
+              runtime->program[i].line_number, command_type_to_string(profile_command_type(runtime, i)),
+              profile->counts[i], (unsigned long long)profile->ticks[i],
+              total ? 100.0 * profile->ticks[i] / total : 0.0, (double)profile->ticks[i] / profile->counts[i]);
+   }
+   if (ran > PROFILE_HOT_LINES)
+   {
+      fprintf(file, "%8s  (%d more lines)\n", "...", ran - PROFILE_HOT_LINES);
+   }
+
+   long long type_counts[IF + 1];
+   uint64_t type_ticks[IF + 1];
+   profile_by_type(runtime, type_counts, type_ticks);
+
+   fprintf(file, "\n%-7s %14s %16s %7s\n", "command", "count", TICK_UNIT, "%");
+   for (int t = 1; t <= IF; t++)
+   {
+      if (type_counts[t] == 0)
+         continue;
+
+      fprintf(file, "%-7s %14lld %16llu %6.2f%%\n", command_type_to_string(t), type_counts[t],
+              (unsigned long long)type_ticks[t], total ? 100.0 * type_ticks[t] / total : 0.0);
+   }
+
+   free(order);
+}
+
+// Write the profile to a file, as JSON when the name ends in .json and as collapsed stacks for flame graph tools
+// otherwise, one "a4;<command>;line <n> <ticks>" line per instruction that ran
+int write_profile(Runtime *runtime, const char *filename)
+{
+   if (runtime == NULL || runtime->profile == NULL)
+   {
+      return -1;
+   }
+
+   FILE *file = fopen(filename, "w");
+   if (file == NULL)
+   {
+      report("Error: Could not open %s: %s\n", filename, strerror(errno));
+      return -1;
+   }
+
+   Profile *profile = runtime->profile;
+   size_t len = strlen(filename);
+   int json = len >= 5 && strcmp(filename + len - 5, ".json") == 0;
+
+   if (json)
+   {
+      fprintf(file, "{\n  \"unit\": \"%s\",\n  \"lines\": [", TICK_UNIT);
+
+      int first = 1;
+      for (int i = 0; i < profile->len; i++)
+      {
+         if (profile->counts[i] == 0)
+            continue;
+
+         fprintf(file, "%s\n    {\"line\": %d, \"command\": \"%s\", \"count\": %lld, \"ticks\": %llu}",
+                 first ? "" : ",", runtime->program[i].line_number,
+                 command_type_to_string(profile_command_type(runtime, i)), profile->counts[i],
+                 (unsigned long long)profile->ticks[i]);
+         first = 0;
+      }
+
+      long long type_counts[IF + 1];
+      uint64_t type_ticks[IF + 1];
+      profile_by_type(runtime, type_counts, type_ticks);
+
+      fprintf(file, "\n  ],\n  \"commands\": [");
+
+      first = 1;
+      for (int t = 1; t <= IF; t++)
+      {
+         if (type_counts[t] == 0)
+            continue;
+
+         fprintf(file, "%s\n    {\"command\": \"%s\", \"count\": %lld, \"ticks\": %llu}", first ? "" : ",",
+                 command_type_to_string(t), type_counts[t], (unsigned long long)type_ticks[t]);
+         first = 0;
+      }
+
+      fprintf(file, "\n  ]\n}\n");
+   }
+   else
+   {
+      for (int i = 0; i < profile->len; i++)
+      {
+         if (profile->counts[i] == 0)
+            continue;
+
+         fprintf(file, "a4;%s;line %d %llu\n", command_type_to_string(profile_command_type(runtime, i)),
+                 runtime->program[i].line_number, (unsigned long long)profile->ticks[i]);
+      }
+   }
+
+   if (fclose(file) != 0)
+   {
+      report("Error: Could not write %s: %s\n", filename, strerror(errno));
+      return -1;
+   }
+
+   return 1;
+}
+
+# pragma endregion
+
+# pragma region Output Functions
+
+// Output errors are reported into instead of stdout, set per thread so programs run side by side in batch mode
+// report their errors along with their own output
+static __thread Output *report_output = NULL;
+
+// Callback errors are reported to when there is no report output, see a4_set_error_callback
+static __thread OutputCallback report_callback = NULL;
+static __thread void *report_context = NULL;
+
+// Print an error or other message about the program being built or run on this thread
+void report(const char *format, ...)
+{
+   va_list args;
+   va_start(args, format);
+
+   if (report_output == NULL && report_callback == NULL)
+   {
+      vprintf(format, args);
+   }
+   else
+   {
+      char message[4096];
+      int n = vsnprintf(message, sizeof(message), format, args);
+      if (n > (int)sizeof(message) - 1)
+         n = sizeof(message) - 1;
+      if (n > 0 && report_output != NULL)
+         output_write(report_output, message, n);
+      else if (n > 0)
+         report_callback(report_context, message, n);
+   }
+
+   va_end(args);
+}
+
+// Send the messages of report on this thread to output, NULL for stdout
+void set_report_output(Output *output)
+{
+   report_output = output;
+}
+
+// Set up an empty output writing to fd
+void init_output(Output *output, int fd)
+{
+   output->len = 0;
+   output->fd = fd;
+   output->line_buffered = 0;
+   output->callback = NULL;
+   output->context = NULL;
+   output->memory = NULL;
+   output->memoryLen = 0;
+   output->memoryCapacity = 0;
+   output->pack = NULL;
 }
 
-# pragma endregion
+// Append a PRINT line, "val1 val2 str\n", to the output buffer
+// The integers are formatted by hand since this runs for every PRINT
+void output_print(Output *output, Value val1, Value val2, const char *str, int len)
+{
+   if (output == NULL)
+   {
+      return;
+   }
 
-# pragma region Helper Functions
+   if (output->pack != NULL)
+   {
+      pack_print(output, val1, val2, str, len);
+      if (output->line_buffered)
+         flush_output(output);
+      return;
+   }
 
-// Check if the variable is defined, return the index of the variable if it is defined
-int is_defined(Runtime *runtime, char *arg)
-{
-   // Check if the variable is defined
-   for (int i = 0; i < runtime->intNamesLen; i++)
+   // Two integers of up to VALUE_DIGITS characters each, two spaces and a newline
+   if (output->len + len + 2 * VALUE_DIGITS + 3 > OUTPUT_BUFFER_SIZE)
    {
-      // Check if the variable is defined
-      char *v = runtime->intNames[i];
-      if (strcmp(v, arg) == 0)
+      flush_output(output);
+
+      // Strings longer than the buffer are written around it
+      if (len + 2 * VALUE_DIGITS + 3 > OUTPUT_BUFFER_SIZE)
       {
-         return i;
+         char prefix[2 * VALUE_DIGITS + 3];
+         int n = snprintf(prefix, sizeof(prefix), "%lld %lld ", (long long)val1, (long long)val2);
+         output_write(output, prefix, n);
+         output_write(output, str, len);
+         output_write(output, "\n", 1);
+         return;
       }
    }
-   return -1;
-}
 
-// Check if the value of the variable is set, and return the index of the variable
-int is_set(Runtime *runtime, char *arg)
-{
-   // Check if the variable is defined
-   for (int i = 0; i < runtime->intValuesLen; i++)
+   char *p = output->data + output->len;
+   Value vals[2] = {val1, val2};
+
+   for (int v = 0; v < 2; v++)
    {
-      // Check if the variable is defined
-      char *v = runtime->intNames[i];
-      if (is_defined(runtime, v) >= 0)
+      // Fill the digits in backwards, unsigned so that VALUE_MIN can be negated
+      char digits[VALUE_DIGITS];
+      int n = 0;
+      UnsignedValue u = vals[v] < 0 ? 0u - (UnsignedValue)vals[v] : (UnsignedValue)vals[v];
+      do
       {
-         // Check if the defined variable is the same as the variable we are checking
-         if (strcmp(v, arg) == 0)
-         {
-            // Check if the variable is set
-            if (runtime->intValuesSet[i] == 1)
-            {
-               return i;
-            }
-            else
-            {
-               return -1;
-            }
-         }
-      }
+         digits[n++] = '0' + u % 10;
+         u /= 10;
+      } while (u != 0);
+
+      if (vals[v] < 0)
+         *p++ = '-';
+      while (n > 0)
+         *p++ = digits[--n];
+      *p++ = ' ';
    }
 
-   // Variable is not set
-   return -1;
+   memcpy(p, str, len);
+   p += len;
+   *p++ = '\n';
+   output->len = p - output->data;
+
+   if (output->line_buffered)
+      flush_output(output);
 }
 
-// Evaluate an expression
-int evaluate(Runtime *runtime, int n, char *op, int val1, int val2)
+// Write all of data to the output's fd, retrying short writes, or append it to its memory when fd is -1
+static void write_all(Output *output, const char *data, int len)
 {
-   if (strcmp(op, "eq") == 0)
-   {
-      return (val1 == val2);
-   }
-   else if (strcmp(op, "ne") == 0)
-   {
-      return (val1 != val2);
-   }
-   else if (strcmp(op, "gt") == 0)
-   {
-      return (val1 > val2);
-   }
-   else if (strcmp(op, "gte") == 0)
+   if (output->callback != NULL)
    {
-      return (val1 >= val2);
+      if (len > 0)
+         output->callback(output->context, data, len);
+      return;
    }
-   else if (strcmp(op, "lt") == 0)
+
+   int fd = output->fd;
+   if (fd == -1)
    {
-      return (val1 < val2);
+      if (output->memoryLen + len > output->memoryCapacity)
+      {
+         size_t capacity = output->memoryCapacity > 0 ? output->memoryCapacity : 4096;
+         while (output->memoryLen + len > capacity)
+            capacity *= 2;
+
+         // Output that can not be kept is dropped, just like writes to a closed fd
+         char *memory = realloc(output->memory, capacity);
+         if (memory == NULL)
+            return;
+         output->memory = memory;
+         output->memoryCapacity = capacity;
+      }
+
+      memcpy(output->memory + output->memoryLen, data, len);
+      output->memoryLen += len;
+      return;
    }
-   else if (strcmp(op, "lte") == 0)
+
+   while (len > 0)
    {
-      return (val1 <= val2);
+      ssize_t bytes = write(fd, data, len);
+      if (bytes == -1 && errno == EINTR)
+         continue;
+      if (bytes <= 0)
+         return;
+      data += bytes;
+      len -= bytes;
    }
-   else
+}
+
+// Append raw data to the output, as a text record when it is compressed
+void output_write(Output *output, const char *data, int len)
+{
+   if (output->pack != NULL)
    {
-      return -1;
+      pack_text(output, data, len);
+      return;
    }
+
+   output_append(output, data, len);
 }
 
-// Check if the number of arguments is correct for the command
-int check_arguments(int command_type, int argc, int line_number)
+// Append bytes to the output buffer as they are, compressed or not
+void output_append(Output *output, const char *data, int len)
 {
-   // Check to see if the correct number of arguments are provided
-   switch (command_type)
+   if (output->len + len > OUTPUT_BUFFER_SIZE)
    {
-   case INT:
-      if (argc != 1)
-      {
-         printf("Error at line %d: Incorrect number of arguments for command 'int'\n\tint <var>\n", line_number);
-         return -1;
-      }
-      break;
-   case SET:
-      if (argc != 2)
-      {
-         printf("Error at line %d: Incorrect number of arguments for command 'set'\n\tset <var> #\n", line_number);
-         return -1;
-      }
-      break;
-   case BEGIN:
-      if (argc != 0)
-      {
-         printf("Error at line %d: Incorrect number of arguments for command 'begin'\n\tbegin\n", line_number);
-         return -1;
-      }
-      break;
-   case END:
-      if (argc != 0)
-      {
-         printf("Error at line %d: Incorrect number of arguments for command 'end'\n\tend\n", line_number);
-         return -1;
-      }
-      break;
-   case ADD:
-      if (argc != 2)
-      {
-         printf("Error at line %d: Incorrect number of arguments for command 'add'\n\tadd <var> #\n", line_number);
-         return -1;
-      }
-      break;
-   case SUB:
-      if (argc != 2)
-      {
-         printf("Error at line %d: Incorrect number of arguments for command 'sub'\n\tsub <var> #\n", line_number);
-         return -1;
-      }
-      break;
-   case MULT:
-      if (argc != 2)
-      {
-         printf("Error at line %d: Incorrect number of arguments for command 'mult'\n\tmult <var> #\n", line_number);
-         return -1;
-      }
-      break;
-   case DIV:
-      if (argc != 2)
-      {
-         printf("Error at line %d: Incorrect number of arguments for command 'div'\n\tdiv <var> #\n", line_number);
-         return -1;
-      }
-      break;
-   case PRINT:
-      if (argc != 3)
-      {
-         printf("Error at line %d: Incorrect number of arguments for command 'print'\n\tprint <var1> <var2> string\n", line_number);
-         return -1;
-      }
-      break;
-   case GOTO:
-      if (argc != 1)
-      {
-         printf("Error at line %d: Incorrect number of arguments for command 'goto'\n\tgoto <lineNumber>\n", line_number);
-         return -1;
-      }
-      break;
-   case IF:
-      if (argc != 3)
+      flush_output(output);
+
+      // Too big for the buffer, write it straight out
+      if (len > OUTPUT_BUFFER_SIZE)
       {
-         printf("Error at line %d: Incorrect number of arguments for command 'if'\n\tif <var> <op> <var>\n", line_number);
-         return -1;
+         write_all(output, data, len);
+         return;
       }
-      break;
-   default:
-      printf("Error at line %d: Invalid command\n", line_number);
-      return -1;
    }
+
+   memcpy(output->data + output->len, data, len);
+   output->len += len;
+}
+
+// Write out everything in the output buffer
+void flush_output(Output *output)
+{
+   if (output == NULL)
+   {
+      return;
+   }
+
+#ifndef NOGRAPHICS
+   // In the graphics build PRINT draws into the frame buffer, flushing output redraws what changed
+   flush_frame();
+#endif
+
+   // A run of repeated lines the encoder is still counting is written out with the rest
+   if (output->pack != NULL)
+      pack_finish(output);
+
+   // Anything printed through stdio has to come out first to keep the order
+   if (output->fd != -1 && output->callback == NULL)
+      fflush(stdout);
+
+   write_all(output, output->data, output->len);
+   output->len = 0;
 }
 
-// Determine the syntax flag of the command
-int determine_command_type(char *token)
+# pragma endregion
+
+# pragma region Library Functions
+
+// Parse, compile and optimize a program from a buffer for an embedding program
+// The buffer is used in place and must stay valid until the runtime is freed with a4_free
+// Returns NULL when the program has errors, which are reported as set by a4_set_error_callback
+Runtime *a4_parse_buffer(const char *source, size_t len)
 {
-   // Check if the command is a valid command
-   if (strcmp(token, "int") == 0)
+   Runtime *runtime = build_runtime_from_buffer(source, len);
+   if (runtime == NULL)
    {
-      return INT;
+      return NULL;
    }
-   else if (strcmp(token, "set") == 0)
+
+   optimize_runtime(runtime, OPT_ALL);
+   return runtime;
+}
+
+// Run a program parsed by a4_parse_buffer, handing its output to callback in blocks as it is written out
+// Errors found while running go to the callback along with the output, a NULL callback writes everything to stdout
+int a4_execute(Runtime *runtime, OutputCallback callback, void *context)
+{
+   if (runtime == NULL || runtime->program == NULL)
    {
-      return SET;
+      return -1;
    }
-   else if (strcmp(token, "begin") == 0)
+
+   Output *output = malloc(sizeof(Output));
+   if (output == NULL)
    {
-      return BEGIN;
+      report("Error: Could not allocate memory for the output buffer\n");
+      return -1;
    }
-   else if (strcmp(token, "end") == 0)
+
+   init_output(output, STDOUT_FILENO);
+   output->callback = callback;
+   output->context = context;
+
+   // Runtimes can be run from inside batch mode or the server, whose output errors would go to otherwise
+   Output *previous = report_output;
+   set_report_output(output);
+
+   runtime->output = output;
+   execute_runtime(runtime);
+   flush_output(output);
+
+   set_report_output(previous);
+   runtime->output = NULL;
+   free(output);
+   return 1;
+}
+
+// Run a program parsed by a4_parse_buffer for at most max_instructions instructions, 0 or less for no limit, and
+// until the deadline set with a4_set_time_limit, with output and errors going to callback as for a4_execute
+// Returns A4_DONE once the program has halted and A4_ERROR once it has stopped at an error, which every later call
+// returns again, or A4_BUDGET or A4_DEADLINE when it was stopped before the instruction at runtime->pc, and the next
+// call carries on from there as if it had never stopped; -1 when it could not be run
+// The program is always interpreted, native code has no budget to stop at, and a loop run in closed form by OP_LOOP
+// counts as a single instruction
+int a4_run(Runtime *runtime, long long max_instructions, OutputCallback callback, void *context)
+{
+   if (runtime == NULL || runtime->program == NULL)
    {
-      return END;
+      return -1;
    }
-   else if (strcmp(token, "add") == 0)
+
+   if (runtime->status == A4_DONE || runtime->status == A4_ERROR)
+      return runtime->status;
+
+   // A deadline that has already passed runs nothing, so a program that is out of time never gets another slice
+   if (runtime->deadline != 0 && clock_ns() >= runtime->deadline)
    {
-      return ADD;
+      runtime->status = A4_DEADLINE;
+      return A4_DEADLINE;
    }
-   else if (strcmp(token, "sub") == 0)
+
+   Output *output = malloc(sizeof(Output));
+   if (output == NULL)
    {
-      return SUB;
+      report("Error: Could not allocate memory for the output buffer\n");
+      return -1;
    }
-   else if (strcmp(token, "mult") == 0)
+
+   init_output(output, STDOUT_FILENO);
+   output->callback = callback;
+   output->context = context;
+
+   Output *previous = report_output;
+   set_report_output(output);
+
+   runtime->output = output;
+   runtime->budget = max_instructions > 0 ? max_instructions : -1;
+   int start = runtime->status == A4_READY ? runtime->entry : runtime->next;
+   runtime->status = execute_program_budgeted(runtime, start);
+   flush_output(output);
+
+   set_report_output(previous);
+   runtime->output = NULL;
+   free(output);
+   return runtime->status;
+}
+
+// Have a4_run stop with A4_DEADLINE once nanoseconds have passed from now, 0 or less to take the limit away
+// The clock is read every DEADLINE_INTERVAL instructions, so a program can run a little past its deadline
+void a4_set_time_limit(Runtime *runtime, long long nanoseconds)
+{
+   if (runtime == NULL)
    {
-      return MULT;
+      return;
    }
-   else if (strcmp(token, "div") == 0)
+
+   runtime->deadline = nanoseconds > 0 ? clock_ns() + (uint64_t)nanoseconds : 0;
+}
+
+// Choose what arithmetic does when its result does not fit in a Value, one of OVERFLOW_WRAP (the default),
+// OVERFLOW_TRAP or OVERFLOW_SATURATE
+// Call it before jit_compile and before the program runs, returns -1 for a policy that is not one of them
+int a4_set_overflow(Runtime *runtime, int overflow)
+{
+   if (runtime == NULL || overflow < OVERFLOW_WRAP || overflow > OVERFLOW_SATURATE)
    {
-      return DIV;
+      return -1;
    }
-   else if (strcmp(token, "print") == 0)
+
+   runtime->overflow = overflow;
+   return 1;
+}
+
+// Overflow policy for a name given on the command line, or -1 if there is no such policy
+// wrap                -the result wraps around, two's complement
+// trap                -the program stops with an error at the line that overflowed
+// saturate            -the result is the largest or smallest value there is
+int overflow_from_name(const char *name)
+{
+   if (strcmp(name, "wrap") == 0)
    {
-      return PRINT;
+      return OVERFLOW_WRAP;
    }
-   else if (strcmp(token, "goto") == 0)
+   else if (strcmp(name, "trap") == 0)
    {
-      return GOTO;
+      return OVERFLOW_TRAP;
    }
-   else if (strcmp(token, "if") == 0)
+   else if (strcmp(name, "saturate") == 0)
    {
-      return IF;
+      return OVERFLOW_SATURATE;
    }
    else
    {
@@ -1191,82 +3634,86 @@ int determine_command_type(char *token)
    }
 }
 
-// Return the command with the given line number
-int get_command_by_line_number(Runtime *runtime, int line_number)
+// Send the errors reported on this thread while no program is running to callback, NULL for stdout
+// This covers a4_parse_buffer, whose errors have nowhere else to go
+void a4_set_error_callback(OutputCallback callback, void *context)
 {
-   if (runtime == NULL)
-   {
-      return -1;
-   }
+   report_callback = callback;
+   report_context = context;
+}
 
-   // Loop through the commands
-   for (int i = 0; i < runtime->commandsLen; i++)
-   {
-      // Check if the line number matches
-      if (runtime->commands[i]->line_number == line_number)
-      {
-         return i;
-      }
-   }
+// Free a program parsed by a4_parse_buffer
+void a4_free(Runtime *runtime)
+{
+   free_runtime(runtime);
+}
 
-   // Line number not found
-   return -1;
+# pragma endregion
+
+# pragma region Arena Functions
+
+// Round a size up to the arena alignment
+static size_t arena_round(size_t size)
+{
+   return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
 }
 
-// Return string representation of the command
-const char *command_type_to_string(int command_type)
+// Allocate memory from the arena, the memory is not initialized
+void *arena_alloc(Arena *arena, size_t size)
 {
-   switch (command_type)
+   size = arena_round(size);
+
+   // Start a new block when the current one is full
+   ArenaBlock *block = arena->head;
+   if (block == NULL || block->size - block->used < size)
    {
-   case INT:
-      return "int";
-   case SET:
-      return "set";
-   case BEGIN:
-      return "begin";
-   case END:
-      return "end";
-   case ADD:
-      return "add";
-   case SUB:
-      return "sub";
-   case MULT:
-      return "mult";
-   case DIV:
-      return "div";
-   case PRINT:
-      return "print";
-   case GOTO:
-      return "goto";
-   case IF:
-      return "if";
-   default:
-      return "invalid";
+      size_t block_size = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+      block = malloc(sizeof(ArenaBlock) + block_size);
+      if (block == NULL)
+         return NULL;
+
+      block->next = arena->head;
+      block->size = block_size;
+      block->used = 0;
+      arena->head = block;
    }
+
+   void *ptr = block->data + block->used;
+   block->used += size;
+   return ptr;
 }
 
-// Check if the value is an integer (-1 = not an integer, 0 = positive integer, 1 = negative integer)
-int is_integer(char *token)
+// Grow an allocation to new_size bytes, keeping its contents
+// The allocation is extended in place if it is the last one in the current block, otherwise it is copied
+void *arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size)
 {
-   int negative = 0;
+   ArenaBlock *block = arena->head;
+   old_size = arena_round(old_size);
+   new_size = arena_round(new_size);
 
-   for (int i = 0; i < strlen(token); i++)
+   if (ptr != NULL && block != NULL && (char *)ptr + old_size == block->data + block->used && block->size - block->used >= new_size - old_size)
    {
-      // Check if the value is a negative number
-      if (i == 0 && token[i] == '-')
-      {
-         negative = 1;
-         continue;
-      }
-
-      // Check if the value is actually a number
-      if (!isdigit(token[i]))
-      {
-         return -1;
-      }
+      block->used += new_size - old_size;
+      return ptr;
    }
 
-   return negative;
+   void *new_ptr = arena_alloc(arena, new_size);
+   if (new_ptr != NULL && ptr != NULL)
+      memcpy(new_ptr, ptr, old_size);
+   return new_ptr;
+}
+
+// Release every block of the arena
+void arena_free(Arena *arena)
+{
+   ArenaBlock *block = arena->head;
+   while (block != NULL)
+   {
+      ArenaBlock *next = block->next;
+      free(block);
+      block = next;
+   }
+   arena->head = NULL;
 }
 
-# pragma endregion
\ No newline at end of file
+# pragma endregion
@@ -0,0 +1,679 @@
+// Types, constants and function prototypes shared by the interpreter, the benchmark driver and anything else
+// built on top of a4.c
+
+#ifndef A4_H
+#define A4_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#define MAXVARNAME 10
+#define SCREENSIZE 200
+
+// Variables hold 32 bit values unless the interpreter is built with A4_WIDE_VALUES (make VALUES=64) for 64 bit ones
+// Numbers in the source are 32 bit either way
+#ifdef A4_WIDE_VALUES
+typedef int64_t Value;
+typedef uint64_t UnsignedValue;
+#define VALUE_MIN INT64_MIN
+#define VALUE_MAX INT64_MAX
+#define VALUE_DIGITS 20
+#else
+typedef int32_t Value;
+typedef uint32_t UnsignedValue;
+#define VALUE_MIN INT32_MIN
+#define VALUE_MAX INT32_MAX
+#define VALUE_DIGITS 11
+#endif
+
+// What arithmetic does with a result that does not fit in a Value, see a4_set_overflow
+// Division by zero is an error under every policy
+#define OVERFLOW_WRAP 0
+#define OVERFLOW_TRAP 1
+#define OVERFLOW_SATURATE 2
+
+// Initial capacity of the variable storage and the symbol table, both double when they fill up
+// The symbol table size must be a power of two
+#define INITIAL_VARIABLES 16
+#define INITIAL_SYMBOLS 32
+
+// Set flags are packed 64 to a word
+#define BITSET_WORDS(n) (((n) + 63) / 64)
+#define TEST_BIT(bits, i) (((bits)[(i) >> 6] >> ((i) & 63)) & 1)
+#define SET_BIT(bits, i) ((bits)[(i) >> 6] |= (uint64_t)1 << ((i) & 63))
+#define CLEAR_BIT(bits, i) ((bits)[(i) >> 6] &= ~((uint64_t)1 << ((i) & 63)))
+
+// Whitespace separating tokens, the characters isspace accepts in the C locale without going through the locale
+#define IS_BLANK(c) ((c) == ' ' || ((c) >= '\t' && (c) <= '\r'))
+
+// Line numbers are looked up through a dense table unless the table would be this many times larger than the program
+#define LINETABLE_SPARSITY 4
+
+// Size of the buffer PRINT output is collected in before it is written out
+#define OUTPUT_BUFFER_SIZE 65536
+
+// Computed goto dispatch needs the labels as values extension
+#if defined(THREADED_DISPATCH) && defined(__GNUC__)
+#define USE_THREADED_DISPATCH
+#endif
+
+// Initial capacity of the command array, doubles as lines are parsed
+#define INITIAL_COMMANDS 64
+
+// Sources are split into commands on several threads when every thread gets at least this many bytes, and on no
+// more than PARSE_MAX_THREADS threads
+#define PARSE_CHUNK_SIZE (1 << 20)
+#define PARSE_MAX_THREADS 16
+
+// Runs of a parameter sweep done in lockstep, and the most values a sweep can have, see sweep.c
+#define SWEEP_LANES 8
+#define MAX_SWEEP_VALUES (1 << 24)
+
+// Size of the blocks the arena allocator hands out memory from, larger allocations get a block of their own
+#define ARENA_BLOCK_SIZE 65536
+
+// Arena allocations are aligned to this many bytes
+#define ARENA_ALIGN 16
+
+// Syntax flags for the interpreter
+#define INT 1
+#define SET 2
+#define BEGIN 3
+#define END 4
+#define ADD 5
+#define SUB 6
+#define MULT 7
+#define DIV 8
+#define PRINT 9
+#define GOTO 10
+#define IF 11
+
+// Opcodes for the compiled program that execute_runtime runs, see compile_runtime
+#define OP_HALT 0
+#define OP_SET 1
+#define OP_ADD 2
+#define OP_SUB 3
+#define OP_MULT 4
+#define OP_DIV 5
+#define OP_PRINT 6
+#define OP_GOTO 7
+#define OP_IF_EQ 8
+#define OP_IF_NE 9
+#define OP_IF_GT 10
+#define OP_IF_GTE 11
+#define OP_IF_LT 12
+#define OP_IF_LTE 13
+#define OP_NOP 14
+#define OP_TRAP 15
+
+// Superinstructions written over the first instruction of an idiom by fuse_program, see optimize_runtime
+// Both families are in the same order as OP_IF_EQ to OP_IF_LTE
+// OP_BRANCH_* is an if followed by a goto, OP_ADD_BRANCH_* an add followed by an if and a goto
+#define OP_BRANCH_EQ 16
+#define OP_BRANCH_NE 17
+#define OP_BRANCH_GT 18
+#define OP_BRANCH_GTE 19
+#define OP_BRANCH_LT 20
+#define OP_BRANCH_LTE 21
+#define OP_ADD_BRANCH_EQ 22
+#define OP_ADD_BRANCH_NE 23
+#define OP_ADD_BRANCH_GT 24
+#define OP_ADD_BRANCH_GTE 25
+#define OP_ADD_BRANCH_LT 26
+#define OP_ADD_BRANCH_LTE 27
+
+// Counted loop computed in closed form, b is the index of the loop in runtime->loops, see loop_program
+#define OP_LOOP 28
+
+// SET, ADD, SUB, MULT and DIV with a variable as the second operand, b is its slot instead of an immediate
+// In the same order as OP_SET to OP_DIV, OP_VAR_OFFSET apart
+#define OP_SET_VAR 29
+#define OP_ADD_VAR 30
+#define OP_SUB_VAR 31
+#define OP_MULT_VAR 32
+#define OP_DIV_VAR 33
+#define OP_VAR_OFFSET (OP_SET_VAR - OP_SET)
+
+// Optimization passes run by optimize_runtime
+#define OPT_FUSE 1
+#define OPT_LOOPS 2
+#define OPT_CONSTANTS 4
+#define OPT_ALL (OPT_FUSE | OPT_LOOPS | OPT_CONSTANTS)
+
+// Error codes raised by OP_TRAP when a goto could not be resolved at compile time
+#define TRAP_INVALID_LINE 1
+#define TRAP_MISSING_LINE 2
+
+// Status of a runtime run with a4_run, A4_READY until it has stopped for good
+// A4_BUDGET and A4_DEADLINE leave it where it stopped, and the next call to a4_run carries on from there
+#define A4_READY 0
+#define A4_DONE 1
+#define A4_ERROR 2
+#define A4_BUDGET 3
+#define A4_DEADLINE 4
+
+// Instructions run by a4_run between two looks at the clock when there is a deadline
+#define DEADLINE_INTERVAL 4096
+
+// Called with every block of output as it is written out, in place of writing it to a file descriptor
+typedef void (*OutputCallback)(void *context, const char *data, size_t len);
+
+// Buffered output sink for PRINT in the non graphics build
+// Lines are formatted straight into data and written to fd when the buffer fills up, at the end of the program,
+// before an error is reported, or after every line when line_buffered is set
+// With a callback it is handed everything written out instead, see a4_execute, and with fd set to -1 it is
+// collected in memory, see batch.c
+typedef struct
+{
+   char data[OUTPUT_BUFFER_SIZE];
+   int len;
+   int fd;
+   int line_buffered;
+
+   OutputCallback callback;
+   void *context;
+
+   // Output collected when fd is -1, allocated with malloc and owned by whoever set up the output
+   char *memory;
+   size_t memoryLen;
+   size_t memoryCapacity;
+
+   // Encoder state when the output is written compressed, NULL for plain text, see pack.c
+   struct Pack *pack;
+} Output;
+
+// View of a token in the source buffer, tokens are not NUL terminated
+typedef struct
+{
+   const char *str;
+   int len;
+} Token;
+
+// Block of memory in an arena, blocks are kept in a list with the block being allocated from at the head
+typedef struct ArenaBlock
+{
+   struct ArenaBlock *next;
+   size_t size;
+   size_t used;
+
+   // Starts on the alignment rather than right after the header, blocks come from malloc which aligns them as much
+   _Alignas(ARENA_ALIGN) char data[];
+} ArenaBlock;
+
+// Bump allocator, memory is only ever released all at once with arena_free
+typedef struct
+{
+   ArenaBlock *head;
+} Arena;
+
+// Command structure
+typedef struct
+{
+   // line number of the command
+   int line_number;
+
+   // type of command, see syntax flags above
+   int command_type;
+
+   // arguments are stored as views into the source buffer for the command only
+   // Values are stored as integers in the runtime structure once the program is executed
+   Token args[3];
+} Command;
+
+// Compiled instruction, one per command
+typedef struct
+{
+   // opcode of the instruction, see opcodes above
+   int opcode;
+
+   // Operands are indices into intValues (variables and constant slots), except for SET, ADD, SUB, MULT and DIV
+   // where b holds the decoded immediate, and TRAP where a holds the error code and b the offending line number
+   // Whether the second operand of arithmetic is an immediate or a variable is decided once by compile_runtime,
+   // which picks OP_SET to OP_DIV or OP_SET_VAR to OP_DIV_VAR
+   int a;
+   int b;
+
+   // Index of the instruction to jump to for GOTO, and for IF when the expression is false
+   int target;
+
+   // String printed by PRINT
+   Token str;
+
+   // Line number of the command the instruction was compiled from
+   int line_number;
+
+   // 1 when verify_program has proven that every variable the instruction reads is set, so it runs without set checks
+   int proven;
+} Instruction;
+
+// Compressed output, see pack.c and a4unpack.c
+// A stream is PACK_MAGIC and a version byte followed by records, each a tag byte and its fields, numbers are
+// unsigned LEB128 varints and row and col are zigzag encoded steps from the line before
+#define PACK_MAGIC "A4PK"
+
+// Bumped whenever anything written to a compressed stream changes meaning
+#define PACK_VERSION 1
+
+// Text written as is, such as errors: length and bytes
+#define PACK_TEXT 0
+
+// Line with a string not in the string table: length, bytes, row step and col step, the string goes into the table
+#define PACK_STRING 1
+
+// Line with a string from the table: its slot, row step and col step
+#define PACK_PRINT 2
+
+// Line with the string of the line before it: row step and col step
+#define PACK_SAME 3
+
+// The last period lines again, count lines in all: period and count
+#define PACK_REPEAT 4
+
+// Everything decoded so far is forgotten, the string table, the lines for repeats and the row and col
+#define PACK_RESET 5
+
+// Slots of the string table, a string goes into the slot pack_hash picks for it, a power of two
+#define PACK_STRINGS 256
+
+// Longest run of lines a repeat can copy
+#define PACK_PERIODS 4
+
+// Slot of the string table a PRINT string goes into, FNV-1a, the same for the encoder and the decoder
+static inline int pack_hash(const char *str, int len)
+{
+   uint32_t hash = 2166136261u;
+   for (int i = 0; i < len; i++)
+   {
+      hash = (hash ^ (unsigned char)str[i]) * 16777619u;
+   }
+   return hash & (PACK_STRINGS - 1);
+}
+
+// Execution profile, one execution count and one tick total for every instruction of the compiled program
+typedef struct
+{
+   long long *counts;
+   uint64_t *ticks;
+   int len;
+} Profile;
+
+// Number of lines listed in the hot line report
+#define PROFILE_HOT_LINES 20
+
+// Events kept by an execution trace unless another number is asked for, see enable_trace
+#define TRACE_EVENTS (1 << 20)
+
+#define TRACE_MAGIC "A4TR"
+
+// Bumped whenever anything written to a trace changes meaning
+#define TRACE_VERSION 2
+
+// Sections of a trace file start on this alignment
+#define TRACE_ALIGN 16
+
+// Flags of a trace event: the instruction writes a variable, the variable was set before it, and the instruction
+// finished so after holds the value it left behind
+#define TRACE_WRITE 1
+#define TRACE_WAS_SET 2
+#define TRACE_DONE 4
+
+// Start of a trace file, see trace.c
+// It is followed by the variable names and a description of every instruction, then the ring of events
+typedef struct
+{
+   char magic[4];
+   uint32_t version;
+   uint32_t eventSize;
+   int32_t programLen;
+   int32_t intNamesLen;
+   int32_t unused;
+
+   // Offset of the ring and the number of events it holds, a power of two
+   uint64_t events;
+   uint64_t capacity;
+
+   // Events recorded since the program started, event i is at i % capacity and the last capacity are kept
+   uint64_t count;
+} TraceHeader;
+
+// Describes an instruction in a trace file, followed by textLen bytes of the command it was compiled from
+typedef struct
+{
+   int32_t line;
+   int32_t commandType;
+
+   // Variable the instruction writes, -1 for none
+   int32_t slot;
+   int32_t textLen;
+} TraceLine;
+
+// One instruction run, with the value of the variable it writes before and after
+typedef struct
+{
+   int32_t index;
+   uint8_t opcode;
+   uint8_t flags;
+   uint16_t unused;
+   int64_t before;
+   int64_t after;
+} TraceEvent;
+
+// Execution trace written by execute_runtime once enabled with enable_trace
+// The file is mapped shared, so the events recorded so far are in it even when the interpreter is killed
+typedef struct
+{
+   TraceHeader *header;
+   TraceEvent *events;
+   uint64_t mask;
+   size_t size;
+
+   // Variable written by every instruction of the program, -1 for none
+   int *writes;
+} Trace;
+
+// Loop whose body only adds constants to variables, ending in an if and a goto back to its first instruction
+// OP_LOOP replaces the first instruction of the body and works out the values after the last iteration in one go
+typedef struct
+{
+   // Instruction OP_LOOP replaced, it runs instead when the loop can not be computed
+   Instruction head;
+
+   // Slot the if tests that the body changes, or its left operand when the body changes neither
+   int counter;
+
+   // Slot the counter is compared with
+   int limit;
+
+   // OP_IF_* opcode with the counter on the left
+   int compare;
+
+   // Index of the instruction after the goto
+   int exit;
+
+   // Variables the body changes, with the total change over one iteration and the lowest and highest partial sum
+   // of the changes within an iteration, used to check that no value overflows
+   int *slots;
+   long long *deltas;
+   long long *lows;
+   long long *highs;
+   int len;
+} Loop;
+
+// Entry in the symbol table, index is -1 for an empty entry
+typedef struct
+{
+   unsigned int hash;
+   int index;
+} Symbol;
+
+struct Runtime;
+
+// Native code generated by jit_compile, returns the index of the instruction the interpreter continues from
+typedef int (*NativeProgram)(Value *values, uint64_t *set, struct Runtime *runtime);
+
+// Runtime structure
+typedef struct Runtime
+{
+   // Every allocation made while parsing and compiling comes from this arena, including the runtime itself
+   Arena arena;
+
+   // Source text the command tokens point into, either mapped from the file or read into memory
+   // source is NULL when the runtime was built from a buffer owned by the caller
+   // Sources that are read rather than mapped live in the arena
+   char *source;
+   size_t sourceLen;
+   int sourceMapped;
+
+   // Cached image the program, variables and loops live in when the runtime was loaded by load_cached_runtime
+   // There are no commands, line table or symbols then, only what is needed to execute the program
+   char *image;
+   size_t imageLen;
+
+   // Commands are stored by value in one contiguous array
+   Command *commands;
+   int commandsLen;
+   int commandsCapacity;
+
+   // Line number to command index lookup, built once after parsing, see build_line_table
+   // Dense: lineTable[line_number - lineBase] is the command index or -1
+   // Sparse: lineTable holds the command indices sorted by line number and is binary searched
+   int *lineTable;
+   int lineTableLen;
+   int lineBase;
+   int lineTableDense;
+
+   // Track the length of the int names and int values arrays
+   // intValuesLen also counts the constant slots appended after the variables by compile_runtime
+   int intNamesLen;
+   int intValuesLen;
+
+   // Allocated length of intNames and intValues, see grow_variables
+   int intCapacity;
+
+   // Used to store the names of the int variables, constant slots have an empty name
+   Token *intNames;
+
+   // Used to store the values of the int variables and constant slots
+   Value *intValues;
+
+   // Bitset with a bit for every entry in intValues, the bit is 1 if the value is set
+   uint64_t *intValuesSet;
+
+   // Open addressing hash table from variable name to index in intNames and intValues
+   Symbol *symbols;
+   int symbolsLen;
+   int symbolsCapacity;
+
+   // Open addressing hash table from value to constant slot, built on first use by constant_slot
+   Symbol *constants;
+   int constantsLen;
+   int constantsCapacity;
+
+   // Program counter and begin and end line numbers
+   int pc;
+   int begin_line;
+   int end_line;
+
+   // Flags to check if begin and end commands are present
+   int begin_flag;
+   int end_flag;
+
+   // Compiled program, commandsLen instructions followed by two OP_HALT sentinels
+   Instruction *program;
+   int programLen;
+
+   // Index of the instruction for the begin command
+   int entry;
+
+   // Loops run by OP_LOOP
+   Loop *loops;
+   int loopsLen;
+   int loopsCapacity;
+
+   // What arithmetic does when it overflows, one of OVERFLOW_WRAP to OVERFLOW_SATURATE, see a4_set_overflow
+   int overflow;
+
+   // 1 when verify_program has proven every instruction, so the program runs in a loop without any set checks
+   int verified;
+
+   // Native code for the compiled program, NULL unless jit_compile has been called
+   NativeProgram native;
+   size_t nativeSize;
+
+   // Where PRINT output goes in the non graphics build, shared with other runtimes writing to the same place
+   Output *output;
+
+   // Filled in by execute_runtime when profiling has been enabled with enable_profile, NULL otherwise
+   Profile *profile;
+
+   // Written by execute_runtime when tracing has been enabled with enable_trace, NULL otherwise
+   Trace *trace;
+
+   // Where a4_run left the program, status is one of A4_READY to A4_DEADLINE and next the index of the instruction
+   // it continues from once it has stopped at the budget or the deadline
+   int status;
+   int next;
+
+   // Instructions a4_run may still run in this call, -1 for no limit, and the CLOCK_MONOTONIC time in nanoseconds
+   // it stops at, 0 for none, see a4_set_time_limit
+   long long budget;
+   uint64_t deadline;
+
+} Runtime;
+
+// Runtime functions
+Runtime *create_runtime(void);
+Runtime *build_runtime_from_file(const char *filename);
+Runtime *build_runtime_from_buffer(const char *source, size_t len);
+Runtime *load_program(const char *filename, int passes, int use_cache);
+int build_line_table(Runtime *runtime);
+int compile_runtime(Runtime *runtime);
+void execute_runtime(Runtime *runtime);
+void free_runtime(Runtime *runtime);
+
+// Optimizer functions
+int optimize_runtime(Runtime *runtime, int passes);
+int fuse_program(Runtime *runtime);
+int fold_program(Runtime *runtime);
+int loop_program(Runtime *runtime);
+int run_loop(Runtime *runtime, Loop *loop);
+long long loop_trip_count(long long start, long long step, long long limit, int compare);
+int optimization_from_name(const char *name);
+
+// Verifier functions, see verify.c
+int verify_program(Runtime *runtime);
+
+// Parse functions
+int parse_source(Runtime *runtime, const char *source, size_t len);
+int parse_lines(Runtime *runtime, const char *source, size_t len);
+int parse_line(Runtime *runtime, int n, const char *line, int len);
+int parse_arg(Runtime *runtime, int n, Token token, int i);
+int declare_variable(Runtime *runtime, Token name);
+
+// Parallel parse functions, see parse.c
+int parse_threads(size_t len);
+int parse_parallel(Runtime *runtime, const char *source, size_t len, int threads);
+
+// JIT functions, see jit.c
+int jit_compile(Runtime *runtime);
+void jit_free(Runtime *runtime);
+void jit_print(Runtime *runtime, int idx);
+
+// Emit functions, see emit.c
+int emit_c(Runtime *runtime, const char *source_name, FILE *file);
+
+// Cache functions, see cache.c
+Runtime *load_cached_runtime(const char *filename, int passes);
+int save_cached_runtime(Runtime *runtime, const char *filename, int passes);
+uint64_t hash_bytes(const char *data, size_t len);
+
+// Profile functions
+int enable_profile(Runtime *runtime);
+void print_profile(Runtime *runtime, FILE *file);
+int write_profile(Runtime *runtime, const char *filename);
+
+// Ticks used by the profiler, CPU cycles where the time stamp counter can be read and nanoseconds otherwise
+#if defined(__x86_64__) || defined(__i386__)
+#define TICK_UNIT "cycles"
+static inline uint64_t read_ticks(void)
+{
+   return __rdtsc();
+}
+#else
+#define TICK_UNIT "ns"
+static inline uint64_t read_ticks(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#endif
+
+// Snapshot functions, see snapshot.c
+uint64_t hash_program(Runtime *runtime);
+int a4_snapshot(Runtime *runtime, char **data, size_t *len);
+int a4_restore(Runtime *runtime, const char *data, size_t len);
+
+// Trace functions, see trace.c
+int enable_trace(Runtime *runtime, const char *filename, long long events);
+void free_trace(Runtime *runtime);
+
+// Batch functions, see batch.c
+int run_batch(char **files, int count, int threads, int passes, int native, int use_cache, int overflow);
+int read_manifest(const char *filename, char ***files, int *count);
+
+// Sweep functions, see sweep.c
+int parse_sweep(const char *spec, char **name, Value **values, int *count);
+int run_sweep(Runtime *runtime, const char *name, const Value *values, int count);
+
+// Pack functions, see pack.c
+int pack_output(Output *output, int header);
+void pack_append(Output *output, Output *from);
+void free_pack(Output *output);
+void pack_print(Output *output, Value val1, Value val2, const char *str, int len);
+void pack_text(Output *output, const char *data, int len);
+void pack_finish(Output *output);
+
+// Serve functions, see serve.c
+int run_server(const char *path, int passes, int native, int use_cache, int overflow);
+
+// Library functions, for embedding the interpreter, see liba4.a in the makefile
+Runtime *a4_parse_buffer(const char *source, size_t len);
+int a4_execute(Runtime *runtime, OutputCallback callback, void *context);
+int a4_run(Runtime *runtime, long long max_instructions, OutputCallback callback, void *context);
+void a4_set_time_limit(Runtime *runtime, long long nanoseconds);
+int a4_set_overflow(Runtime *runtime, int overflow);
+int overflow_from_name(const char *name);
+void a4_set_error_callback(OutputCallback callback, void *context);
+void a4_free(Runtime *runtime);
+
+// Output functions
+void report(const char *format, ...);
+void set_report_output(Output *output);
+void init_output(Output *output, int fd);
+void output_print(Output *output, Value val1, Value val2, const char *str, int len);
+void output_write(Output *output, const char *data, int len);
+void output_append(Output *output, const char *data, int len);
+void flush_output(Output *output);
+
+// Arena functions
+void *arena_alloc(Arena *arena, size_t size);
+void *arena_grow(Arena *arena, void *ptr, size_t old_size, size_t new_size);
+void arena_free(Arena *arena);
+
+// Helper functions
+void print_runtime(Runtime *runtime);
+unsigned int hash_name(Token name);
+int define_symbol(Runtime *runtime, Token arg, int index);
+int is_defined(Runtime *runtime, Token arg);
+int is_set(Runtime *runtime, Token arg);
+int add_slot(Runtime *runtime, Token name, int value, int set);
+int grow_variables(Runtime *runtime, int needed);
+int resolve_operand(Runtime *runtime, Token arg);
+int constant_slot(Runtime *runtime, int value);
+int determine_if_opcode(Token op);
+int check_arguments(int command_type, int argc, int line_number);
+int determine_command_type(Token token);
+int get_command_by_line_number(Runtime *runtime, int line_number);
+const char *command_type_to_string(int command_type);
+int is_integer(Token token);
+int scan_integer(Token token, int *value);
+int token_equals(Token token, const char *str);
+int token_to_int(Token token);
+
+#endif
@@ -0,0 +1,183 @@
+/* Decoder for execution traces
+        -prints the events of a trace written by a4 --trace, oldest first, with the command run and the change it
+         made to its variable
+        -only needs the trace file, which names the variables and holds the text of every command
+        -build with make a4trace
+*/
+
+#include "a4.h"
+
+# pragma region Decoder Functions
+
+// Instruction of the traced program, the text points into the trace file
+typedef struct
+{
+   TraceLine line;
+   const char *text;
+} DecodedLine;
+
+// Print one event, step is its position in the run counting from 1
+static void print_event(TraceEvent *event, uint64_t step, DecodedLine *lines, int programLen, Token *names, int namesLen)
+{
+   if (event->index < 0 || event->index >= programLen)
+   {
+      printf("%12llu  invalid event\n", (unsigned long long)step);
+      return;
+   }
+
+   DecodedLine *line = &lines[event->index];
+   printf("%12llu %6d  %-32.*s", (unsigned long long)step, line->line.line, line->line.textLen, line->text);
+
+   if ((event->flags & TRACE_WRITE) && line->line.slot >= 0 && line->line.slot < namesLen)
+   {
+      Token name = names[line->line.slot];
+      printf("  %.*s ", name.len, name.str);
+      if (event->flags & TRACE_WAS_SET)
+         printf("%lld", (long long)event->before);
+      else
+         printf("unset");
+
+      // The last event of a run that was killed or stopped at an error never finished
+      if (event->flags & TRACE_DONE)
+         printf(" -> %lld", (long long)event->after);
+      else
+         printf(" -> did not finish");
+   }
+
+   printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+   long long last = -1;
+   int c;
+
+   // -n <events> only prints the last events events
+   while ((c = getopt(argc, argv, "n:")) != -1)
+   {
+      switch (c)
+      {
+         case 'n':
+            last = atoll(optarg);
+            break;
+         default:
+            printf("Usage: %s [-n <events>] <trace>\n", argv[0]);
+            return -1;
+      }
+   }
+
+   if (argc - optind != 1)
+   {
+      printf("Usage: %s [-n <events>] <trace>\n", argv[0]);
+      return -1;
+   }
+
+   const char *filename = argv[optind];
+   int fd = open(filename, O_RDONLY);
+   if (fd == -1)
+   {
+      printf("Error opening file %s\n", filename);
+      return -1;
+   }
+
+   struct stat st;
+   char *data = MAP_FAILED;
+   if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(TraceHeader))
+      data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+
+   TraceHeader *header = (TraceHeader *)data;
+   if (data == MAP_FAILED || memcmp(header->magic, TRACE_MAGIC, 4) != 0 || header->version != TRACE_VERSION ||
+       header->eventSize != sizeof(TraceEvent) || header->programLen < 0 || header->intNamesLen < 0)
+   {
+      printf("Error: %s is not a trace\n", filename);
+      if (data != MAP_FAILED)
+         munmap(data, st.st_size);
+      return -1;
+   }
+
+   size_t size = st.st_size;
+   Token *names = malloc(sizeof(Token) * (header->intNamesLen + 1));
+   DecodedLine *lines = malloc(sizeof(DecodedLine) * (header->programLen + 1));
+   if (names == NULL || lines == NULL)
+   {
+      printf("Error: Could not allocate memory for the trace\n");
+      free(names);
+      free(lines);
+      munmap(data, size);
+      return -1;
+   }
+
+   // Variable names and instructions follow the header, every length is checked against the file
+   size_t at = (sizeof(TraceHeader) + TRACE_ALIGN - 1) & ~(size_t)(TRACE_ALIGN - 1);
+   int damaged = 0;
+   for (int v = 0; v < header->intNamesLen && !damaged; v++)
+   {
+      uint32_t len;
+      if (at + sizeof(len) > size)
+      {
+         damaged = 1;
+         break;
+      }
+      memcpy(&len, data + at, sizeof(len));
+      at += sizeof(len);
+      if (len > size - at)
+      {
+         damaged = 1;
+         break;
+      }
+      names[v].str = data + at;
+      names[v].len = len;
+      at += len;
+   }
+
+   for (int i = 0; i < header->programLen && !damaged; i++)
+   {
+      if (at + sizeof(TraceLine) > size)
+      {
+         damaged = 1;
+         break;
+      }
+      memcpy(&lines[i].line, data + at, sizeof(TraceLine));
+      at += sizeof(TraceLine);
+      if (lines[i].line.textLen < 0 || (size_t)lines[i].line.textLen > size - at)
+      {
+         damaged = 1;
+         break;
+      }
+      lines[i].text = data + at;
+      at += lines[i].line.textLen;
+   }
+
+   uint64_t capacity = header->capacity;
+   if (damaged || capacity == 0 || (capacity & (capacity - 1)) != 0 || header->events < at ||
+       header->events > size || capacity > (size - header->events) / sizeof(TraceEvent))
+   {
+      printf("Error: Trace %s is damaged\n", filename);
+      free(names);
+      free(lines);
+      munmap(data, size);
+      return -1;
+   }
+
+   TraceEvent *events = (TraceEvent *)(data + header->events);
+   uint64_t count = header->count;
+   uint64_t kept = count < capacity ? count : capacity;
+   if (last >= 0 && (uint64_t)last < kept)
+      kept = last;
+
+   printf("%llu instructions run, the last %llu of them follow\n", (unsigned long long)count, (unsigned long long)kept);
+   printf("%12s %6s  %-32s  %s\n", "step", "line", "command", "change");
+
+   for (uint64_t step = count - kept; step < count; step++)
+   {
+      print_event(&events[step & (capacity - 1)], step + 1, lines, header->programLen, names, header->intNamesLen);
+   }
+
+   free(names);
+   free(lines);
+   munmap(data, size);
+   return 0;
+}
+
+# pragma endregion
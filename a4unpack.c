@@ -0,0 +1,262 @@
+/* Decoder for compressed output
+        -turns the stream written by a4ng --compress back into the text a4ng would have printed
+        -reads the stream as it comes, from a file or from stdin, so it can sit at the end of a pipe
+        -build with make a4unpack
+*/
+
+#include "a4.h"
+
+# pragma region Decoder Functions
+
+// Lines kept for repeats, the same as the encoder keeps
+#define UNPACK_HISTORY 8
+
+// String of the table or of a line, a copy of its own as the slot it came from can be taken over
+typedef struct
+{
+   char *str;
+   int len;
+   int capacity;
+} UnpackString;
+
+// A line already printed, with the steps its row and col took from the line before
+typedef struct
+{
+   UnpackString string;
+   uint64_t rowStep;
+   uint64_t colStep;
+} UnpackLine;
+
+typedef struct
+{
+   FILE *in;
+   FILE *out;
+
+   UnpackString strings[PACK_STRINGS];
+   UnpackLine history[UNPACK_HISTORY];
+   uint64_t lines;
+
+   // Row and col of the last line, kept as 64 bit whatever the width the stream was written with
+   uint64_t row;
+   uint64_t col;
+} Unpack;
+
+// Read an unsigned LEB128 varint, returns -1 at the end of the stream or on a varint too long for 64 bits
+static int read_varint(Unpack *unpack, uint64_t *n)
+{
+   *n = 0;
+   for (int shift = 0; shift < 64; shift += 7)
+   {
+      int c = getc(unpack->in);
+      if (c == EOF)
+         return -1;
+      *n |= (uint64_t)(c & 0x7f) << shift;
+      if (!(c & 0x80))
+         return 1;
+   }
+   return -1;
+}
+
+// Make room for len bytes in a string, returns -1 when there is not enough memory
+// A string that has been filled is never NULL, even when it is empty
+static int reserve_string(UnpackString *string, int len)
+{
+   if (len + 1 > string->capacity)
+   {
+      char *grown = realloc(string->str, len + 1);
+      if (grown == NULL)
+         return -1;
+      string->str = grown;
+      string->capacity = len + 1;
+   }
+
+   string->len = len;
+   return 1;
+}
+
+// Read len bytes of a string from the stream into string, returns -1 when they are not all there
+static int read_string(Unpack *unpack, UnpackString *string, uint64_t len)
+{
+   if (len >= INT_MAX || reserve_string(string, len) == -1)
+      return -1;
+
+   return fread(string->str, 1, len, unpack->in) == len ? 1 : -1;
+}
+
+// Print a line with the given string and steps the way a4ng prints it, and remember it for repeats
+static int print_line(Unpack *unpack, const UnpackString *string, uint64_t rowStep, uint64_t colStep)
+{
+   // Steps are zigzag encoded and wrap around in 64 bits
+   unpack->row += (rowStep >> 1) ^ (0 - (rowStep & 1));
+   unpack->col += (colStep >> 1) ^ (0 - (colStep & 1));
+   fprintf(unpack->out, "%lld %lld %.*s\n", (long long)unpack->row, (long long)unpack->col, string->len, string->str);
+
+   UnpackLine *line = &unpack->history[unpack->lines % UNPACK_HISTORY];
+   line->rowStep = rowStep;
+   line->colStep = colStep;
+   unpack->lines++;
+   if (reserve_string(&line->string, string->len) == -1)
+      return -1;
+   memcpy(line->string.str, string->str, string->len);
+   return 1;
+}
+
+// Decode records until the end of the stream, returns -1 when it ends in the middle of one or makes no sense
+static int unpack_stream(Unpack *unpack)
+{
+   int tag;
+   UnpackString text = {NULL, 0, 0};
+   int result = 1;
+
+   while (result == 1 && (tag = getc(unpack->in)) != EOF)
+   {
+      uint64_t a, b, c;
+      switch (tag)
+      {
+         case PACK_TEXT:
+         {
+            result = read_varint(unpack, &a) == 1 ? read_string(unpack, &text, a) : -1;
+            if (result == 1)
+               fwrite(text.str, 1, text.len, unpack->out);
+            break;
+         }
+         case PACK_STRING:
+         {
+            // Read into the spare string and swap it into the table, the slot's old string may be the last line's
+            result = read_varint(unpack, &a) == 1 ? read_string(unpack, &text, a) : -1;
+            if (result == 1 && read_varint(unpack, &b) == 1 && read_varint(unpack, &c) == 1)
+            {
+               UnpackString *slot = &unpack->strings[pack_hash(text.str, text.len)];
+               UnpackString old = *slot;
+               *slot = text;
+               text = old;
+               result = print_line(unpack, slot, b, c);
+            }
+            else
+            {
+               result = -1;
+            }
+            break;
+         }
+         case PACK_PRINT:
+         {
+            if (read_varint(unpack, &a) == 1 && a < PACK_STRINGS && unpack->strings[a].str != NULL &&
+                read_varint(unpack, &b) == 1 && read_varint(unpack, &c) == 1)
+               result = print_line(unpack, &unpack->strings[a], b, c);
+            else
+               result = -1;
+            break;
+         }
+         case PACK_SAME:
+         {
+            if (unpack->lines > 0 && read_varint(unpack, &b) == 1 && read_varint(unpack, &c) == 1)
+            {
+               UnpackLine *last = &unpack->history[(unpack->lines - 1) % UNPACK_HISTORY];
+               result = print_line(unpack, &last->string, b, c);
+            }
+            else
+            {
+               result = -1;
+            }
+            break;
+         }
+         case PACK_REPEAT:
+         {
+            if (read_varint(unpack, &a) != 1 || a == 0 || a > PACK_PERIODS || a > unpack->lines ||
+                read_varint(unpack, &b) != 1)
+            {
+               result = -1;
+               break;
+            }
+
+            // The period is less than the history, so the line copied from is never the one written
+            for (uint64_t i = 0; i < b && result == 1; i++)
+            {
+               UnpackLine *line = &unpack->history[(unpack->lines - a) % UNPACK_HISTORY];
+               result = print_line(unpack, &line->string, line->rowStep, line->colStep);
+            }
+            break;
+         }
+         case PACK_RESET:
+         {
+            // A slot of the table only counts again once a string fills it
+            for (int s = 0; s < PACK_STRINGS; s++)
+            {
+               free(unpack->strings[s].str);
+               unpack->strings[s] = (UnpackString){NULL, 0, 0};
+            }
+            unpack->lines = 0;
+            unpack->row = 0;
+            unpack->col = 0;
+            break;
+         }
+         default:
+         {
+            result = -1;
+            break;
+         }
+      }
+   }
+
+   free(text.str);
+   return result;
+}
+
+int main(int argc, char *argv[])
+{
+   if (argc > 2)
+   {
+      printf("Usage: %s [<file>]\n", argv[0]);
+      return -1;
+   }
+
+   // Without a file the stream is read from stdin
+   const char *filename = argc == 2 ? argv[1] : "-";
+   FILE *in = strcmp(filename, "-") == 0 ? stdin : fopen(filename, "rb");
+   if (in == NULL)
+   {
+      printf("Error opening file %s\n", filename);
+      return -1;
+   }
+
+   char header[5];
+   if (fread(header, 1, sizeof(header), in) != sizeof(header) || memcmp(header, PACK_MAGIC, 4) != 0 ||
+       header[4] != PACK_VERSION)
+   {
+      fprintf(stderr, "Error: %s is not compressed output\n", filename);
+      if (in != stdin)
+         fclose(in);
+      return -1;
+   }
+
+   Unpack *unpack = calloc(1, sizeof(Unpack));
+   if (unpack == NULL)
+   {
+      fprintf(stderr, "Error: Could not allocate memory for the decoder\n");
+      if (in != stdin)
+         fclose(in);
+      return -1;
+   }
+
+   unpack->in = in;
+   unpack->out = stdout;
+   int result = unpack_stream(unpack);
+   fflush(stdout);
+   if (result == -1)
+      fprintf(stderr, "Error: %s is damaged or cut short\n", filename);
+
+   for (int s = 0; s < PACK_STRINGS; s++)
+   {
+      free(unpack->strings[s].str);
+   }
+   for (int l = 0; l < UNPACK_HISTORY; l++)
+   {
+      free(unpack->history[l].string.str);
+   }
+   free(unpack);
+   if (in != stdin)
+      fclose(in);
+   return result == -1 ? -1 : 0;
+}
+
+# pragma endregion
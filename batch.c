@@ -0,0 +1,329 @@
+/* Batch mode, many programs run by one process
+        -every program is built and run on one of a pool of threads, each with its own runtime and output
+        -every thread starts with its own share of the programs and steals from the others once it runs out
+        -output is collected per program and written out in the order the programs were given
+*/
+
+#include "a4.h"
+#include <pthread.h>
+
+# pragma region Batch Functions
+
+// One program to run, and what it printed once done is set
+typedef struct
+{
+   const char *filename;
+   char *output;
+   size_t outputLen;
+   int failed;
+   int done;
+} Job;
+
+// Jobs still to be run by one thread, lo to hi - 1
+// The thread itself takes from the front so programs finish roughly in order, thieves take from the back
+typedef struct
+{
+   pthread_mutex_t lock;
+   int lo;
+   int hi;
+} Deque;
+
+typedef struct
+{
+   Job *jobs;
+   int count;
+
+   Deque *deques;
+   int threads;
+
+   int passes;
+   int native;
+   int useCache;
+   int overflow;
+
+   // Signalled whenever a job is done, the main thread waits on it to write the output out in order
+   pthread_mutex_t lock;
+   pthread_cond_t finished;
+} Batch;
+
+typedef struct
+{
+   Batch *batch;
+   int id;
+} Worker;
+
+// Take the next job from the front of a thread's own deque, or from the back of another's when steal is set
+// Returns -1 when the deque is empty
+static int take_job(Deque *deque, int steal)
+{
+   int job = -1;
+
+   pthread_mutex_lock(&deque->lock);
+   if (deque->lo < deque->hi)
+      job = steal ? --deque->hi : deque->lo++;
+   pthread_mutex_unlock(&deque->lock);
+
+   return job;
+}
+
+// Build and run one program, collecting everything it prints and every error reported about it
+static void run_job(Batch *batch, Job *job)
+{
+   Output *output = malloc(sizeof(Output));
+   if (output == NULL)
+   {
+      job->failed = 1;
+   }
+   else
+   {
+      init_output(output, -1);
+
+      set_report_output(output);
+
+      Runtime *runtime = load_program(job->filename, batch->passes, batch->useCache);
+      if (runtime != NULL)
+      {
+         runtime->output = output;
+         runtime->overflow = batch->overflow;
+
+         // The interpreter runs the program when there is no native code for it
+         if (batch->native)
+            jit_compile(runtime);
+
+         execute_runtime(runtime);
+         free_runtime(runtime);
+      }
+
+      flush_output(output);
+      set_report_output(NULL);
+
+      job->output = output->memory;
+      job->outputLen = output->memoryLen;
+      free(output);
+   }
+
+   pthread_mutex_lock(&batch->lock);
+   job->done = 1;
+   pthread_cond_broadcast(&batch->finished);
+   pthread_mutex_unlock(&batch->lock);
+}
+
+// Run jobs until every deque is empty, there are never new jobs once the batch has started
+static void *run_worker(void *arg)
+{
+   Worker *worker = arg;
+   Batch *batch = worker->batch;
+
+   while (1)
+   {
+      int job = take_job(&batch->deques[worker->id], 0);
+
+      // Look for work on every other thread, starting with the next one so thieves spread out
+      for (int i = 1; job == -1 && i < batch->threads; i++)
+      {
+         job = take_job(&batch->deques[(worker->id + i) % batch->threads], 1);
+      }
+
+      if (job == -1)
+         break;
+
+      run_job(batch, &batch->jobs[job]);
+   }
+
+   return NULL;
+}
+
+// Run count programs on threads threads, 0 for one per CPU, writing their output to stdout in order
+// Passes, native, use_cache and overflow apply to every program as they do for a single one, see main
+int run_batch(char **files, int count, int threads, int passes, int native, int use_cache, int overflow)
+{
+   if (count == 0)
+   {
+      return 0;
+   }
+
+   if (threads <= 0)
+      threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+   if (threads <= 0)
+      threads = 1;
+   if (threads > count)
+      threads = count;
+
+   Batch batch;
+   batch.count = count;
+   batch.threads = threads;
+   batch.passes = passes;
+   batch.native = native;
+   batch.useCache = use_cache;
+   batch.overflow = overflow;
+   batch.jobs = calloc(count, sizeof(Job));
+   batch.deques = malloc(sizeof(Deque) * threads);
+   Worker *workers = malloc(sizeof(Worker) * threads);
+   pthread_t *ids = malloc(sizeof(pthread_t) * threads);
+
+   if (batch.jobs == NULL || batch.deques == NULL || workers == NULL || ids == NULL)
+   {
+      report("Error: Could not allocate memory for the batch\n");
+      free(batch.jobs);
+      free(batch.deques);
+      free(workers);
+      free(ids);
+      return -1;
+   }
+
+   pthread_mutex_init(&batch.lock, NULL);
+   pthread_cond_init(&batch.finished, NULL);
+
+   for (int i = 0; i < count; i++)
+   {
+      batch.jobs[i].filename = files[i];
+   }
+
+   // Every thread starts with an equal run of consecutive programs
+   for (int t = 0; t < threads; t++)
+   {
+      pthread_mutex_init(&batch.deques[t].lock, NULL);
+      batch.deques[t].lo = (int)((long long)count * t / threads);
+      batch.deques[t].hi = (int)((long long)count * (t + 1) / threads);
+   }
+
+   // Threads that can not be started leave their programs to be stolen by the others, or run on this thread
+   int started = 0;
+   for (int t = 0; t < threads; t++)
+   {
+      workers[t].batch = &batch;
+      workers[t].id = t;
+      if (pthread_create(&ids[t], NULL, run_worker, &workers[t]) == 0)
+         started++;
+      else
+         ids[t] = pthread_self();
+   }
+
+   if (started == 0)
+      run_worker(&workers[0]);
+
+   // Write every program's output out as soon as it and every program before it are done
+   for (int i = 0; i < count; i++)
+   {
+      Job *job = &batch.jobs[i];
+
+      pthread_mutex_lock(&batch.lock);
+      while (!job->done)
+         pthread_cond_wait(&batch.finished, &batch.lock);
+      pthread_mutex_unlock(&batch.lock);
+
+      if (job->failed)
+         printf("Error: Could not allocate memory for the output of %s\n", job->filename);
+      else if (job->outputLen > 0)
+         fwrite(job->output, 1, job->outputLen, stdout);
+
+      free(job->output);
+      job->output = NULL;
+   }
+
+   fflush(stdout);
+
+   // Threads still look at every deque until they are all empty, so none is destroyed before all have finished
+   for (int t = 0; t < threads; t++)
+   {
+      if (!pthread_equal(ids[t], pthread_self()))
+         pthread_join(ids[t], NULL);
+   }
+
+   for (int t = 0; t < threads; t++)
+   {
+      pthread_mutex_destroy(&batch.deques[t].lock);
+   }
+
+   pthread_mutex_destroy(&batch.lock);
+   pthread_cond_destroy(&batch.finished);
+   free(batch.jobs);
+   free(batch.deques);
+   free(workers);
+   free(ids);
+   return 0;
+}
+
+// Read the files listed in a manifest, one per line, skipping blank lines and lines starting with #
+// files is one allocation, the array followed by the names it points to, and is freed with free
+int read_manifest(const char *filename, char ***files, int *count)
+{
+   FILE *file = fopen(filename, "r");
+   if (file == NULL)
+   {
+      report("Error opening file %s\n", filename);
+      return -1;
+   }
+
+   char *text = NULL;
+   size_t len = 0;
+   size_t capacity = 0;
+   size_t bytes;
+
+   do
+   {
+      if (len == capacity)
+      {
+         capacity = capacity > 0 ? capacity * 2 : 4096;
+         char *grown = realloc(text, capacity);
+         if (grown == NULL)
+         {
+            report("Error: Could not allocate memory for manifest %s\n", filename);
+            free(text);
+            fclose(file);
+            return -1;
+         }
+         text = grown;
+      }
+
+      bytes = fread(text + len, 1, capacity - len, file);
+      len += bytes;
+   } while (bytes > 0);
+
+   fclose(file);
+
+   int lines = 1;
+   for (size_t i = 0; i < len; i++)
+   {
+      if (text[i] == '\n')
+         lines++;
+   }
+
+   char **names = malloc(sizeof(char *) * lines + len + 1);
+   if (names == NULL)
+   {
+      report("Error: Could not allocate memory for manifest %s\n", filename);
+      free(text);
+      return -1;
+   }
+
+   char *copy = (char *)(names + lines);
+   memcpy(copy, text, len);
+   copy[len] = '\0';
+   free(text);
+
+   int n = 0;
+   char *line = copy;
+   while (line != NULL)
+   {
+      char *next = strchr(line, '\n');
+      if (next != NULL)
+         *next++ = '\0';
+
+      // Trailing carriage returns and spaces are not part of the name
+      size_t end = strlen(line);
+      while (end > 0 && isspace((unsigned char)line[end - 1]))
+         line[--end] = '\0';
+
+      if (line[0] != '\0' && line[0] != '#')
+         names[n++] = line;
+
+      line = next;
+   }
+
+   *files = names;
+   *count = n;
+   return 1;
+}
+
+# pragma endregion
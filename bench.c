@@ -0,0 +1,589 @@
+/* Benchmark driver for the interpreter
+        -generates programs along several axes, parses and runs each one and reports how long both steps took
+        -build with make bench
+*/
+
+#include "a4.h"
+#include <stdarg.h>
+#include <limits.h>
+#include <time.h>
+
+// Instructions executed by each generated program unless -n is given
+#define DEFAULT_INSTRUCTIONS 10000000
+
+// Number of times each program is parsed and executed, the fastest run is reported
+#define DEFAULT_REPEATS 5
+
+// Maximum number of parameters for one workload
+#define MAX_PARAMS 16
+
+// Growable text buffer the programs are generated into
+typedef struct
+{
+   char *data;
+   size_t len;
+   size_t capacity;
+
+   // Line number of the next line
+   int line;
+} Source;
+
+// Generated program and what running it costs
+typedef struct
+{
+   Source source;
+
+   // Number of lines in the program
+   int commands;
+
+   // Exact number of source instructions the program executes, as a4 would run them line by line
+   // Fusion and constant propagation dispatch fewer, so the rates reported are per source instruction
+   long long instructions;
+} Workload;
+
+// Generates a program for a workload parameter, aiming for roughly target instructions executed
+typedef void (*Generator)(Workload *workload, int param, long long target);
+
+// Workload axis, params holds the values used when none are given on the command line
+typedef struct
+{
+   const char *name;
+   const char *param_name;
+   Generator generate;
+   int params[MAX_PARAMS];
+   int paramsLen;
+} Axis;
+
+// Source functions
+void emit(Source *source, const char *format, ...) __attribute__((format(printf, 2, 3)));
+int next_line(Source *source);
+
+// Generators
+void generate_straight(Workload *workload, int length, long long target);
+void generate_loops(Workload *workload, int depth, long long target);
+void generate_vars(Workload *workload, int count, long long target);
+void generate_gotos(Workload *workload, int density, long long target);
+void generate_parse(Workload *workload, int klines, long long target);
+
+// Benchmark functions
+double now(void);
+void run_workload(const Axis *axis, int param, long long target, int repeats, int passes, int native, Output *output);
+
+static const Axis axes[] = {
+   {"straight", "length", generate_straight, {10, 100, 1000, 10000, 100000}, 5},
+   {"loops", "depth", generate_loops, {1, 2, 3, 4, 6}, 5},
+   {"vars", "count", generate_vars, {10, 100, 1000, 10000}, 4},
+   {"gotos", "density", generate_gotos, {0, 10, 25, 50, 100}, 5},
+   {"parse", "klines", generate_parse, {10, 100, 1000}, 3},
+};
+
+#define AXES ((int)(sizeof(axes) / sizeof(axes[0])))
+
+int main(int argc, char *argv[])
+{
+   long long target = DEFAULT_INSTRUCTIONS;
+   int repeats = DEFAULT_REPEATS;
+   // Loops computed in one step would skip the instructions being measured, so that pass is never run
+   int passes = OPT_ALL & ~OPT_LOOPS;
+   int native = 0;
+   int c;
+
+   // -n <instructions> sets how many source instructions each program should execute
+   // -r <repeats> sets how many times each program is parsed and run
+   // -d <pass> disables an optimization pass, like it does for a4ng, loops are never computed in one step
+   // -j runs the programs as native code, like it does for a4ng
+   while ((c = getopt(argc, argv, "n:r:d:j")) != -1)
+   {
+      switch (c)
+      {
+         case 'n':
+            target = atoll(optarg);
+            break;
+         case 'r':
+            repeats = atoi(optarg);
+            break;
+         case 'd':
+         {
+            int pass = optimization_from_name(optarg);
+            if (pass == -1)
+            {
+               printf("Error: Unknown optimization %s\n", optarg);
+               return -1;
+            }
+            passes &= ~pass;
+            break;
+         }
+         case 'j':
+            native = 1;
+            break;
+         default:
+            printf("Usage: %s [-n <instructions>] [-r <repeats>] [-d <pass>] [-j] [workload [param...]]\n", argv[0]);
+            return -1;
+      }
+   }
+
+   // Superinstructions are left to the interpreter by native code, a4ng leaves them out too
+   if (native)
+      passes &= ~OPT_FUSE;
+
+   if (target < 1 || repeats < 1)
+   {
+      printf("Error: -n and -r must be positive\n");
+      return -1;
+   }
+
+   // PRINT output is thrown away so that terminal speed does not end up in the numbers
+   Output *output = malloc(sizeof(Output));
+   if (output == NULL)
+   {
+      printf("Error: Could not allocate memory for the output buffer\n");
+      return -1;
+   }
+   init_output(output, open("/dev/null", O_WRONLY));
+   if (output->fd == -1)
+   {
+      printf("Error: Could not open /dev/null: %s\n", strerror(errno));
+      free(output);
+      return -1;
+   }
+
+   printf("%-9s %-12s %8s %10s %8s %10s %12s %10s %8s\n",
+          "workload", "param", "lines", "parse ms", "MB/s", "exec ms", "instructions", "Minstr/s", "ns/instr");
+
+   int found = 0;
+   for (int a = 0; a < AXES; a++)
+   {
+      const Axis *axis = &axes[a];
+
+      // Run every workload, or only the one named on the command line
+      if (optind < argc && strcmp(argv[optind], axis->name) != 0)
+      {
+         continue;
+      }
+      found = 1;
+
+      if (optind + 1 < argc)
+      {
+         for (int i = optind + 1; i < argc; i++)
+         {
+            run_workload(axis, atoi(argv[i]), target, repeats, passes, native, output);
+         }
+      }
+      else
+      {
+         for (int i = 0; i < axis->paramsLen; i++)
+         {
+            run_workload(axis, axis->params[i], target, repeats, passes, native, output);
+         }
+      }
+   }
+
+   if (!found)
+   {
+      printf("Error: Unknown workload %s, expected one of", argv[optind]);
+      for (int a = 0; a < AXES; a++)
+      {
+         printf(" %s", axes[a].name);
+      }
+      printf("\n");
+   }
+
+   close(output->fd);
+   free(output);
+   return found ? 0 : -1;
+}
+
+# pragma region Benchmark Functions
+
+// Monotonic time in seconds
+double now(void)
+{
+   struct timespec ts;
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Loop counters are ints, so trip counts are capped
+static long long clamp_iterations(long long iterations)
+{
+   if (iterations < 1)
+      return 1;
+   if (iterations > INT_MAX - 1)
+      return INT_MAX - 1;
+   return iterations;
+}
+
+// Generate the program for one workload parameter, then parse and execute it repeats times and report the
+// fastest parse and the fastest execution
+void run_workload(const Axis *axis, int param, long long target, int repeats, int passes, int native, Output *output)
+{
+   Workload workload = {0};
+   axis->generate(&workload, param, target);
+   if (workload.source.data == NULL)
+   {
+      printf("Error: Could not generate %s %d\n", axis->name, param);
+      return;
+   }
+
+   double best_parse = -1;
+   double best_exec = -1;
+
+   for (int r = 0; r < repeats; r++)
+   {
+      // Parsing includes building the line table, compiling and optimizing the program and generating native code
+      double start = now();
+      Runtime *runtime = build_runtime_from_buffer(workload.source.data, workload.source.len);
+      if (runtime == NULL)
+      {
+         printf("Error: Could not build runtime for %s %d\n", axis->name, param);
+         free(workload.source.data);
+         return;
+      }
+      optimize_runtime(runtime, passes);
+      if (native)
+         jit_compile(runtime);
+      double parsed = now();
+
+      runtime->output = output;
+      execute_runtime(runtime);
+      flush_output(output);
+      double executed = now();
+
+      free_runtime(runtime);
+
+      if (best_parse < 0 || parsed - start < best_parse)
+         best_parse = parsed - start;
+      if (best_exec < 0 || executed - parsed < best_exec)
+         best_exec = executed - parsed;
+   }
+
+   char label[32];
+   snprintf(label, sizeof(label), "%s=%d", axis->param_name, param);
+
+   printf("%-9s %-12s %8d %10.3f %8.1f %10.3f %12lld %10.1f %8.2f\n",
+          axis->name, label, workload.commands, best_parse * 1e3, workload.source.len / best_parse / 1e6,
+          best_exec * 1e3, workload.instructions, workload.instructions / best_exec / 1e6,
+          best_exec * 1e9 / workload.instructions);
+
+   free(workload.source.data);
+}
+
+# pragma endregion
+
+# pragma region Generators
+
+// Instructions run by the iterations of a counted loop around a block of body instructions, the loop adds three per
+// iteration (add, if, goto); setting the counter and the goto skipped on the last iteration cancel out
+#define LOOP_COST(iterations, body) ((long long)(iterations) * ((body) + 3))
+
+// Open a counted loop on counter, returns the line number the loop jumps back to
+static int open_loop(Workload *workload, const char *counter)
+{
+   Source *source = &workload->source;
+   emit(source, "%d set %s 0\n", next_line(source), counter);
+   workload->commands++;
+
+   // The loop body starts on the line after the counter is set
+   return source->line + 1;
+}
+
+// Close a counted loop opened with open_loop
+static void close_loop(Workload *workload, const char *counter, int top, long long iterations)
+{
+   Source *source = &workload->source;
+   emit(source, "%d add %s 1\n", next_line(source), counter);
+   emit(source, "%d if %s lt %lld\n", next_line(source), counter, iterations);
+   emit(source, "%d goto %d\n", next_line(source), top);
+   workload->commands += 3;
+}
+
+// Declarations and begin, every program starts with these
+static void open_program(Workload *workload, const char *names[], int count)
+{
+   Source *source = &workload->source;
+   for (int i = 0; i < count; i++)
+   {
+      emit(source, "%d int %s\n", next_line(source), names[i]);
+   }
+   emit(source, "%d begin\n", next_line(source));
+
+   // begin executes as an instruction
+   workload->commands += count + 1;
+   workload->instructions = 1;
+}
+
+// Print the result so the work is observable, then end
+static void close_program(Workload *workload, const char *name)
+{
+   Source *source = &workload->source;
+   emit(source, "%d print %s %s done\n", next_line(source), name, name);
+   emit(source, "%d end\n", next_line(source));
+   workload->commands += 2;
+   workload->instructions += 2;
+}
+
+// Straight-line block of length adds and subs, repeated in a loop until target instructions have run
+void generate_straight(Workload *workload, int length, long long target)
+{
+   if (length < 1)
+      length = 1;
+
+   long long iterations = target / (length + 3);
+   iterations = clamp_iterations(iterations);
+
+   const char *names[] = {"i", "x"};
+   open_program(workload, names, 2);
+
+   Source *source = &workload->source;
+   emit(source, "%d set x 0\n", next_line(source));
+   workload->commands++;
+
+   int top = open_loop(workload, "i");
+   for (int j = 0; j < length; j++)
+   {
+      emit(source, "%d %s x %d\n", next_line(source), j % 2 ? "sub" : "add", j % 2 ? 1 : 3);
+   }
+   workload->commands += length;
+   close_loop(workload, "i", top, iterations);
+
+   // set x and the loop
+   workload->instructions += 1 + LOOP_COST(iterations, length);
+   close_program(workload, "x");
+}
+
+// depth nested counted loops around a single add, each loop runs the same number of times
+void generate_loops(Workload *workload, int depth, long long target)
+{
+   if (depth < 1)
+      depth = 1;
+   if (depth > 9)
+      depth = 9;
+
+   // Largest trip count that keeps the total at or under target, but at least two
+   long long trips = 2;
+   for (;;)
+   {
+      long long total = 1;
+      for (int d = 0; d < depth; d++)
+      {
+         total = LOOP_COST(trips + 1, total);
+      }
+      if (total > target)
+         break;
+      trips++;
+   }
+
+   char counters[9][3];
+   const char *names[10];
+   for (int d = 0; d < depth; d++)
+   {
+      snprintf(counters[d], sizeof(counters[d]), "c%d", d);
+      names[d] = counters[d];
+   }
+   names[depth] = "x";
+   open_program(workload, names, depth + 1);
+
+   Source *source = &workload->source;
+   emit(source, "%d set x 0\n", next_line(source));
+   workload->commands++;
+   workload->instructions++;
+
+   int tops[9];
+   for (int d = 0; d < depth; d++)
+   {
+      tops[d] = open_loop(workload, counters[d]);
+   }
+
+   emit(source, "%d add x 1\n", next_line(source));
+   workload->commands++;
+
+   // Each level runs the level inside it trips times
+   long long cost = 1;
+   for (int d = depth - 1; d >= 0; d--)
+   {
+      close_loop(workload, counters[d], tops[d], trips);
+      cost = LOOP_COST(trips, cost);
+   }
+   workload->instructions += cost;
+
+   close_program(workload, "x");
+}
+
+// count variables declared and set like sample5, then added to one after another in a loop
+void generate_vars(Workload *workload, int count, long long target)
+{
+   if (count < 1)
+      count = 1;
+
+   long long iterations = target / (count + 3);
+   iterations = clamp_iterations(iterations);
+
+   Source *source = &workload->source;
+   for (int v = 0; v < count; v++)
+   {
+      emit(source, "%d int x%d\n", next_line(source), v);
+   }
+   const char *names[] = {"i"};
+   open_program(workload, names, 1);
+   workload->commands += count;
+
+   for (int v = 0; v < count; v++)
+   {
+      emit(source, "%d set x%d %d\n", next_line(source), v, v);
+   }
+   workload->commands += count;
+
+   int top = open_loop(workload, "i");
+   for (int v = 0; v < count; v++)
+   {
+      emit(source, "%d add x%d 1\n", next_line(source), v);
+   }
+   workload->commands += count;
+   close_loop(workload, "i", top, iterations);
+
+   // The sets and the loop
+   workload->instructions += count + LOOP_COST(iterations, count);
+   close_program(workload, "x0");
+}
+
+// Number of two line slots in the block of the gotos workload
+#define GOTO_SLOTS 64
+
+// Loop over a block of two line slots, density percent of them jump over their second line with a goto
+void generate_gotos(Workload *workload, int density, long long target)
+{
+   if (density < 0)
+      density = 0;
+   if (density > 100)
+      density = 100;
+
+   // Spread the gotos evenly over the slots
+   int gotos = 0;
+   for (int j = 0; j < GOTO_SLOTS; j++)
+   {
+      if ((j + 1) * density / 100 > j * density / 100)
+         gotos++;
+   }
+
+   // Slots with a goto execute one instruction, others two
+   int body = 2 * GOTO_SLOTS - gotos;
+   long long iterations = target / (body + 3);
+   iterations = clamp_iterations(iterations);
+
+   const char *names[] = {"i", "x"};
+   open_program(workload, names, 2);
+
+   Source *source = &workload->source;
+   emit(source, "%d set x 0\n", next_line(source));
+   workload->commands++;
+
+   int top = open_loop(workload, "i");
+   for (int j = 0; j < GOTO_SLOTS; j++)
+   {
+      if ((j + 1) * density / 100 > j * density / 100)
+      {
+         int line = next_line(source);
+         emit(source, "%d goto %d\n", line, line + 2);
+         emit(source, "%d add x 1000\n", next_line(source));
+      }
+      else
+      {
+         emit(source, "%d add x 1\n", next_line(source));
+         emit(source, "%d sub x 1\n", next_line(source));
+      }
+   }
+   workload->commands += 2 * GOTO_SLOTS;
+   close_loop(workload, "i", top, iterations);
+
+   // set x and the loop
+   workload->instructions += 1 + LOOP_COST(iterations, body);
+   close_program(workload, "x");
+}
+
+// Lines in one block of the parse workload
+#define PARSE_BLOCK 9
+
+// klines thousand lines using every command, run once from top to bottom, for measuring how fast programs parse
+// Every block has constants of its own, so the constant slots grow with the program; target is not used
+void generate_parse(Workload *workload, int klines, long long target)
+{
+   (void)target;
+   if (klines < 1)
+      klines = 1;
+
+   const char *names[] = {"a", "b"};
+   open_program(workload, names, 2);
+
+   Source *source = &workload->source;
+   emit(source, "%d set b 1\n", next_line(source));
+   workload->commands++;
+   workload->instructions++;
+
+   int blocks = (int)((long long)klines * 1000 / PARSE_BLOCK);
+   for (int k = 0; k < blocks; k++)
+   {
+      // The if always holds, so the goto jumps over the add after it
+      emit(source, "%d set a %d\n", next_line(source), k % 1000);
+      emit(source, "%d add b a\n", next_line(source));
+      emit(source, "%d sub a 3\n", next_line(source));
+      emit(source, "%d mult b 2\n", next_line(source));
+      emit(source, "%d div b 7\n", next_line(source));
+      emit(source, "%d if a lt %d\n", next_line(source), 1000000 + k);
+      int line = next_line(source);
+      emit(source, "%d goto %d\n", line, line + 2);
+      emit(source, "%d add a 1\n", next_line(source));
+      emit(source, "%d print a b block%d\n", next_line(source), k);
+   }
+   workload->commands += blocks * PARSE_BLOCK;
+   workload->instructions += (long long)blocks * (PARSE_BLOCK - 1);
+
+   close_program(workload, "b");
+}
+
+# pragma endregion
+
+# pragma region Source Functions
+
+// Append formatted text to the source, growing it as needed
+// On failure the source is freed and data is left NULL, later calls do nothing
+void emit(Source *source, const char *format, ...)
+{
+   if (source->data == NULL && source->capacity != 0)
+   {
+      return;
+   }
+
+   for (;;)
+   {
+      size_t room = source->capacity - source->len;
+      va_list args;
+      va_start(args, format);
+      int n = room > 0 ? vsnprintf(source->data + source->len, room, format, args) : -1;
+      va_end(args);
+
+      if (n >= 0 && (size_t)n < room)
+      {
+         source->len += n;
+         return;
+      }
+
+      size_t capacity = source->capacity ? source->capacity * 2 : 4096;
+      char *data = realloc(source->data, capacity);
+      if (data == NULL)
+      {
+         free(source->data);
+         source->data = NULL;
+         return;
+      }
+      source->data = data;
+      source->capacity = capacity;
+   }
+}
+
+// Line number for the next line of the program
+int next_line(Source *source)
+{
+   return ++source->line;
+}
+
+# pragma endregion
@@ -0,0 +1,510 @@
+/* Cache of compiled programs
+        -a compiled and optimized runtime is written to a binary image the first time a program runs
+        -later runs of the same source map the image and execute it as it is, without parsing or compiling
+        -images are keyed on the source path and checked against the source's mtime, size and a hash of its contents
+*/
+
+#include "a4.h"
+
+# pragma region Cache Functions
+
+#define IMAGE_MAGIC "A4IM"
+
+// Bumped whenever anything written to an image changes meaning
+#define IMAGE_VERSION 3
+
+// Sections of an image start on this alignment
+#define IMAGE_ALIGN 8
+
+// Stored in place of the offset of a string that is NULL
+#define IMAGE_NO_STRING UINTPTR_MAX
+
+// Start of an image, followed by the sections at the offsets it lists
+// Pointers in the sections are stored as offsets and relocated by load_cached_runtime
+typedef struct
+{
+   char magic[4];
+   uint32_t version;
+
+   // Layout of the structures in the image, an image from a differently built interpreter is never loaded
+   uint32_t instructionSize;
+   uint32_t loopSize;
+   uint32_t valueSize;
+   uint32_t unused;
+
+   // Source the image was compiled from, and the optimization passes it was compiled with
+   int64_t mtimeSec;
+   int64_t mtimeNsec;
+   uint64_t sourceSize;
+   uint64_t sourceHash;
+   int32_t passes;
+
+   int32_t programLen;
+   int32_t entry;
+   int32_t intNamesLen;
+   int32_t intValuesLen;
+   int32_t loopsLen;
+   int32_t beginLine;
+   int32_t endLine;
+
+   // Offsets of the sections from the start of the image
+   uint64_t program;
+   uint64_t names;
+   uint64_t values;
+   uint64_t set;
+   uint64_t loops;
+   uint64_t loopData;
+   uint64_t strings;
+   uint64_t stringsLen;
+   uint64_t imageLen;
+} ImageHeader;
+
+// FNV-1a over data, used for source contents and for paths
+uint64_t hash_bytes(const char *data, size_t len)
+{
+   uint64_t hash = 14695981039346656037ull;
+   for (size_t i = 0; i < len; i++)
+   {
+      hash ^= (unsigned char)data[i];
+      hash *= 1099511628211ull;
+   }
+   return hash;
+}
+
+static size_t image_round(size_t size)
+{
+   return (size + IMAGE_ALIGN - 1) & ~(size_t)(IMAGE_ALIGN - 1);
+}
+
+// Directory the images are kept in, $A4_CACHE_DIR, $XDG_CACHE_HOME/a4 or ~/.cache/a4, created when create is set
+// Returns -1 when there is nowhere to keep them
+static int cache_directory(char *dir, size_t size, int create)
+{
+   const char *env = getenv("A4_CACHE_DIR");
+   const char *xdg = getenv("XDG_CACHE_HOME");
+   const char *home = getenv("HOME");
+   int n;
+
+   if (env != NULL && env[0] != '\0')
+      n = snprintf(dir, size, "%s", env);
+   else if (xdg != NULL && xdg[0] != '\0')
+      n = snprintf(dir, size, "%s/a4", xdg);
+   else if (home != NULL && home[0] != '\0')
+      n = snprintf(dir, size, "%s/.cache/a4", home);
+   else
+      return -1;
+
+   if (n < 0 || (size_t)n >= size)
+      return -1;
+
+   if (!create)
+      return 1;
+
+   // Create every missing directory along the way
+   for (char *p = dir + 1; *p != '\0'; p++)
+   {
+      if (*p != '/')
+         continue;
+      *p = '\0';
+      mkdir(dir, 0755);
+      *p = '/';
+   }
+
+   if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+      return -1;
+
+   return 1;
+}
+
+// Path of the image for a source file compiled with passes, named after a hash of the source's absolute path
+static int cache_path(const char *filename, int passes, char *path, size_t size, int create)
+{
+   char *absolute = realpath(filename, NULL);
+   if (absolute == NULL)
+      return -1;
+
+   uint64_t hash = hash_bytes(absolute, strlen(absolute));
+   free(absolute);
+
+   char dir[4096];
+   if (cache_directory(dir, sizeof(dir), create) == -1)
+      return -1;
+
+   int n = snprintf(path, size, "%s/%016llx-%d.a4c", dir, (unsigned long long)hash, passes);
+   return n < 0 || (size_t)n >= size ? -1 : 1;
+}
+
+// Hash the contents of a source file, whose size is already known from stat
+static int hash_source(const char *filename, size_t size, uint64_t *hash)
+{
+   if (size == 0)
+   {
+      *hash = hash_bytes(NULL, 0);
+      return 1;
+   }
+
+   int fd = open(filename, O_RDONLY);
+   if (fd == -1)
+      return -1;
+
+   char *source = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (source == MAP_FAILED)
+      return -1;
+
+   *hash = hash_bytes(source, size);
+   munmap(source, size);
+   return 1;
+}
+
+// Check that every index in a loaded program is in range, so a damaged image can not make execution run wild
+static int check_image(Runtime *runtime)
+{
+   int n = runtime->programLen;
+   int slots = runtime->intValuesLen;
+
+   // Programs end in halts, so stepping on from the last instruction can not run off the end
+   if (runtime->entry < 0 || runtime->entry >= n || runtime->intNamesLen > slots || runtime->program[n - 1].opcode != OP_HALT)
+      return -1;
+
+   for (int i = 0; i < n + runtime->loopsLen; i++)
+   {
+      // The heads of the loops are instructions too, checked after the program
+      Instruction *ins = i < n ? &runtime->program[i] : &runtime->loops[i - n].head;
+      int op = ins->opcode;
+
+      if (op < OP_HALT || op > OP_DIV_VAR)
+         return -1;
+
+      // Jumps, every other instruction's target is unused
+      if ((op == OP_GOTO || (op >= OP_IF_EQ && op <= OP_ADD_BRANCH_LTE)) && (ins->target < 0 || ins->target >= n))
+         return -1;
+
+      // Fused instructions step over the instructions they were fused from, which stay in the program, so they have
+      // to be followed by them, and a loop head never is one as loops are found before fusion
+      if (op >= OP_BRANCH_EQ && op <= OP_ADD_BRANCH_LTE && (i >= n || i + (op >= OP_ADD_BRANCH_EQ ? 3 : 2) >= n))
+         return -1;
+
+      // Arithmetic, and the add of a fused add/if/goto whose compare operands are read from the if after it, or the
+      // if and goto fused in turn, which is checked as an instruction of its own
+      if ((op >= OP_SET && op <= OP_DIV) || (op >= OP_ADD_BRANCH_EQ && op <= OP_ADD_BRANCH_LTE))
+      {
+         if (ins->a < 0 || ins->a >= slots)
+            return -1;
+         if (op >= OP_ADD_BRANCH_EQ)
+         {
+            int compare = runtime->program[i + 1].opcode;
+            if (!(compare >= OP_IF_EQ && compare <= OP_IF_LTE) && !(compare >= OP_BRANCH_EQ && compare <= OP_BRANCH_LTE))
+               return -1;
+         }
+      }
+      else if (op == OP_PRINT || (op >= OP_IF_EQ && op <= OP_IF_LTE) || (op >= OP_BRANCH_EQ && op <= OP_BRANCH_LTE) || op >= OP_SET_VAR)
+      {
+         if (ins->a < 0 || ins->a >= slots || ins->b < 0 || ins->b >= slots)
+            return -1;
+      }
+      else if (op == OP_LOOP)
+      {
+         if (i >= n || ins->b < 0 || ins->b >= runtime->loopsLen)
+            return -1;
+      }
+   }
+
+   for (int l = 0; l < runtime->loopsLen; l++)
+   {
+      Loop *loop = &runtime->loops[l];
+      if (loop->exit < 0 || loop->exit >= n || loop->counter < 0 || loop->counter >= slots || loop->limit < 0 || loop->limit >= slots)
+         return -1;
+      for (int s = 0; s < loop->len; s++)
+      {
+         if (loop->slots[s] < 0 || loop->slots[s] >= slots)
+            return -1;
+      }
+   }
+
+   return 1;
+}
+
+// Turn a string offset stored in an image back into a pointer into the string section
+static int relocate_string(Token *token, char *strings, uint64_t stringsLen)
+{
+   uintptr_t offset = (uintptr_t)token->str;
+   if (offset == IMAGE_NO_STRING)
+   {
+      token->str = NULL;
+      return 1;
+   }
+
+   if (token->len < 0 || offset > stringsLen || (uint64_t)token->len > stringsLen - offset)
+      return -1;
+
+   token->str = strings + offset;
+   return 1;
+}
+
+// Map the image of a source file compiled with passes and build a runtime running it
+// Returns NULL when there is no image, or it is out of date, damaged or from another build, and the caller compiles
+// the source as usual
+Runtime *load_cached_runtime(const char *filename, int passes)
+{
+   char path[4200];
+   struct stat source_st;
+   if (cache_path(filename, passes, path, sizeof(path), 0) == -1 || stat(filename, &source_st) == -1)
+      return NULL;
+
+   int fd = open(path, O_RDONLY);
+   if (fd == -1)
+      return NULL;
+
+   struct stat st;
+   if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(ImageHeader))
+   {
+      close(fd);
+      return NULL;
+   }
+
+   // Private and writable, the values, set bits and relocated pointers are written in place
+   size_t len = st.st_size;
+   char *image = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (image == MAP_FAILED)
+      return NULL;
+
+   ImageHeader *header = (ImageHeader *)image;
+   uint64_t hash;
+
+   // The mtime and size are checked before hashing the source, which only happens when they match
+   int valid = memcmp(header->magic, IMAGE_MAGIC, 4) == 0 && header->version == IMAGE_VERSION && header->instructionSize == sizeof(Instruction) && header->loopSize == sizeof(Loop) && header->valueSize == sizeof(Value) && header->imageLen == len && header->passes == passes && header->mtimeSec == (int64_t)source_st.st_mtim.tv_sec && header->mtimeNsec == (int64_t)source_st.st_mtim.tv_nsec && header->sourceSize == (uint64_t)source_st.st_size;
+
+   // Every section has to lie inside the image
+   valid = valid && header->programLen > 0 && header->intValuesLen >= 0 && header->loopsLen >= 0 && header->program + (uint64_t)header->programLen * sizeof(Instruction) <= len && header->names + (uint64_t)header->intValuesLen * sizeof(Token) <= len && header->values + (uint64_t)header->intValuesLen * sizeof(Value) <= len && header->set + (uint64_t)BITSET_WORDS(header->intValuesLen) * sizeof(uint64_t) <= len && header->loops + (uint64_t)header->loopsLen * sizeof(Loop) <= len && header->loopData <= len && header->strings + header->stringsLen <= len;
+
+   valid = valid && hash_source(filename, header->sourceSize, &hash) == 1 && hash == header->sourceHash;
+   if (!valid)
+   {
+      munmap(image, len);
+      return NULL;
+   }
+
+   Runtime *runtime = create_runtime();
+   if (runtime == NULL)
+   {
+      munmap(image, len);
+      return NULL;
+   }
+
+   runtime->image = image;
+   runtime->imageLen = len;
+
+   runtime->program = (Instruction *)(image + header->program);
+   runtime->programLen = header->programLen;
+   runtime->entry = header->entry;
+   runtime->intNamesLen = header->intNamesLen;
+   runtime->intValuesLen = header->intValuesLen;
+   runtime->intCapacity = header->intValuesLen;
+   runtime->intNames = (Token *)(image + header->names);
+   runtime->intValues = (Value *)(image + header->values);
+   runtime->intValuesSet = (uint64_t *)(image + header->set);
+   runtime->loops = (Loop *)(image + header->loops);
+   runtime->loopsLen = header->loopsLen;
+   runtime->loopsCapacity = header->loopsLen;
+   runtime->begin_line = header->beginLine;
+   runtime->end_line = header->endLine;
+   runtime->begin_flag = 1;
+   runtime->end_flag = 1;
+
+   char *strings = image + header->strings;
+   valid = 1;
+
+   for (int i = 0; i < runtime->programLen; i++)
+   {
+      valid = valid && relocate_string(&runtime->program[i].str, strings, header->stringsLen) == 1;
+   }
+
+   for (int v = 0; v < runtime->intValuesLen; v++)
+   {
+      valid = valid && relocate_string(&runtime->intNames[v], strings, header->stringsLen) == 1;
+   }
+
+   // The arrays of every loop follow each other in the loop data section
+   uint64_t at = header->loopData;
+   for (int l = 0; l < runtime->loopsLen && valid; l++)
+   {
+      Loop *loop = &runtime->loops[l];
+      uint64_t size = image_round(sizeof(int) * (size_t)loop->len) + sizeof(long long) * 3 * (size_t)loop->len;
+      if (loop->len < 0 || at + size > header->strings || relocate_string(&loop->head.str, strings, header->stringsLen) == -1)
+      {
+         valid = 0;
+         break;
+      }
+
+      loop->slots = (int *)(image + at);
+      at += image_round(sizeof(int) * loop->len);
+      loop->deltas = (long long *)(image + at);
+      loop->lows = loop->deltas + loop->len;
+      loop->highs = loop->lows + loop->len;
+      at += sizeof(long long) * 3 * loop->len;
+   }
+
+   if (!valid || check_image(runtime) == -1)
+   {
+      free_runtime(runtime);
+      return NULL;
+   }
+
+   // Whether the program was verified is not stored, the image is checked again as it may have been changed
+   verify_program(runtime);
+
+   return runtime;
+}
+
+// Append a string to the string section being built, returning the offset to store in its place
+static uintptr_t pool_string(Token token, char *strings, size_t *stringsLen)
+{
+   if (token.str == NULL)
+      return IMAGE_NO_STRING;
+
+   uintptr_t offset = *stringsLen;
+   if (strings != NULL)
+      memcpy(strings + offset, token.str, token.len);
+   *stringsLen += token.len;
+   return offset;
+}
+
+// Write the image of a compiled runtime for a source file compiled with passes
+// The image is written to a temporary file and renamed over the old one, so readers never see half an image
+// Returns -1 when it could not be written, the cache is only an optimization so nothing is reported
+int save_cached_runtime(Runtime *runtime, const char *filename, int passes)
+{
+   if (runtime == NULL || runtime->program == NULL || (runtime->source == NULL && runtime->sourceLen > 0))
+   {
+      return -1;
+   }
+
+   char path[4200];
+   struct stat st;
+   if (cache_path(filename, passes, path, sizeof(path), 1) == -1 || stat(filename, &st) == -1 || (size_t)st.st_size != runtime->sourceLen)
+      return -1;
+
+   // Lay out the sections, sizing the string section by pooling every string without copying it
+   size_t stringsLen = 0;
+   for (int i = 0; i < runtime->programLen; i++)
+      pool_string(runtime->program[i].str, NULL, &stringsLen);
+   for (int v = 0; v < runtime->intValuesLen; v++)
+      pool_string(runtime->intNames[v], NULL, &stringsLen);
+   for (int l = 0; l < runtime->loopsLen; l++)
+      pool_string(runtime->loops[l].head.str, NULL, &stringsLen);
+
+   size_t loopData = 0;
+   for (int l = 0; l < runtime->loopsLen; l++)
+      loopData += image_round(sizeof(int) * runtime->loops[l].len) + sizeof(long long) * 3 * runtime->loops[l].len;
+
+   ImageHeader header;
+   memset(&header, 0, sizeof(header));
+   memcpy(header.magic, IMAGE_MAGIC, 4);
+   header.version = IMAGE_VERSION;
+   header.instructionSize = sizeof(Instruction);
+   header.loopSize = sizeof(Loop);
+   header.valueSize = sizeof(Value);
+   header.mtimeSec = st.st_mtim.tv_sec;
+   header.mtimeNsec = st.st_mtim.tv_nsec;
+   header.sourceSize = runtime->sourceLen;
+   header.sourceHash = hash_bytes(runtime->source, runtime->sourceLen);
+   header.passes = passes;
+   header.programLen = runtime->programLen;
+   header.entry = runtime->entry;
+   header.intNamesLen = runtime->intNamesLen;
+   header.intValuesLen = runtime->intValuesLen;
+   header.loopsLen = runtime->loopsLen;
+   header.beginLine = runtime->begin_line;
+   header.endLine = runtime->end_line;
+
+   header.program = image_round(sizeof(ImageHeader));
+   header.names = image_round(header.program + sizeof(Instruction) * runtime->programLen);
+   header.values = image_round(header.names + sizeof(Token) * runtime->intValuesLen);
+   header.set = image_round(header.values + sizeof(Value) * runtime->intValuesLen);
+   header.loops = image_round(header.set + sizeof(uint64_t) * BITSET_WORDS(runtime->intValuesLen));
+   header.loopData = image_round(header.loops + sizeof(Loop) * runtime->loopsLen);
+   header.strings = header.loopData + loopData;
+   header.stringsLen = stringsLen;
+   header.imageLen = header.strings + stringsLen;
+
+   char *image = calloc(header.imageLen, 1);
+   if (image == NULL)
+      return -1;
+
+   memcpy(image, &header, sizeof(header));
+   char *strings = image + header.strings;
+   stringsLen = 0;
+
+   Instruction *program = (Instruction *)(image + header.program);
+   for (int i = 0; i < runtime->programLen; i++)
+   {
+      program[i] = runtime->program[i];
+      program[i].str.str = (const char *)pool_string(runtime->program[i].str, strings, &stringsLen);
+   }
+
+   Token *names = (Token *)(image + header.names);
+   for (int v = 0; v < runtime->intValuesLen; v++)
+   {
+      names[v] = runtime->intNames[v];
+      names[v].str = (const char *)pool_string(runtime->intNames[v], strings, &stringsLen);
+   }
+
+   memcpy(image + header.values, runtime->intValues, sizeof(Value) * runtime->intValuesLen);
+   memcpy(image + header.set, runtime->intValuesSet, sizeof(uint64_t) * BITSET_WORDS(runtime->intValuesLen));
+
+   Loop *loops = (Loop *)(image + header.loops);
+   size_t at = header.loopData;
+   for (int l = 0; l < runtime->loopsLen; l++)
+   {
+      Loop *loop = &runtime->loops[l];
+      loops[l] = *loop;
+      loops[l].head.str.str = (const char *)pool_string(loop->head.str, strings, &stringsLen);
+      loops[l].slots = NULL;
+      loops[l].deltas = NULL;
+      loops[l].lows = NULL;
+      loops[l].highs = NULL;
+
+      memcpy(image + at, loop->slots, sizeof(int) * loop->len);
+      at += image_round(sizeof(int) * loop->len);
+      memcpy(image + at, loop->deltas, sizeof(long long) * loop->len);
+      memcpy(image + at + sizeof(long long) * loop->len, loop->lows, sizeof(long long) * loop->len);
+      memcpy(image + at + sizeof(long long) * 2 * loop->len, loop->highs, sizeof(long long) * loop->len);
+      at += sizeof(long long) * 3 * loop->len;
+   }
+
+   // Unique to the process and the runtime, batch mode may be saving the same program on several threads at once
+   char temp[4300];
+   snprintf(temp, sizeof(temp), "%s.%d.%p", path, (int)getpid(), (void *)runtime);
+
+   int fd = open(temp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+   if (fd == -1)
+   {
+      free(image);
+      return -1;
+   }
+
+   size_t written = 0;
+   while (written < header.imageLen)
+   {
+      ssize_t bytes = write(fd, image + written, header.imageLen - written);
+      if (bytes == -1 && errno == EINTR)
+         continue;
+      if (bytes <= 0)
+         break;
+      written += bytes;
+   }
+
+   free(image);
+
+   if (close(fd) == -1 || written != header.imageLen || rename(temp, path) == -1)
+   {
+      unlink(temp);
+      return -1;
+   }
+
+   return 1;
+}
+
+# pragma endregion
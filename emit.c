@@ -0,0 +1,325 @@
+/* Ahead of time compilation of programs to C
+        -writes a standalone C program that runs a compiled runtime the way the non graphics interpreter does
+        -every instruction that is jumped to becomes a label, goto and if become C gotos and variables become locals
+        -the output only needs a C compiler, e.g. gcc -O2 out.c -o out, and no part of the interpreter
+        -arithmetic follows the overflow policy of the runtime, trapping and saturating use the overflow builtins
+         of GCC and Clang
+*/
+
+#include "a4.h"
+
+# pragma region Emit Functions
+
+// C types, limits and printf conversion of the values of the emitted program, the same width as the interpreter's
+#ifdef A4_WIDE_VALUES
+#define EMIT_VALUE "long long"
+#define EMIT_UNSIGNED "unsigned long long"
+#define EMIT_MIN "LLONG_MIN"
+#define EMIT_MAX "LLONG_MAX"
+#define EMIT_CONVERSION "%%lld"
+#else
+#define EMIT_VALUE "int"
+#define EMIT_UNSIGNED "unsigned"
+#define EMIT_MIN "INT_MIN"
+#define EMIT_MAX "INT_MAX"
+#define EMIT_CONVERSION "%%d"
+#endif
+
+// Write str as the contents of a C string literal, escaping everything that is not printable
+static void emit_string(FILE *file, const char *str, int len)
+{
+   for (int i = 0; i < len; i++)
+   {
+      unsigned char c = (unsigned char)str[i];
+      if (c == '"' || c == '\\')
+         fprintf(file, "\\%c", c);
+      else if (isprint(c) && c != '?')
+         fputc(c, file);
+      else
+         // Always three octal digits so that a digit after the escape is not read as part of it
+         fprintf(file, "\\%03o", c);
+   }
+}
+
+// Operand of an instruction, a local for variables and the value itself for constant slots
+// Slots past the variables without a name are constants, the others are names an if uses that were never declared,
+// which emit_require_set stops at, so they are never compared
+static void emit_operand(FILE *file, Runtime *runtime, int slot)
+{
+   if (slot < runtime->intNamesLen)
+      fprintf(file, "v%d", slot);
+   else if (runtime->intNames[slot].str == NULL)
+      fprintf(file, "%lld", (long long)runtime->intValues[slot]);
+   else
+      fprintf(file, "0");
+}
+
+// Report the variable in slot and stop when it is not set, constant slots are always set and names that were never
+// declared never are
+static void emit_require_set(FILE *file, Runtime *runtime, Instruction *ins, int slot, const char *message)
+{
+   Token name = runtime->intNames[slot];
+   if (slot >= runtime->intNamesLen && name.str == NULL)
+      return;
+
+   if (slot >= runtime->intNamesLen)
+      fprintf(file, "   {\n");
+   else
+      fprintf(file, "   if (!s%d)\n   {\n", slot);
+   fprintf(file, "      printf(\"Error at line %d: %s\\n\", \"", ins->line_number, message);
+   emit_string(file, name.str, name.len);
+   fprintf(file, "\");\n      goto halt;\n   }\n");
+}
+
+// Report that the variable of an arithmetic instruction overflowed and stop, or saturate it, inside the branch taken
+// when the result r overflowed
+static void emit_overflow(FILE *file, Runtime *runtime, Instruction *ins, const char *saturated)
+{
+   if (runtime->overflow == OVERFLOW_SATURATE)
+   {
+      fprintf(file, "      r = %s;\n", saturated);
+      return;
+   }
+
+   Token name = runtime->intNames[ins->a];
+   fprintf(file, "      printf(\"Error at line %d: Variable %%s overflowed\\n\", \"", ins->line_number);
+   emit_string(file, name.str, name.len);
+   fprintf(file, "\");\n      goto halt;\n");
+}
+
+// Add, subtract or multiply the variable of an instruction by operand under the overflow policy
+static void emit_arithmetic(FILE *file, Runtime *runtime, Instruction *ins, int opcode, const char *operand)
+{
+   static const char operators[] = {'+', '-', '*'};
+   static const char *builtins[] = {"__builtin_add_overflow", "__builtin_sub_overflow", "__builtin_mul_overflow"};
+   int k = opcode - OP_ADD;
+
+   // Through unsigned so that overflow wraps as it does in the interpreter instead of being undefined
+   if (runtime->overflow == OVERFLOW_WRAP)
+   {
+      fprintf(file, "   v%d = (" EMIT_VALUE ")((" EMIT_UNSIGNED ")v%d %c (" EMIT_UNSIGNED ")%s);\n", ins->a, ins->a, operators[k], operand);
+      return;
+   }
+
+   char saturated[64];
+   if (opcode == OP_MULT)
+      snprintf(saturated, sizeof(saturated), "(v%d < 0) != (%s < 0) ? " EMIT_MIN " : " EMIT_MAX, ins->a, operand);
+   else
+      snprintf(saturated, sizeof(saturated), "%s > 0 ? %s : %s", operand, opcode == OP_ADD ? EMIT_MAX : EMIT_MIN, opcode == OP_ADD ? EMIT_MIN : EMIT_MAX);
+
+   fprintf(file, "   if (%s(v%d, %s, &r))\n   {\n", builtins[k], ins->a, operand);
+   emit_overflow(file, runtime, ins, saturated);
+   fprintf(file, "   }\n   v%d = r;\n", ins->a);
+}
+
+// Divide the variable of an instruction by divisor, division by zero is an error under every policy
+static void emit_division(FILE *file, Runtime *runtime, Instruction *ins, const char *divisor)
+{
+   fprintf(file, "   if (%s == 0)\n   {\n", divisor);
+   fprintf(file, "      printf(\"Error at line %d: Division by zero\\n\");\n      goto halt;\n   }\n", ins->line_number);
+
+   fprintf(file, "   if (v%d == " EMIT_MIN " && %s == -1)\n   {\n", ins->a, divisor);
+   if (runtime->overflow == OVERFLOW_WRAP)
+      fprintf(file, "      r = " EMIT_MIN ";\n");
+   else
+      emit_overflow(file, runtime, ins, EMIT_MAX);
+   fprintf(file, "   }\n   else\n      r = v%d / %s;\n   v%d = r;\n", ins->a, divisor, ins->a);
+}
+
+// Label of the instruction at index i, every halt shares one
+// Labels go by index rather than line number, as nothing stops two commands from having the same line number
+static void emit_label(FILE *file, Runtime *runtime, int i)
+{
+   if (runtime->program[i].opcode == OP_HALT)
+      fprintf(file, "halt");
+   else
+      fprintf(file, "i%d", i);
+}
+
+// Write the compiled program of a runtime to file as C source
+// Only the instructions of compile_runtime and the constants pass are supported, run no other passes beforehand
+// Returns -1 when the program contains anything else or memory runs out
+int emit_c(Runtime *runtime, const char *source_name, FILE *file)
+{
+   if (runtime == NULL || runtime->program == NULL || file == NULL)
+   {
+      return -1;
+   }
+
+   int n = runtime->programLen;
+
+   // Only instructions that are jumped to get a label, the rest fall through from the one before
+   char *labeled = calloc(n, 1);
+   if (labeled == NULL)
+   {
+      report("Error: Could not allocate memory for labels\n");
+      return -1;
+   }
+
+   for (int i = 0; i < n; i++)
+   {
+      Instruction *ins = &runtime->program[i];
+      if (ins->opcode >= OP_BRANCH_EQ && ins->opcode <= OP_LOOP)
+      {
+         report("Error: Can not emit C for %s, run it without -j and with only the constants pass\n", source_name);
+         free(labeled);
+         return -1;
+      }
+
+      if (ins->opcode == OP_GOTO || (ins->opcode >= OP_IF_EQ && ins->opcode <= OP_IF_LTE))
+         labeled[ins->target] = 1;
+   }
+
+   fprintf(file, "// Generated by a4 --emit-c from ");
+   emit_string(file, source_name, strlen(source_name));
+   fprintf(file, "\n\n#include <stdio.h>\n#include <limits.h>\n\n");
+
+   // Same line format as output_print
+   fprintf(file, "static void print(" EMIT_VALUE " val1, " EMIT_VALUE " val2, const char *str, int len)\n{\n");
+   fprintf(file, "   printf(\"" EMIT_CONVERSION " " EMIT_CONVERSION " \", val1, val2);\n");
+   fprintf(file, "   fwrite(str, 1, len, stdout);\n");
+   fprintf(file, "   putchar('\\n');\n}\n\n");
+
+   fprintf(file, "int main(void)\n{\n");
+   for (int v = 0; v < runtime->intNamesLen; v++)
+   {
+      Token name = runtime->intNames[v];
+      fprintf(file, "   " EMIT_VALUE " v%d = 0;\n   int s%d = 0; // %.*s\n", v, v, name.len, name.str);
+   }
+
+   // Result of the arithmetic being done, stored once it is known not to have overflowed
+   fprintf(file, "   " EMIT_VALUE " r;\n   (void)r;\n");
+
+   fprintf(file, "\n   goto ");
+   emit_label(file, runtime, runtime->entry);
+   fprintf(file, ";\n\n");
+
+   for (int i = 0; i < n; i++)
+   {
+      Instruction *ins = &runtime->program[i];
+
+      if (labeled[i] || i == runtime->entry)
+      {
+         // A halt that is jumped to is the shared label at the end
+         if (ins->opcode != OP_HALT)
+            fprintf(file, "i%d: // line %d\n", i, ins->line_number);
+      }
+
+      switch (ins->opcode)
+      {
+         case OP_NOP:
+         {
+            break;
+         }
+         case OP_SET:
+         {
+            fprintf(file, "   v%d = %d;\n   s%d = 1;\n", ins->a, ins->b, ins->a);
+            break;
+         }
+         case OP_ADD:
+         case OP_SUB:
+         case OP_MULT:
+         case OP_DIV:
+         {
+            // Immediates are in parentheses so that a negative one can follow an operator
+            char operand[16];
+            snprintf(operand, sizeof(operand), "(%d)", ins->b);
+            emit_require_set(file, runtime, ins, ins->a, "Variable %s is not set");
+            if (ins->opcode == OP_DIV)
+               emit_division(file, runtime, ins, operand);
+            else
+               emit_arithmetic(file, runtime, ins, ins->opcode, operand);
+            break;
+         }
+         case OP_SET_VAR:
+         {
+            emit_require_set(file, runtime, ins, ins->b, "Variable %s is not set");
+            fprintf(file, "   v%d = v%d;\n   s%d = 1;\n", ins->a, ins->b, ins->a);
+            break;
+         }
+         case OP_ADD_VAR:
+         case OP_SUB_VAR:
+         case OP_MULT_VAR:
+         case OP_DIV_VAR:
+         {
+            char operand[16];
+            snprintf(operand, sizeof(operand), "v%d", ins->b);
+            emit_require_set(file, runtime, ins, ins->a, "Variable %s is not set");
+            emit_require_set(file, runtime, ins, ins->b, "Variable %s is not set");
+            if (ins->opcode == OP_DIV_VAR)
+               emit_division(file, runtime, ins, operand);
+            else
+               emit_arithmetic(file, runtime, ins, ins->opcode - OP_VAR_OFFSET, operand);
+            break;
+         }
+         case OP_PRINT:
+         {
+            emit_require_set(file, runtime, ins, ins->a, "Variable %s is not set");
+            emit_require_set(file, runtime, ins, ins->b, "Variable %s is not set");
+            fprintf(file, "   print(");
+            emit_operand(file, runtime, ins->a);
+            fprintf(file, ", ");
+            emit_operand(file, runtime, ins->b);
+            fprintf(file, ", \"");
+            emit_string(file, ins->str.str, ins->str.len);
+            fprintf(file, "\", %d);\n", ins->str.len);
+            break;
+         }
+         case OP_GOTO:
+         {
+            fprintf(file, "   goto ");
+            emit_label(file, runtime, ins->target);
+            fprintf(file, ";\n");
+            break;
+         }
+         case OP_IF_EQ:
+         case OP_IF_NE:
+         case OP_IF_GT:
+         case OP_IF_GTE:
+         case OP_IF_LT:
+         case OP_IF_LTE:
+         {
+            // A false expression skips to the target, a true one falls through
+            static const char *operators[] = {"==", "!=", ">", ">=", "<", "<="};
+            emit_require_set(file, runtime, ins, ins->a, "%s is not defined");
+            emit_require_set(file, runtime, ins, ins->b, "%s is not defined");
+            fprintf(file, "   if (!(");
+            emit_operand(file, runtime, ins->a);
+            fprintf(file, " %s ", operators[ins->opcode - OP_IF_EQ]);
+            emit_operand(file, runtime, ins->b);
+            fprintf(file, "))\n      goto ");
+            emit_label(file, runtime, ins->target);
+            fprintf(file, ";\n");
+            break;
+         }
+         case OP_TRAP:
+         {
+            if (ins->a == TRAP_INVALID_LINE)
+               fprintf(file, "   printf(\"Error at line %d: Invalid line number %d\\n\");\n", ins->line_number, ins->b);
+            else
+               fprintf(file, "   printf(\"Error: Command at line %d not found\\n\");\n", ins->b);
+            fprintf(file, "   goto halt;\n");
+            break;
+         }
+         case OP_HALT:
+         {
+            fprintf(file, "   goto halt;\n");
+            break;
+         }
+      }
+   }
+
+   fprintf(file, "\nhalt:\n   fflush(stdout);\n   return 0;\n}\n");
+
+   free(labeled);
+
+   if (ferror(file))
+   {
+      report("Error: Could not write C for %s\n", source_name);
+      return -1;
+   }
+
+   return 1;
+}
+
+# pragma endregion
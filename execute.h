@@ -0,0 +1,500 @@
+// Interpreter loop, included by a4.c once for every variant of the loop it needs
+// Define EXECUTE_FUNCTION to the name of the function to generate, EXECUTE_PROFILE to count executions and
+// ticks per instruction into runtime->profile, and EXECUTE_BUDGET to stop once runtime->budget instructions have run
+// or runtime->deadline has passed, see a4_run, EXECUTE_TRACE to record every instruction in runtime->trace, and
+// EXECUTE_VERIFIED to leave out the set checks of a program verify_program has proven never reads an unset variable,
+// loops without it still skip the checks of every instruction it has proven
+// Define EXECUTE_OVERFLOW to one of OVERFLOW_WRAP to OVERFLOW_SATURATE to generate a loop for that overflow policy
+// alone, loops without it follow runtime->overflow
+// With THREADED_DISPATCH (GCC and Clang only) every handler jumps straight to the next one through a table of
+// label addresses, so each opcode gets its own indirect branch; otherwise a switch statement is used
+
+// Execution starts at instruction start, which is runtime->entry unless native code ran the first part of the program
+// or an earlier call stopped at the budget
+// Returns A4_DONE at a halt, A4_ERROR after reporting an error, and A4_BUDGET or A4_DEADLINE with runtime->next set
+// to the instruction to continue from
+static int EXECUTE_FUNCTION(Runtime *runtime, int start)
+{
+   Instruction *program = runtime->program;
+   Value *values = runtime->intValues;
+   uint64_t *set = runtime->intValuesSet;
+   Output *output = runtime->output;
+
+   // Index of the instruction being executed
+   int idx = start;
+   Instruction *ins;
+
+#ifdef EXECUTE_PROFILE
+   // Every dispatch charges the ticks since the previous one to the instruction that was running
+   long long *counts = runtime->profile->counts;
+   uint64_t *ticks = runtime->profile->ticks;
+   int running = -1;
+   uint64_t started = 0;
+
+   #define PROFILE_STEP() \
+      do { \
+         uint64_t now = read_ticks(); \
+         if (running >= 0) \
+            ticks[running] += now - started; \
+         counts[idx]++; \
+         running = idx; \
+         started = now; \
+      } while (0)
+   #define PROFILE_END() ticks[running] += read_ticks() - started
+#else
+   #define PROFILE_STEP() do { } while (0)
+   #define PROFILE_END() do { } while (0)
+#endif
+
+#ifdef EXECUTE_TRACE
+   // Every dispatch records an event, and fills in the value left behind by the instruction before it
+   TraceEvent *events = runtime->trace->events;
+   uint64_t mask = runtime->trace->mask;
+   uint64_t *count = &runtime->trace->header->count;
+   const int *writes = runtime->trace->writes;
+   TraceEvent *pending = NULL;
+
+   #define TRACE_FINISH() \
+      do { \
+         if (pending != NULL) \
+         { \
+            pending->after = values[writes[pending->index]]; \
+            pending->flags |= TRACE_DONE; \
+            pending = NULL; \
+         } \
+      } while (0)
+   #define TRACE_STEP() \
+      do { \
+         TRACE_FINISH(); \
+         TraceEvent *event = &events[(*count)++ & mask]; \
+         int slot = writes[idx]; \
+         event->index = idx; \
+         event->opcode = program[idx].opcode; \
+         event->flags = 0; \
+         event->before = 0; \
+         event->after = 0; \
+         if (slot >= 0) \
+         { \
+            event->flags = TRACE_WRITE | (TEST_BIT(set, slot) ? TRACE_WAS_SET : 0); \
+            event->before = values[slot]; \
+            pending = event; \
+         } \
+      } while (0)
+   #define TRACE_END() TRACE_FINISH()
+#else
+   #define TRACE_STEP() do { } while (0)
+   #define TRACE_END() do { } while (0)
+#endif
+
+#ifdef EXECUTE_OVERFLOW
+   #define OVERFLOW_POLICY EXECUTE_OVERFLOW
+#else
+   const int overflow = runtime->overflow;
+   #define OVERFLOW_POLICY overflow
+#endif
+
+#ifdef EXECUTE_BUDGET
+   // Instructions left before the budget and the deadline are looked at again, see next_slice
+   long long slice = next_slice(runtime);
+   long long countdown = slice;
+
+   // Stop before the instruction at idx, every instruction before it has run in full
+   #define BUDGET_STEP() \
+      do { \
+         if (countdown == 0) \
+         { \
+            int stop = charge_slice(runtime, slice); \
+            if (stop != A4_READY) \
+            { \
+               flush_output(output); \
+               runtime->next = idx; \
+               runtime->pc = program[idx].line_number; \
+               return stop; \
+            } \
+            slice = countdown = next_slice(runtime); \
+         } \
+         countdown--; \
+      } while (0)
+#else
+   #define BUDGET_STEP() do { } while (0)
+#endif
+
+#ifdef USE_THREADED_DISPATCH
+   static void *dispatch_table[] = {
+      [OP_HALT] = &&OP_HALT_handler,
+      [OP_SET] = &&OP_SET_handler,
+      [OP_ADD] = &&OP_ADD_handler,
+      [OP_SUB] = &&OP_SUB_handler,
+      [OP_MULT] = &&OP_MULT_handler,
+      [OP_DIV] = &&OP_DIV_handler,
+      [OP_PRINT] = &&OP_PRINT_handler,
+      [OP_GOTO] = &&OP_GOTO_handler,
+      [OP_IF_EQ] = &&OP_IF_EQ_handler,
+      [OP_IF_NE] = &&OP_IF_NE_handler,
+      [OP_IF_GT] = &&OP_IF_GT_handler,
+      [OP_IF_GTE] = &&OP_IF_GTE_handler,
+      [OP_IF_LT] = &&OP_IF_LT_handler,
+      [OP_IF_LTE] = &&OP_IF_LTE_handler,
+      [OP_NOP] = &&OP_NOP_handler,
+      [OP_TRAP] = &&OP_TRAP_handler,
+      [OP_BRANCH_EQ] = &&OP_BRANCH_EQ_handler,
+      [OP_BRANCH_NE] = &&OP_BRANCH_NE_handler,
+      [OP_BRANCH_GT] = &&OP_BRANCH_GT_handler,
+      [OP_BRANCH_GTE] = &&OP_BRANCH_GTE_handler,
+      [OP_BRANCH_LT] = &&OP_BRANCH_LT_handler,
+      [OP_BRANCH_LTE] = &&OP_BRANCH_LTE_handler,
+      [OP_ADD_BRANCH_EQ] = &&OP_ADD_BRANCH_EQ_handler,
+      [OP_ADD_BRANCH_NE] = &&OP_ADD_BRANCH_NE_handler,
+      [OP_ADD_BRANCH_GT] = &&OP_ADD_BRANCH_GT_handler,
+      [OP_ADD_BRANCH_GTE] = &&OP_ADD_BRANCH_GTE_handler,
+      [OP_ADD_BRANCH_LT] = &&OP_ADD_BRANCH_LT_handler,
+      [OP_ADD_BRANCH_LTE] = &&OP_ADD_BRANCH_LTE_handler,
+      [OP_LOOP] = &&OP_LOOP_handler,
+      [OP_SET_VAR] = &&OP_SET_VAR_handler,
+      [OP_ADD_VAR] = &&OP_ADD_VAR_handler,
+      [OP_SUB_VAR] = &&OP_SUB_VAR_handler,
+      [OP_MULT_VAR] = &&OP_MULT_VAR_handler,
+      [OP_DIV_VAR] = &&OP_DIV_VAR_handler,
+   };
+
+   #define DISPATCH() do { PROFILE_STEP(); BUDGET_STEP(); TRACE_STEP(); ins = &program[idx]; goto *dispatch_table[ins->opcode]; } while (0)
+   #define EXECUTE(instruction) do { ins = (instruction); goto *dispatch_table[ins->opcode]; } while (0)
+   #define HANDLER(op) op##_handler
+#else
+   #define DISPATCH() goto dispatch
+   #define EXECUTE(instruction) do { ins = (instruction); goto execute; } while (0)
+   #define HANDLER(op) case op
+#endif
+
+   // Report an error at the instruction being run and stop
+   #define FAIL(...) \
+      do { \
+         flush_output(output); \
+         report(__VA_ARGS__); \
+         runtime->pc = ins->line_number; \
+         PROFILE_END(); \
+         TRACE_END(); \
+         return A4_ERROR; \
+      } while (0)
+
+#ifdef EXECUTE_VERIFIED
+   #define REQUIRE_SET(slot, message) do { } while (0)
+   #define OPERANDS_SET(compare) 1
+#else
+   // Report an unset variable and stop, unless the instruction has been proven to only read set variables
+   #define REQUIRE_SET(slot, message) \
+      do { \
+         if (!ins->proven && !TEST_BIT(set, (slot))) \
+            FAIL(message, ins->line_number, runtime->intNames[(slot)].len, runtime->intNames[(slot)].str); \
+      } while (0)
+   #define OPERANDS_SET(compare) (ins->proven || (TEST_BIT(set, (compare)->a) && TEST_BIT(set, (compare)->b)))
+#endif
+
+   // Store target op operand in target under the overflow policy, the builtins give the wrapped result and whether
+   // it overflowed, saturated is the result a saturating overflow gives
+   #define OVERFLOWING(builtin, target, operand, saturated) \
+      do { \
+         Value result; \
+         if (builtin((target), (operand), &result) && OVERFLOW_POLICY != OVERFLOW_WRAP) \
+         { \
+            if (OVERFLOW_POLICY == OVERFLOW_TRAP) \
+               FAIL("Error at line %d: Variable %.*s overflowed\n", ins->line_number, runtime->intNames[ins->a].len, runtime->intNames[ins->a].str); \
+            result = (saturated); \
+         } \
+         (target) = result; \
+      } while (0)
+
+   #define ADD_VALUE(target, operand) OVERFLOWING(__builtin_add_overflow, target, operand, (operand) > 0 ? VALUE_MAX : VALUE_MIN)
+   #define SUB_VALUE(target, operand) OVERFLOWING(__builtin_sub_overflow, target, operand, (operand) > 0 ? VALUE_MIN : VALUE_MAX)
+   #define MULT_VALUE(target, operand) OVERFLOWING(__builtin_mul_overflow, target, operand, ((target) < 0) != ((operand) < 0) ? VALUE_MIN : VALUE_MAX)
+
+   // Division by zero is an error under every policy, and the one division that overflows is VALUE_MIN / -1
+   #define DIV_VALUE(target, operand) \
+      do { \
+         Value divisor = (operand); \
+         if (divisor == 0) \
+            FAIL("Error at line %d: Division by zero\n", ins->line_number); \
+         if (divisor == -1 && (target) == VALUE_MIN) \
+         { \
+            if (OVERFLOW_POLICY == OVERFLOW_TRAP) \
+               FAIL("Error at line %d: Variable %.*s overflowed\n", ins->line_number, runtime->intNames[ins->a].len, runtime->intNames[ins->a].str); \
+            (target) = OVERFLOW_POLICY == OVERFLOW_SATURATE ? VALUE_MAX : VALUE_MIN; \
+         } \
+         else \
+            (target) /= divisor; \
+      } while (0)
+
+   // Arithmetic commands need their variable to be set
+   #define ARITHMETIC(operation) \
+      REQUIRE_SET(ins->a, "Error at line %d: Variable %.*s is not set\n"); \
+      operation(values[ins->a], (Value)ins->b); \
+      idx++; \
+      DISPATCH();
+
+   // Arithmetic with a variable operand needs both variables to be set
+   #define ARITHMETIC_VAR(operation) \
+      REQUIRE_SET(ins->a, "Error at line %d: Variable %.*s is not set\n"); \
+      REQUIRE_SET(ins->b, "Error at line %d: Variable %.*s is not set\n"); \
+      operation(values[ins->a], values[ins->b]); \
+      idx++; \
+      DISPATCH();
+
+   // Operands are either variables or constant slots, constants are always set
+   // If the expression is false, skip the next line
+   #define COMPARE(operator) \
+      REQUIRE_SET(ins->a, "Error at line %d: %.*s is not defined\n"); \
+      REQUIRE_SET(ins->b, "Error at line %d: %.*s is not defined\n"); \
+      idx = values[ins->a] operator values[ins->b] ? idx + 1 : ins->target; \
+      DISPATCH();
+
+   // Fused if and goto, a true expression jumps straight to the target of the goto
+   #define BRANCH(operator) \
+      REQUIRE_SET(ins->a, "Error at line %d: %.*s is not defined\n"); \
+      REQUIRE_SET(ins->b, "Error at line %d: %.*s is not defined\n"); \
+      idx = values[ins->a] operator values[ins->b] ? ins->target : idx + 2; \
+      DISPATCH();
+
+   // Fused add, if and goto, the operands of the if are read from the instruction after the add
+   // An unset operand falls back to running the if on its own so the error is reported from its line
+   #define ADD_BRANCH(operator) \
+      REQUIRE_SET(ins->a, "Error at line %d: Variable %.*s is not set\n"); \
+      ADD_VALUE(values[ins->a], (Value)ins->b); \
+      { \
+         Instruction *compare = &program[idx + 1]; \
+         if (!OPERANDS_SET(compare)) \
+         { \
+            idx++; \
+            DISPATCH(); \
+         } \
+         idx = values[compare->a] operator values[compare->b] ? ins->target : idx + 3; \
+      } \
+      DISPATCH();
+
+#ifdef USE_THREADED_DISPATCH
+   DISPATCH();
+#else
+dispatch:
+   PROFILE_STEP();
+   BUDGET_STEP();
+   TRACE_STEP();
+   ins = &program[idx];
+execute:
+   switch (ins->opcode)
+   {
+#endif
+      HANDLER(OP_NOP):
+      {
+         idx++;
+         DISPATCH();
+      }
+      HANDLER(OP_SET):
+      {
+         values[ins->a] = ins->b;
+         SET_BIT(set, ins->a);
+         idx++;
+         DISPATCH();
+      }
+      HANDLER(OP_ADD):
+      {
+         ARITHMETIC(ADD_VALUE)
+      }
+      HANDLER(OP_SUB):
+      {
+         ARITHMETIC(SUB_VALUE)
+      }
+      HANDLER(OP_MULT):
+      {
+         ARITHMETIC(MULT_VALUE)
+      }
+      HANDLER(OP_DIV):
+      {
+         ARITHMETIC(DIV_VALUE)
+      }
+      HANDLER(OP_SET_VAR):
+      {
+         REQUIRE_SET(ins->b, "Error at line %d: Variable %.*s is not set\n");
+         values[ins->a] = values[ins->b];
+         SET_BIT(set, ins->a);
+         idx++;
+         DISPATCH();
+      }
+      HANDLER(OP_ADD_VAR):
+      {
+         ARITHMETIC_VAR(ADD_VALUE)
+      }
+      HANDLER(OP_SUB_VAR):
+      {
+         ARITHMETIC_VAR(SUB_VALUE)
+      }
+      HANDLER(OP_MULT_VAR):
+      {
+         ARITHMETIC_VAR(MULT_VALUE)
+      }
+      HANDLER(OP_DIV_VAR):
+      {
+         ARITHMETIC_VAR(DIV_VALUE)
+      }
+      HANDLER(OP_PRINT):
+      {
+         // Check if both variables are set
+         REQUIRE_SET(ins->a, "Error at line %d: Variable %.*s is not set\n");
+         REQUIRE_SET(ins->b, "Error at line %d: Variable %.*s is not set\n");
+
+         #ifndef NOGRAPHICS
+         // Print the string to the screen at the specified coordinates (row, col)
+         print(values[ins->a], values[ins->b], ins->str.str, ins->str.len);
+         #else
+         // Print the variable values
+         output_print(output, values[ins->a], values[ins->b], ins->str.str, ins->str.len);
+         #endif
+
+         idx++;
+         DISPATCH();
+      }
+      HANDLER(OP_GOTO):
+      {
+         idx = ins->target;
+         DISPATCH();
+      }
+      HANDLER(OP_IF_EQ):
+      {
+         COMPARE(==)
+      }
+      HANDLER(OP_IF_NE):
+      {
+         COMPARE(!=)
+      }
+      HANDLER(OP_IF_GT):
+      {
+         COMPARE(>)
+      }
+      HANDLER(OP_IF_GTE):
+      {
+         COMPARE(>=)
+      }
+      HANDLER(OP_IF_LT):
+      {
+         COMPARE(<)
+      }
+      HANDLER(OP_IF_LTE):
+      {
+         COMPARE(<=)
+      }
+      HANDLER(OP_BRANCH_EQ):
+      {
+         BRANCH(==)
+      }
+      HANDLER(OP_BRANCH_NE):
+      {
+         BRANCH(!=)
+      }
+      HANDLER(OP_BRANCH_GT):
+      {
+         BRANCH(>)
+      }
+      HANDLER(OP_BRANCH_GTE):
+      {
+         BRANCH(>=)
+      }
+      HANDLER(OP_BRANCH_LT):
+      {
+         BRANCH(<)
+      }
+      HANDLER(OP_BRANCH_LTE):
+      {
+         BRANCH(<=)
+      }
+      HANDLER(OP_ADD_BRANCH_EQ):
+      {
+         ADD_BRANCH(==)
+      }
+      HANDLER(OP_ADD_BRANCH_NE):
+      {
+         ADD_BRANCH(!=)
+      }
+      HANDLER(OP_ADD_BRANCH_GT):
+      {
+         ADD_BRANCH(>)
+      }
+      HANDLER(OP_ADD_BRANCH_GTE):
+      {
+         ADD_BRANCH(>=)
+      }
+      HANDLER(OP_ADD_BRANCH_LT):
+      {
+         ADD_BRANCH(<)
+      }
+      HANDLER(OP_ADD_BRANCH_LTE):
+      {
+         ADD_BRANCH(<=)
+      }
+      HANDLER(OP_LOOP):
+      {
+         // Jump past the loop when its result could be computed, otherwise run the instruction OP_LOOP replaced
+         // and step through the loop as usual, executing the saved copy instead of the program's
+         Loop *loop = &runtime->loops[ins->b];
+         if (run_loop(runtime, loop))
+         {
+            idx = loop->exit;
+            DISPATCH();
+         }
+         EXECUTE(&loop->head);
+      }
+      HANDLER(OP_TRAP):
+      {
+         flush_output(output);
+         if (ins->a == TRAP_INVALID_LINE)
+            report("Error at line %d: Invalid line number %d\n", ins->line_number, ins->b);
+         else
+            report("Error: Command at line %d not found\n", ins->b);
+         runtime->pc = ins->line_number;
+         PROFILE_END();
+         TRACE_END();
+         return A4_ERROR;
+      }
+      HANDLER(OP_HALT):
+#ifndef USE_THREADED_DISPATCH
+      default:
+#endif
+      {
+         flush_output(output);
+         runtime->pc = ins->line_number;
+         PROFILE_END();
+         TRACE_END();
+         return A4_DONE;
+      }
+#ifndef USE_THREADED_DISPATCH
+   }
+#endif
+
+   #undef DISPATCH
+   #undef HANDLER
+   #undef EXECUTE
+   #undef FAIL
+   #undef REQUIRE_SET
+   #undef OPERANDS_SET
+   #undef ARITHMETIC
+   #undef ARITHMETIC_VAR
+   #undef OVERFLOWING
+   #undef ADD_VALUE
+   #undef SUB_VALUE
+   #undef MULT_VALUE
+   #undef DIV_VALUE
+   #undef OVERFLOW_POLICY
+   #undef COMPARE
+   #undef BRANCH
+   #undef ADD_BRANCH
+   #undef PROFILE_STEP
+   #undef PROFILE_END
+   #undef BUDGET_STEP
+   #undef TRACE_FINISH
+   #undef TRACE_STEP
+   #undef TRACE_END
+}
+
+#undef EXECUTE_FUNCTION
+#undef EXECUTE_PROFILE
+#undef EXECUTE_BUDGET
+#undef EXECUTE_TRACE
+#undef EXECUTE_VERIFIED
+#undef EXECUTE_OVERFLOW
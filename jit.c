@@ -0,0 +1,465 @@
+/* Native code generation for compiled programs
+        -translates the instructions of a compiled runtime to x86-64 machine code, one basic block after another
+        -variables stay in the runtime's intValues array, PRINT calls back into the interpreter's output path
+        -anything the native code does not handle itself, including every error, returns to the interpreter at the
+         instruction in question, which then runs it exactly as it would have without native code
+        -under the trap and saturate policies arithmetic that overflows, and any division that could, is also left
+         to the interpreter before the variable is written
+        -variables are 32 bits, a build with 64-bit values always runs the interpreter
+*/
+
+#include "a4.h"
+
+# pragma region JIT Functions
+
+#if defined(__x86_64__) && !defined(A4_WIDE_VALUES)
+
+// Upper bound on the machine code for one instruction, plus the prologue, epilogue and one exit stub per instruction
+#define JIT_INSTRUCTION_SIZE 96
+#define JIT_EXIT_SIZE 10
+#define JIT_FIXED_SIZE 64
+
+// Kind of location a rel32 jump is patched to point at
+#define JIT_TO_INSTRUCTION 0
+#define JIT_TO_EXIT 1
+
+// rel32 field to fill in once every instruction and exit stub has an address
+typedef struct
+{
+   size_t at;
+   int kind;
+   int index;
+} Patch;
+
+// Machine code being generated
+typedef struct
+{
+   unsigned char *code;
+   size_t len;
+
+   // Offset of the code for every instruction and of the stub that returns to the interpreter at it, -1 if unused
+   size_t *instructions;
+   long *exits;
+
+   Patch *patches;
+   int patchesLen;
+
+   // Program being compiled, set checks are left out of the instructions verify_program has proven
+   Instruction *program;
+
+   // Set unless overflow wraps, arithmetic then returns to the interpreter when it overflows
+   int checked;
+} Assembler;
+
+static void emit_byte(Assembler *as, int byte)
+{
+   as->code[as->len++] = (unsigned char)byte;
+}
+
+static void emit_bytes(Assembler *as, const char *bytes, int len)
+{
+   memcpy(as->code + as->len, bytes, len);
+   as->len += len;
+}
+
+static void emit_int32(Assembler *as, int32_t value)
+{
+   memcpy(as->code + as->len, &value, 4);
+   as->len += 4;
+}
+
+static void emit_int64(Assembler *as, uint64_t value)
+{
+   memcpy(as->code + as->len, &value, 8);
+   as->len += 8;
+}
+
+// rel32 operand to be patched to jump to an instruction or its exit stub
+static void emit_target(Assembler *as, int kind, int index)
+{
+   Patch *patch = &as->patches[as->patchesLen++];
+   patch->at = as->len;
+   patch->kind = kind;
+   patch->index = index;
+   emit_int32(as, 0);
+
+   if (kind == JIT_TO_EXIT)
+      as->exits[index] = 0;
+}
+
+// jz to the exit at instruction index when the set bit of slot is clear, unless the instruction is proven
+// test byte [r12 + slot / 8], 1 << (slot % 8)
+static void emit_require_set(Assembler *as, int slot, int index)
+{
+   if (as->program[index].proven)
+      return;
+
+   emit_bytes(as, "\x41\xF6\x84\x24", 4);
+   emit_int32(as, slot >> 3);
+   emit_byte(as, 1 << (slot & 7));
+   emit_bytes(as, "\x0F\x84", 2);
+   emit_target(as, JIT_TO_EXIT, index);
+}
+
+// jo to the exit at instruction index when the arithmetic before it overflowed, only for checked programs
+static void emit_require_no_overflow(Assembler *as, int index)
+{
+   if (!as->checked)
+      return;
+
+   emit_bytes(as, "\x0F\x80", 2);
+   emit_target(as, JIT_TO_EXIT, index);
+}
+
+// Operand for a slot in intValues, [rbx + slot * 4]
+static void emit_slot(Assembler *as, int opcode_bytes, const char *opcode, int slot)
+{
+   emit_bytes(as, opcode, opcode_bytes);
+   emit_int32(as, slot * 4);
+}
+
+// mov rax, function; call rax
+static void emit_call(Assembler *as, void *function)
+{
+   emit_bytes(as, "\x48\xB8", 2);
+   emit_int64(as, (uint64_t)(uintptr_t)function);
+   emit_bytes(as, "\xFF\xD0", 2);
+}
+
+// Return to the interpreter at instruction index
+static void emit_exit(Assembler *as, int index, size_t epilogue)
+{
+   emit_byte(as, 0xB8);
+   emit_int32(as, index);
+   emit_byte(as, 0xE9);
+   emit_int32(as, (int32_t)(epilogue - (as->len + 4)));
+}
+
+// Add or subtract an immediate to a set variable, shared by ADD, SUB and the head of OP_LOOP
+static void emit_add(Assembler *as, Instruction *ins, int opcode, int index)
+{
+   emit_require_set(as, ins->a, index);
+
+   // mov eax, [rbx + a * 4]; add/sub eax, b; jo exit; mov [rbx + a * 4], eax
+   if (as->checked)
+   {
+      emit_slot(as, 2, "\x8B\x83", ins->a);
+      emit_byte(as, opcode == OP_ADD ? 0x05 : 0x2D);
+      emit_int32(as, ins->b);
+      emit_require_no_overflow(as, index);
+      emit_slot(as, 2, "\x89\x83", ins->a);
+      return;
+   }
+
+   // add/sub dword [rbx + a * 4], b
+   emit_slot(as, 2, opcode == OP_ADD ? "\x81\x83" : "\x81\xAB", ins->a);
+   emit_int32(as, ins->b);
+}
+
+// Compile the program of a runtime to native code that execute_runtime runs before handing over to the interpreter
+// Returns -1 when native code can not be generated, the interpreter then runs the whole program as usual
+int jit_compile(Runtime *runtime)
+{
+   if (runtime == NULL || runtime->program == NULL)
+   {
+      return -1;
+   }
+
+   int n = runtime->programLen;
+   size_t capacity = JIT_FIXED_SIZE + (size_t)n * (JIT_INSTRUCTION_SIZE + JIT_EXIT_SIZE);
+   long page = sysconf(_SC_PAGESIZE);
+   capacity = (capacity + page - 1) / page * page;
+
+   Assembler as;
+   as.len = 0;
+   as.patchesLen = 0;
+   as.program = runtime->program;
+   as.checked = runtime->overflow != OVERFLOW_WRAP;
+   as.code = mmap(NULL, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   as.instructions = malloc(sizeof(size_t) * n);
+   as.exits = malloc(sizeof(long) * n);
+
+   // At most four jumps per instruction, and one from the prologue
+   as.patches = malloc(sizeof(Patch) * ((size_t)n * 4 + 1));
+   if (as.code == MAP_FAILED || as.instructions == NULL || as.exits == NULL || as.patches == NULL)
+   {
+      if (as.code != MAP_FAILED)
+         munmap(as.code, capacity);
+      free(as.instructions);
+      free(as.exits);
+      free(as.patches);
+      report("Error: Could not allocate memory for native code\n");
+      return -1;
+   }
+
+   for (int i = 0; i < n; i++)
+   {
+      as.exits[i] = -1;
+   }
+
+   // Shared epilogue: pop r13; pop r12; pop rbx; ret
+   size_t epilogue = as.len;
+   emit_bytes(&as, "\x41\x5D\x41\x5C\x5B\xC3", 6);
+
+   // Prologue: push rbx; push r12; push r13, leaving the stack aligned for calls
+   // rbx holds intValues, r12 the set bitset and r13 the runtime
+   size_t entry = as.len;
+   emit_bytes(&as, "\x53\x41\x54\x41\x55", 5);
+   emit_bytes(&as, "\x48\x89\xFB\x49\x89\xF4\x49\x89\xD5", 9);
+   emit_byte(&as, 0xE9);
+   emit_target(&as, JIT_TO_INSTRUCTION, runtime->entry);
+
+   for (int i = 0; i < n; i++)
+   {
+      Instruction *ins = &runtime->program[i];
+      as.instructions[i] = as.len;
+
+      switch (ins->opcode)
+      {
+         case OP_NOP:
+         {
+            break;
+         }
+         case OP_SET:
+         {
+            // mov dword [rbx + a * 4], b; or byte [r12 + a / 8], 1 << (a % 8)
+            emit_slot(&as, 2, "\xC7\x83", ins->a);
+            emit_int32(&as, ins->b);
+            emit_bytes(&as, "\x41\x80\x8C\x24", 4);
+            emit_int32(&as, ins->a >> 3);
+            emit_byte(&as, 1 << (ins->a & 7));
+            break;
+         }
+         case OP_ADD:
+         case OP_SUB:
+         {
+            emit_add(&as, ins, ins->opcode, i);
+            break;
+         }
+         case OP_MULT:
+         {
+            // mov eax, [rbx + a * 4]; imul eax, eax, b; jo exit; mov [rbx + a * 4], eax
+            emit_require_set(&as, ins->a, i);
+            emit_slot(&as, 2, "\x8B\x83", ins->a);
+            emit_bytes(&as, "\x69\xC0", 2);
+            emit_int32(&as, ins->b);
+            emit_require_no_overflow(&as, i);
+            emit_slot(&as, 2, "\x89\x83", ins->a);
+            break;
+         }
+         case OP_DIV:
+         {
+            // A division by zero is an error the interpreter reports
+            if (ins->b == 0)
+            {
+               emit_exit(&as, i, epilogue);
+               break;
+            }
+
+            // mov eax, [rbx + a * 4]; neg eax; jo exit; mov [rbx + a * 4], eax
+            // neg only overflows for INT_MIN, which the interpreter wraps, traps or saturates
+            emit_require_set(&as, ins->a, i);
+            if (ins->b == -1)
+            {
+               emit_slot(&as, 2, "\x8B\x83", ins->a);
+               emit_bytes(&as, "\xF7\xD8\x0F\x80", 4);
+               emit_target(&as, JIT_TO_EXIT, i);
+               emit_slot(&as, 2, "\x89\x83", ins->a);
+               break;
+            }
+
+            // mov eax, [rbx + a * 4]; cdq; mov ecx, b; idiv ecx; mov [rbx + a * 4], eax
+            emit_slot(&as, 2, "\x8B\x83", ins->a);
+            emit_byte(&as, 0x99);
+            emit_byte(&as, 0xB9);
+            emit_int32(&as, ins->b);
+            emit_bytes(&as, "\xF7\xF9", 2);
+            emit_slot(&as, 2, "\x89\x83", ins->a);
+            break;
+         }
+         case OP_SET_VAR:
+         {
+            // mov eax, [rbx + b * 4]; mov [rbx + a * 4], eax; or byte [r12 + a / 8], 1 << (a % 8)
+            emit_require_set(&as, ins->b, i);
+            emit_slot(&as, 2, "\x8B\x83", ins->b);
+            emit_slot(&as, 2, "\x89\x83", ins->a);
+            emit_bytes(&as, "\x41\x80\x8C\x24", 4);
+            emit_int32(&as, ins->a >> 3);
+            emit_byte(&as, 1 << (ins->a & 7));
+            break;
+         }
+         case OP_ADD_VAR:
+         case OP_SUB_VAR:
+         {
+            emit_require_set(&as, ins->a, i);
+            emit_require_set(&as, ins->b, i);
+
+            // mov eax, [rbx + a * 4]; add/sub eax, [rbx + b * 4]; jo exit; mov [rbx + a * 4], eax
+            if (as.checked)
+            {
+               emit_slot(&as, 2, "\x8B\x83", ins->a);
+               emit_slot(&as, 2, ins->opcode == OP_ADD_VAR ? "\x03\x83" : "\x2B\x83", ins->b);
+               emit_require_no_overflow(&as, i);
+               emit_slot(&as, 2, "\x89\x83", ins->a);
+               break;
+            }
+
+            // mov eax, [rbx + b * 4]; add/sub [rbx + a * 4], eax
+            emit_slot(&as, 2, "\x8B\x83", ins->b);
+            emit_slot(&as, 2, ins->opcode == OP_ADD_VAR ? "\x01\x83" : "\x29\x83", ins->a);
+            break;
+         }
+         case OP_MULT_VAR:
+         {
+            // mov eax, [rbx + a * 4]; imul eax, [rbx + b * 4]; jo exit; mov [rbx + a * 4], eax
+            emit_require_set(&as, ins->a, i);
+            emit_require_set(&as, ins->b, i);
+            emit_slot(&as, 2, "\x8B\x83", ins->a);
+            emit_slot(&as, 3, "\x0F\xAF\x83", ins->b);
+            emit_require_no_overflow(&as, i);
+            emit_slot(&as, 2, "\x89\x83", ins->a);
+            break;
+         }
+         case OP_DIV_VAR:
+         {
+            // mov ecx, [rbx + b * 4]; test ecx, ecx; jz exit; cmp ecx, -1; je exit
+            // mov eax, [rbx + a * 4]; cdq; idiv ecx; mov [rbx + a * 4], eax
+            // Divisors of 0 and -1 go to the interpreter, so idiv never faults
+            emit_require_set(&as, ins->a, i);
+            emit_require_set(&as, ins->b, i);
+            emit_slot(&as, 2, "\x8B\x8B", ins->b);
+            emit_bytes(&as, "\x85\xC9\x0F\x84", 4);
+            emit_target(&as, JIT_TO_EXIT, i);
+            emit_bytes(&as, "\x83\xF9\xFF\x0F\x84", 5);
+            emit_target(&as, JIT_TO_EXIT, i);
+            emit_slot(&as, 2, "\x8B\x83", ins->a);
+            emit_byte(&as, 0x99);
+            emit_bytes(&as, "\xF7\xF9", 2);
+            emit_slot(&as, 2, "\x89\x83", ins->a);
+            break;
+         }
+         case OP_PRINT:
+         {
+            // jit_print(runtime, i)
+            emit_require_set(&as, ins->a, i);
+            emit_require_set(&as, ins->b, i);
+            emit_bytes(&as, "\x4C\x89\xEF", 3);
+            emit_byte(&as, 0xBE);
+            emit_int32(&as, i);
+            emit_call(&as, (void *)jit_print);
+            break;
+         }
+         case OP_GOTO:
+         {
+            emit_byte(&as, 0xE9);
+            emit_target(&as, JIT_TO_INSTRUCTION, ins->target);
+            break;
+         }
+         case OP_IF_EQ:
+         case OP_IF_NE:
+         case OP_IF_GT:
+         case OP_IF_GTE:
+         case OP_IF_LT:
+         case OP_IF_LTE:
+         {
+            // mov eax, [rbx + a * 4]; cmp eax, [rbx + b * 4], then jump to the false target when the expression
+            // does not hold (jne, je, jle, jl, jge, jg) and fall through to the next instruction when it does
+            static const char inverse[] = {'\x85', '\x84', '\x8E', '\x8C', '\x8D', '\x8F'};
+            emit_require_set(&as, ins->a, i);
+            emit_require_set(&as, ins->b, i);
+            emit_slot(&as, 2, "\x8B\x83", ins->a);
+            emit_slot(&as, 2, "\x3B\x83", ins->b);
+            emit_byte(&as, 0x0F);
+            emit_byte(&as, inverse[ins->opcode - OP_IF_EQ]);
+            emit_target(&as, JIT_TO_INSTRUCTION, ins->target);
+            break;
+         }
+         case OP_LOOP:
+         {
+            // if (run_loop(runtime, loop)) goto exit of the loop; otherwise run the head and step through the loop
+            Loop *loop = &runtime->loops[ins->b];
+            emit_bytes(&as, "\x4C\x89\xEF\x48\xBE", 5);
+            emit_int64(&as, (uint64_t)(uintptr_t)loop);
+            emit_call(&as, (void *)run_loop);
+            emit_bytes(&as, "\x85\xC0\x0F\x85", 4);
+            emit_target(&as, JIT_TO_INSTRUCTION, loop->exit);
+            emit_add(&as, &loop->head, loop->head.opcode, i);
+            break;
+         }
+         default:
+         {
+            // Halts, traps and superinstructions are left to the interpreter
+            emit_exit(&as, i, epilogue);
+            break;
+         }
+      }
+   }
+
+   // Stubs returning to the interpreter, only for the instructions that have a jump to one
+   for (int i = 0; i < n; i++)
+   {
+      if (as.exits[i] == -1)
+         continue;
+
+      as.exits[i] = as.len;
+      emit_exit(&as, i, epilogue);
+   }
+
+   for (int p = 0; p < as.patchesLen; p++)
+   {
+      Patch *patch = &as.patches[p];
+      size_t to = patch->kind == JIT_TO_EXIT ? (size_t)as.exits[patch->index] : as.instructions[patch->index];
+      int32_t rel = (int32_t)(to - (patch->at + 4));
+      memcpy(as.code + patch->at, &rel, 4);
+   }
+
+   free(as.instructions);
+   free(as.exits);
+   free(as.patches);
+
+   if (mprotect(as.code, capacity, PROT_READ | PROT_EXEC) == -1)
+   {
+      munmap(as.code, capacity);
+      report("Error: Could not make native code executable: %s\n", strerror(errno));
+      return -1;
+   }
+
+   runtime->native = (NativeProgram)(void *)(as.code + entry);
+   runtime->nativeSize = capacity;
+
+   return 1;
+}
+
+// Release the native code of a runtime
+void jit_free(Runtime *runtime)
+{
+   if (runtime == NULL || runtime->native == NULL)
+   {
+      return;
+   }
+
+   // The code starts at the beginning of its mapping, the entry point is a little way in
+   long page = sysconf(_SC_PAGESIZE);
+   void *code = (void *)((uintptr_t)runtime->native & ~(uintptr_t)(page - 1));
+   munmap(code, runtime->nativeSize);
+   runtime->native = NULL;
+   runtime->nativeSize = 0;
+}
+
+#else
+
+// Native code is only generated for x86-64 with 32-bit values, everything else runs the interpreter
+int jit_compile(Runtime *runtime)
+{
+   (void)runtime;
+   return -1;
+}
+
+void jit_free(Runtime *runtime)
+{
+   (void)runtime;
+}
+
+#endif
+
+# pragma endregion
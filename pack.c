@@ -0,0 +1,261 @@
+/* Compressed PRINT output, for a4ng --compress
+        -every line is a record with the steps its row and col took from the line before, so lines printed along
+         a row or column cost a few bytes whatever the size of the numbers
+        -strings are kept in a table of PACK_STRINGS slots, a line only carries its string the first time, after
+         that its slot or nothing when it is the string of the line before
+        -lines that repeat one of the last PACK_PERIODS lines, string and steps alike, are counted instead of
+         written, and a run of them becomes one repeat record
+        -anything else written to the output, errors included, goes into text records in between
+        -output collected on its own, such as that of the runs of a sweep after the first, starts from a reset
+         and is appended as it is
+        -a4unpack turns a stream back into the text a4ng would have printed
+*/
+
+#include "a4.h"
+
+# pragma region Pack Functions
+
+// Lines kept for repeats, a power of two larger than PACK_PERIODS as a repeat compares a line with the one before
+#define PACK_HISTORY 8
+
+// A line as the encoder sees it, the string points into the source of the program printing it
+typedef struct
+{
+   const char *str;
+   int len;
+   uint64_t rowStep;
+   uint64_t colStep;
+} PackLine;
+
+// Encoder state of a compressed output
+typedef struct Pack
+{
+   // Strings of the table, by the slot pack_hash gives them
+   const char *strings[PACK_STRINGS];
+   int lens[PACK_STRINGS];
+
+   // Row and col of the last line, steps are taken from here whether or not the line was written yet
+   Value row;
+   Value col;
+
+   // Last lines printed, line n at n % PACK_HISTORY
+   PackLine history[PACK_HISTORY];
+   uint64_t lines;
+
+   // Period and length of the run of repeated lines being counted, 0 when there is none
+   int period;
+   uint64_t run;
+} Pack;
+
+// Whether two strings hold the same characters, strings of a PRINT usually point at the same token
+static inline int same_string(const char *a, int alen, const char *b, int blen)
+{
+   return alen == blen && (a == b || memcmp(a, b, alen) == 0);
+}
+
+static inline int same_line(const PackLine *a, const PackLine *b)
+{
+   return a->rowStep == b->rowStep && a->colStep == b->colStep && same_string(a->str, a->len, b->str, b->len);
+}
+
+// Append n as an unsigned LEB128 varint
+static void append_varint(Output *output, uint64_t n)
+{
+   char bytes[10];
+   int len = 0;
+   while (n >= 0x80)
+   {
+      bytes[len++] = (char)(n | 0x80);
+      n >>= 7;
+   }
+   bytes[len++] = (char)n;
+   output_append(output, bytes, len);
+}
+
+// Append a tag byte
+static void append_tag(Output *output, int tag)
+{
+   char byte = (char)tag;
+   output_append(output, &byte, 1);
+}
+
+// Write out line n of the history on its own, comparing its string with the line before and the table
+static void write_line(Output *output, uint64_t n)
+{
+   Pack *pack = output->pack;
+   PackLine *line = &pack->history[n % PACK_HISTORY];
+   PackLine *previous = &pack->history[(n - 1) % PACK_HISTORY];
+
+   if (n > 0 && same_string(line->str, line->len, previous->str, previous->len))
+   {
+      append_tag(output, PACK_SAME);
+   }
+   else
+   {
+      int slot = pack_hash(line->str, line->len);
+      if (pack->strings[slot] != NULL && same_string(line->str, line->len, pack->strings[slot], pack->lens[slot]))
+      {
+         append_tag(output, PACK_PRINT);
+         append_varint(output, slot);
+      }
+      else
+      {
+         pack->strings[slot] = line->str;
+         pack->lens[slot] = line->len;
+         append_tag(output, PACK_STRING);
+         append_varint(output, line->len);
+         output_append(output, line->str, line->len);
+      }
+   }
+
+   append_varint(output, line->rowStep);
+   append_varint(output, line->colStep);
+}
+
+// Write out the run of repeated lines being counted, a run of one line is cheaper written as that line
+// The run is cleared before anything is appended, as a full buffer is flushed and flushing finishes the run
+void pack_finish(Output *output)
+{
+   Pack *pack = output->pack;
+   uint64_t run = pack->run;
+   int period = pack->period;
+   if (period == 0)
+   {
+      return;
+   }
+
+   pack->period = 0;
+   pack->run = 0;
+
+   if (run == 1)
+   {
+      write_line(output, pack->lines - 1);
+      return;
+   }
+
+   append_tag(output, PACK_REPEAT);
+   append_varint(output, period);
+   append_varint(output, run);
+}
+
+// Compressed form of output_print
+void pack_print(Output *output, Value val1, Value val2, const char *str, int len)
+{
+   Pack *pack = output->pack;
+
+   // Steps wrap around in 64 bits so that the decoder gets every value back whatever its width
+   PackLine line;
+   line.str = str;
+   line.len = len;
+   line.rowStep = (uint64_t)(int64_t)val1 - (uint64_t)(int64_t)pack->row;
+   line.colStep = (uint64_t)(int64_t)val2 - (uint64_t)(int64_t)pack->col;
+
+   // Zigzag encoding keeps small steps back as short as small steps forward
+   line.rowStep = (line.rowStep << 1) ^ (uint64_t)((int64_t)line.rowStep >> 63);
+   line.colStep = (line.colStep << 1) ^ (uint64_t)((int64_t)line.colStep >> 63);
+
+   pack->row = val1;
+   pack->col = val2;
+
+   uint64_t n = pack->lines;
+
+   // A run goes on while every line is the one period lines before it
+   if (pack->period != 0)
+   {
+      if (same_line(&line, &pack->history[(n - pack->period) % PACK_HISTORY]))
+      {
+         pack->history[n % PACK_HISTORY] = line;
+         pack->lines++;
+         pack->run++;
+         return;
+      }
+
+      pack_finish(output);
+   }
+
+   pack->history[n % PACK_HISTORY] = line;
+   pack->lines++;
+
+   // The shortest period the line repeats starts a run, written once it ends
+   for (int period = 1; period <= PACK_PERIODS && (uint64_t)period <= n; period++)
+   {
+      if (same_line(&line, &pack->history[(n - period) % PACK_HISTORY]))
+      {
+         pack->period = period;
+         pack->run = 1;
+         return;
+      }
+   }
+
+   write_line(output, n);
+}
+
+// Compressed form of output_write
+void pack_text(Output *output, const char *data, int len)
+{
+   pack_finish(output);
+   append_tag(output, PACK_TEXT);
+   append_varint(output, len);
+   output_append(output, data, len);
+}
+
+// Forget every line and string so far, in the encoder and with a reset record in the decoder
+static void reset_pack(Output *output)
+{
+   memset(output->pack, 0, sizeof(Pack));
+   append_tag(output, PACK_RESET);
+}
+
+// Start writing output compressed, from its header on, or with header 0 from a reset for output collected in
+// memory to be appended to another compressed output with pack_append
+// The strings printed have to stay valid until the output is freed with free_pack, as the table points at them
+// Returns -1 when there is not enough memory
+int pack_output(Output *output, int header)
+{
+   Pack *pack = calloc(1, sizeof(Pack));
+   if (pack == NULL)
+   {
+      return -1;
+   }
+
+   output->pack = pack;
+   if (header)
+   {
+      char magic[5] = {PACK_MAGIC[0], PACK_MAGIC[1], PACK_MAGIC[2], PACK_MAGIC[3], PACK_VERSION};
+      output_append(output, magic, sizeof(magic));
+   }
+   else
+   {
+      reset_pack(output);
+   }
+   return 1;
+}
+
+// Append the compressed output collected in from to output and empty it
+// Both start over from a reset after, as the decoder is left where from ended
+void pack_append(Output *output, Output *from)
+{
+   flush_output(from);
+   pack_finish(output);
+   if (from->memoryLen > 0)
+      output_append(output, from->memory, (int)from->memoryLen);
+   from->memoryLen = 0;
+
+   reset_pack(output);
+   reset_pack(from);
+}
+
+// Finish the stream and go back to plain text
+void free_pack(Output *output)
+{
+   if (output->pack == NULL)
+   {
+      return;
+   }
+
+   pack_finish(output);
+   free(output->pack);
+   output->pack = NULL;
+}
+
+# pragma endregion
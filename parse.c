@@ -0,0 +1,316 @@
+/* Parallel parsing of large sources
+        -the source is split at line boundaries into one chunk per thread, and every thread splits its chunk into
+         commands in an arena of its own
+        -lines are only checked on their own there, whatever needs the symbol table is left to the merge
+        -the merge walks the commands in file order on one thread, declaring variables and checking that the ones
+         used are defined, then compile_runtime resolves the goto targets as usual
+        -a line with a problem is parsed again by parse_line in the merge, so errors are reported exactly as they
+         are when the source is parsed on one thread
+*/
+
+#include "a4.h"
+#include <pthread.h>
+
+# pragma region Parallel Parse Functions
+
+// Command split from a chunk, with the text it came from and whether it passed every check made on its own
+typedef struct
+{
+   Command command;
+   Token line;
+   int valid;
+} ChunkLine;
+
+// Part of the source parsed by one thread, start is the beginning of a line
+typedef struct
+{
+   const char *start;
+   const char *end;
+
+   Arena arena;
+   ChunkLine *lines;
+   int len;
+   int capacity;
+
+   // Set when the arena ran out of memory, the chunk is then incomplete
+   int failed;
+} Chunk;
+
+// Number of arguments every command takes, indexed by syntax flag, see check_arguments
+static const int argument_counts[] = {
+   [INT] = 1, [SET] = 2, [BEGIN] = 0, [END] = 0, [ADD] = 2, [SUB] = 2,
+   [MULT] = 2, [DIV] = 2, [PRINT] = 3, [GOTO] = 1, [IF] = 3,
+};
+
+// Split a line into a command and make every check of parse_line, parse_arg and check_arguments that does not need
+// the symbol table, without reporting anything
+// Returns 1 when the line passed them all
+static int lex_line(const char *line, int len, Command *command)
+{
+   command->line_number = 0;
+   command->command_type = -1;
+   for (int j = 0; j < 3; j++)
+   {
+      command->args[j].str = NULL;
+      command->args[j].len = 0;
+   }
+
+   const char *c = line;
+   const char *end = line + len;
+   int i = 0;
+
+   while (1)
+   {
+      while (c < end && IS_BLANK(*c))
+         c++;
+
+      if (c == end)
+         break;
+
+      Token token;
+      token.str = c;
+      while (c < end && !IS_BLANK(*c))
+         c++;
+      token.len = c - token.str;
+
+      if (i == 0)
+      {
+         int line_number;
+         if (scan_integer(token, &line_number) == -1)
+            return 0;
+         command->line_number = line_number;
+      }
+      else if (i == 1)
+      {
+         command->command_type = determine_command_type(token);
+         if (command->command_type == -1)
+            return 0;
+      }
+      else if (i - 2 < 3)
+      {
+         int arg = i - 2;
+         int type = command->command_type;
+
+         // Variable names that parse_arg checks the length of
+         int name = type == INT || ((type == SET || type == ADD || type == SUB || type == MULT || type == DIV) && arg == 0) ||
+                    (type == PRINT && arg < 2) || (type == IF && arg != 1);
+         if (name && token.len > MAXVARNAME + 1)
+            return 0;
+
+         if (type == GOTO && is_integer(token) == -1)
+            return 0;
+         if (type == IF && arg == 1 && determine_if_opcode(token) == -1)
+            return 0;
+         if (type == BEGIN || type == END)
+            return 0;
+
+         command->args[arg] = token;
+      }
+
+      i++;
+   }
+
+   return command->command_type != -1 && i - 2 == argument_counts[command->command_type];
+}
+
+// Split every line of a chunk into a command
+static void *lex_chunk(void *arg)
+{
+   Chunk *chunk = arg;
+   const char *line = chunk->start;
+
+   while (line < chunk->end)
+   {
+      const char *newline = memchr(line, '\n', chunk->end - line);
+      const char *line_end = newline != NULL ? newline : chunk->end;
+
+      if (line_end == line)
+      {
+         line = line_end + 1;
+         continue;
+      }
+
+      if (chunk->len == chunk->capacity)
+      {
+         int capacity = chunk->capacity > 0 ? chunk->capacity * 2 : INITIAL_COMMANDS;
+         ChunkLine *lines = arena_grow(&chunk->arena, chunk->lines, sizeof(ChunkLine) * chunk->capacity, sizeof(ChunkLine) * capacity);
+         if (lines == NULL)
+         {
+            chunk->failed = 1;
+            return NULL;
+         }
+         chunk->lines = lines;
+         chunk->capacity = capacity;
+      }
+
+      ChunkLine *entry = &chunk->lines[chunk->len++];
+      entry->line.str = line;
+      entry->line.len = line_end - line;
+      entry->valid = lex_line(line, entry->line.len, &entry->command);
+
+      line = line_end + 1;
+   }
+
+   return NULL;
+}
+
+// Make the checks of parse_arg that need the symbol table for a command that passed lex_line, in file order
+static int check_symbols(Runtime *runtime, Command *command)
+{
+   switch (command->command_type)
+   {
+      case INT:
+         return is_defined(runtime, command->args[0]) == -1;
+      case SET:
+      case ADD:
+      case SUB:
+      case MULT:
+      case DIV:
+         return is_defined(runtime, command->args[0]) >= 0 &&
+                (is_integer(command->args[1]) != -1 || is_defined(runtime, command->args[1]) >= 0);
+      case PRINT:
+         return is_defined(runtime, command->args[0]) >= 0 && is_defined(runtime, command->args[1]) >= 0;
+      default:
+         return 1;
+   }
+}
+
+// Number of threads to split a source of len bytes into commands on, 1 to parse it with parse_lines
+int parse_threads(size_t len)
+{
+   size_t chunks = len / PARSE_CHUNK_SIZE;
+   if (chunks < 2)
+      return 1;
+
+   long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+   if (cpus < 1)
+      cpus = 1;
+   if (chunks > (size_t)cpus)
+      chunks = cpus;
+   if (chunks > PARSE_MAX_THREADS)
+      chunks = PARSE_MAX_THREADS;
+
+   return (int)chunks;
+}
+
+// Parse the lines of the source into the commands of the runtime like parse_lines, splitting them into commands on
+// threads threads and then merging them on this one
+int parse_parallel(Runtime *runtime, const char *source, size_t len, int threads)
+{
+   Chunk *chunks = calloc(threads, sizeof(Chunk));
+   pthread_t *ids = malloc(sizeof(pthread_t) * threads);
+   char *started = calloc(threads, 1);
+   if (chunks == NULL || ids == NULL || started == NULL)
+   {
+      free(chunks);
+      free(ids);
+      free(started);
+      return parse_lines(runtime, source, len);
+   }
+
+   // Every chunk starts on the line after the one its even share of the source ends in
+   const char *end = source + len;
+   const char *at = source;
+   for (int t = 0; t < threads; t++)
+   {
+      const char *split = t == threads - 1 ? end : source + (size_t)((double)len * (t + 1) / threads);
+      if (split < at)
+         split = at;
+      const char *newline = split < end ? memchr(split, '\n', end - split) : NULL;
+      split = newline != NULL ? newline + 1 : end;
+
+      chunks[t].start = at;
+      chunks[t].end = split;
+      at = split;
+   }
+
+   // Chunks whose thread can not be started are split into commands on this thread, along with the first
+   for (int t = 1; t < threads; t++)
+   {
+      started[t] = pthread_create(&ids[t], NULL, lex_chunk, &chunks[t]) == 0;
+   }
+
+   lex_chunk(&chunks[0]);
+   for (int t = 1; t < threads; t++)
+   {
+      if (started[t])
+         pthread_join(ids[t], NULL);
+      else
+         lex_chunk(&chunks[t]);
+   }
+
+   int result = 1;
+   long long total = 0;
+   for (int t = 0; t < threads; t++)
+   {
+      if (chunks[t].failed)
+         result = -1;
+      total += chunks[t].len;
+   }
+
+   Command *commands = NULL;
+   if (result == 1 && total < INT_MAX)
+      commands = arena_alloc(&runtime->arena, sizeof(Command) * (total > 0 ? total : 1));
+   if (commands == NULL)
+   {
+      report("Error: Could not allocate memory for commands\n");
+      result = -1;
+   }
+   else
+   {
+      runtime->commands = commands;
+      runtime->commandsCapacity = total > 0 ? (int)total : 1;
+   }
+
+   // Merge in file order, stopping at the first line that parse_line reports an error for
+   int n = 0;
+   for (int t = 0; t < threads && result == 1; t++)
+   {
+      Chunk *chunk = &chunks[t];
+      for (int l = 0; l < chunk->len; l++, n++)
+      {
+         ChunkLine *entry = &chunk->lines[l];
+         Command *command = &runtime->commands[n];
+         runtime->commandsLen = n + 1;
+
+         if (!entry->valid || !check_symbols(runtime, &entry->command))
+         {
+            if (parse_line(runtime, n, entry->line.str, entry->line.len) == -1)
+            {
+               result = -1;
+               break;
+            }
+            continue;
+         }
+
+         *command = entry->command;
+         if (command->command_type == INT && declare_variable(runtime, command->args[0]) == -1)
+         {
+            result = -1;
+            break;
+         }
+         else if (command->command_type == BEGIN)
+         {
+            runtime->begin_line = command->line_number;
+            runtime->begin_flag = 1;
+         }
+         else if (command->command_type == END)
+         {
+            runtime->end_line = command->line_number;
+            runtime->end_flag = 1;
+         }
+      }
+   }
+
+   for (int t = 0; t < threads; t++)
+   {
+      arena_free(&chunks[t].arena);
+   }
+
+   free(chunks);
+   free(ids);
+   free(started);
+   return result;
+}
+
+# pragma endregion
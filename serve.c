@@ -0,0 +1,260 @@
+/* Server mode, programs run by a long running process on request
+        -a4ng --serve <socket> listens on a Unix socket and runs one program for every connection
+        -a request is one line, "run <path>\n" to run a file or "source <length>\n" followed by the program text
+        -the output of the program, errors included, is streamed back over the connection, which is then closed
+        -the process stays up between requests, so there is no start up, and cached programs stay in the page cache
+*/
+
+#include "a4.h"
+#include <pthread.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+# pragma region Serve Functions
+
+// Longest request line accepted, the path of a file to run has to fit
+#define SERVE_LINE_SIZE 4096
+
+// Largest program text accepted in a source request
+#define SERVE_MAX_SOURCE ((size_t)1 << 30)
+
+// Options every request is run with, taken from the command line of the server
+typedef struct
+{
+   int passes;
+   int native;
+   int useCache;
+   int overflow;
+} Server;
+
+typedef struct
+{
+   Server *server;
+   int fd;
+} Connection;
+
+// Read exactly len bytes from fd, returns -1 when the connection ends or fails first
+static int read_exactly(int fd, char *data, size_t len)
+{
+   while (len > 0)
+   {
+      ssize_t bytes = read(fd, data, len);
+      if (bytes == -1 && errno == EINTR)
+         continue;
+      if (bytes <= 0)
+         return -1;
+      data += bytes;
+      len -= bytes;
+   }
+
+   return 1;
+}
+
+// Read the request line one byte at a time, so nothing of the program text after it is consumed
+// The line is NUL terminated without its newline, returns -1 when it is too long or the connection ends
+static int read_line(int fd, char *line, size_t size)
+{
+   size_t len = 0;
+   while (len < size - 1)
+   {
+      char c;
+      if (read_exactly(fd, &c, 1) == -1)
+         return -1;
+      if (c == '\n')
+      {
+         line[len] = '\0';
+         return 1;
+      }
+      line[len++] = c;
+   }
+
+   return -1;
+}
+
+// Build the program a request asks for, source is set to the program text of a source request, which the runtime
+// points into and which has to be freed after it
+static Runtime *build_request(Server *server, int fd, char **source)
+{
+   char line[SERVE_LINE_SIZE];
+   *source = NULL;
+
+   if (read_line(fd, line, sizeof(line)) == -1)
+   {
+      report("Error: Invalid request\n");
+      return NULL;
+   }
+
+   if (strncmp(line, "run ", 4) == 0)
+      return load_program(line + 4, server->passes, server->useCache);
+
+   if (strncmp(line, "source ", 7) != 0)
+   {
+      report("Error: Invalid request\n");
+      return NULL;
+   }
+
+   char *end;
+   errno = 0;
+   unsigned long long len = strtoull(line + 7, &end, 10);
+   if (errno != 0 || end == line + 7 || *end != '\0' || len > SERVE_MAX_SOURCE)
+   {
+      report("Error: Invalid source length %s\n", line + 7);
+      return NULL;
+   }
+
+   // One extra byte so that an empty program still gets a buffer
+   *source = malloc(len + 1);
+   if (*source == NULL)
+   {
+      report("Error: Could not allocate memory for the program\n");
+      return NULL;
+   }
+
+   if (read_exactly(fd, *source, len) == -1)
+   {
+      report("Error: Program text ended early\n");
+      return NULL;
+   }
+
+   Runtime *runtime = build_runtime_from_buffer(*source, len);
+   if (runtime == NULL)
+   {
+      report("Error: Could not build runtime\n");
+      return NULL;
+   }
+
+   optimize_runtime(runtime, server->passes);
+   return runtime;
+}
+
+// Run the request on one connection with the output and every error going back to the client
+static void *serve_connection(void *arg)
+{
+   Connection *connection = arg;
+   Server *server = connection->server;
+   int fd = connection->fd;
+   free(connection);
+
+   Output *output = malloc(sizeof(Output));
+   if (output == NULL)
+   {
+      close(fd);
+      return NULL;
+   }
+
+   init_output(output, fd);
+
+   set_report_output(output);
+
+   char *source;
+   Runtime *runtime = build_request(server, fd, &source);
+   if (runtime != NULL)
+   {
+      runtime->output = output;
+      runtime->overflow = server->overflow;
+
+      // The interpreter runs the program when there is no native code for it
+      if (server->native)
+         jit_compile(runtime);
+
+      execute_runtime(runtime);
+      free_runtime(runtime);
+   }
+
+   flush_output(output);
+   set_report_output(NULL);
+
+   free(source);
+   free(output);
+   close(fd);
+   return NULL;
+}
+
+// Listen on the Unix socket at path and run a program for every connection, each on a thread of its own
+// Passes, native, use_cache and overflow apply to every program as they do for a single one, see main
+// Only returns when the socket can not be set up or accepting a connection fails
+int run_server(const char *path, int passes, int native, int use_cache, int overflow)
+{
+   struct sockaddr_un address;
+   memset(&address, 0, sizeof(address));
+   address.sun_family = AF_UNIX;
+   if (strlen(path) >= sizeof(address.sun_path))
+   {
+      report("Error: Socket path %s is too long\n", path);
+      return -1;
+   }
+   strcpy(address.sun_path, path);
+
+   // A client that goes away early must not take the server with it, its writes just fail
+   signal(SIGPIPE, SIG_IGN);
+
+   int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+   if (listener == -1)
+   {
+      report("Error: Could not create socket: %s\n", strerror(errno));
+      return -1;
+   }
+
+   // Replace the socket left behind by an earlier server, but nothing else
+   struct stat st;
+   if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+      unlink(path);
+
+   if (bind(listener, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(listener, SOMAXCONN) == -1)
+   {
+      report("Error: Could not listen on %s: %s\n", path, strerror(errno));
+      close(listener);
+      return -1;
+   }
+
+   static Server server;
+   server.passes = passes;
+   server.native = native;
+   server.useCache = use_cache;
+   server.overflow = overflow;
+
+   pthread_attr_t attr;
+   pthread_attr_init(&attr);
+   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+   while (1)
+   {
+      int fd = accept(listener, NULL, NULL);
+      if (fd == -1)
+      {
+         if (errno == EINTR || errno == ECONNABORTED)
+            continue;
+
+         // Out of file descriptors, wait for running requests to close theirs
+         if (errno == EMFILE || errno == ENFILE)
+         {
+            usleep(10000);
+            continue;
+         }
+
+         report("Error: Could not accept a connection: %s\n", strerror(errno));
+         break;
+      }
+
+      Connection *connection = malloc(sizeof(Connection));
+      if (connection == NULL)
+      {
+         close(fd);
+         continue;
+      }
+      connection->server = &server;
+      connection->fd = fd;
+
+      // Serve the connection on this thread when no thread can be started for it
+      pthread_t thread;
+      if (pthread_create(&thread, &attr, serve_connection, connection) != 0)
+         serve_connection(connection);
+   }
+
+   pthread_attr_destroy(&attr);
+   close(listener);
+   return -1;
+}
+
+# pragma endregion
@@ -0,0 +1,237 @@
+/* Snapshots of running programs
+        -the execution state of a runtime is written to a small binary snapshot, its status, where it stopped and
+         every variable with its set flag, the constant slots are part of the program and are left out
+        -a snapshot is restored into the same program compiled again, in this process or another, on this machine
+         or another, and a4_run carries on from where the snapshot was taken
+        -snapshots carry a hash of the compiled program and are only restored into a program with the same hash,
+         which covers the width of the values, so a snapshot only moves between interpreters built alike
+*/
+
+#include "a4.h"
+
+# pragma region Snapshot Functions
+
+#define SNAPSHOT_MAGIC "A4SN"
+
+// Bumped whenever anything written to a snapshot changes meaning
+#define SNAPSHOT_VERSION 2
+
+// Magic, version, program hash, status, next, pc and the number of variables, in that order
+#define SNAPSHOT_HEADER_SIZE 32
+
+// Every number in a snapshot is little endian, whatever the machine
+static void put_u32(unsigned char *data, uint32_t value)
+{
+   for (int i = 0; i < 4; i++)
+   {
+      data[i] = (unsigned char)(value >> (i * 8));
+   }
+}
+
+static void put_u64(unsigned char *data, uint64_t value)
+{
+   for (int i = 0; i < 8; i++)
+   {
+      data[i] = (unsigned char)(value >> (i * 8));
+   }
+}
+
+static uint32_t get_u32(const unsigned char *data)
+{
+   uint32_t value = 0;
+   for (int i = 0; i < 4; i++)
+   {
+      value |= (uint32_t)data[i] << (i * 8);
+   }
+   return value;
+}
+
+static uint64_t get_u64(const unsigned char *data)
+{
+   uint64_t value = 0;
+   for (int i = 0; i < 8; i++)
+   {
+      value |= (uint64_t)data[i] << (i * 8);
+   }
+   return value;
+}
+
+// Carry the FNV-1a hash of hash_bytes on over the little endian bytes of value
+static uint64_t hash_value(uint64_t hash, long long value)
+{
+   for (int i = 0; i < 8; i++)
+   {
+      hash ^= (unsigned char)((unsigned long long)value >> (i * 8));
+      hash *= 1099511628211ull;
+   }
+   return hash;
+}
+
+static uint64_t hash_instruction(uint64_t hash, Instruction *ins)
+{
+   hash = hash_value(hash, ins->opcode);
+   hash = hash_value(hash, ins->a);
+   hash = hash_value(hash, ins->b);
+   hash = hash_value(hash, ins->target);
+   hash = hash_value(hash, ins->line_number);
+   hash = hash_value(hash, ins->str.len);
+   for (int i = 0; i < ins->str.len; i++)
+   {
+      hash = hash_value(hash, (unsigned char)ins->str.str[i]);
+   }
+   return hash;
+}
+
+// Hash of everything about a compiled program that the meaning of its execution state depends on
+// The same source compiled with the same passes hashes the same, whether it was built or loaded from the cache
+uint64_t hash_program(Runtime *runtime)
+{
+   uint64_t hash = hash_bytes(SNAPSHOT_MAGIC, 4);
+   hash = hash_value(hash, sizeof(Value));
+   hash = hash_value(hash, runtime->programLen);
+   hash = hash_value(hash, runtime->entry);
+   hash = hash_value(hash, runtime->intNamesLen);
+   hash = hash_value(hash, runtime->intValuesLen);
+
+   for (int i = 0; i < runtime->programLen; i++)
+   {
+      Instruction *ins = &runtime->program[i];
+      hash = hash_instruction(hash, ins);
+
+      if (ins->opcode != OP_LOOP)
+         continue;
+
+      Loop *loop = &runtime->loops[ins->b];
+      hash = hash_instruction(hash, &loop->head);
+      hash = hash_value(hash, loop->counter);
+      hash = hash_value(hash, loop->limit);
+      hash = hash_value(hash, loop->compare);
+      hash = hash_value(hash, loop->exit);
+      for (int s = 0; s < loop->len; s++)
+      {
+         hash = hash_value(hash, loop->slots[s]);
+         hash = hash_value(hash, loop->deltas[s]);
+         hash = hash_value(hash, loop->lows[s]);
+         hash = hash_value(hash, loop->highs[s]);
+      }
+   }
+
+   // Constant slots are part of the program, not of its state
+   for (int v = runtime->intNamesLen; v < runtime->intValuesLen; v++)
+   {
+      hash = hash_value(hash, runtime->intValues[v]);
+   }
+
+   return hash;
+}
+
+// Write the execution state of a runtime to a snapshot allocated with malloc, to be freed by the caller
+// Take it between calls to a4_run, a runtime that has not run yet gives a snapshot of its starting state
+// Returns -1 when memory runs out
+int a4_snapshot(Runtime *runtime, char **data, size_t *len)
+{
+   if (runtime == NULL || runtime->program == NULL || data == NULL || len == NULL)
+   {
+      return -1;
+   }
+
+   int values = runtime->intNamesLen;
+   int words = BITSET_WORDS(values);
+   size_t size = SNAPSHOT_HEADER_SIZE + (size_t)values * sizeof(Value) + (size_t)words * 8;
+
+   unsigned char *snapshot = malloc(size);
+   if (snapshot == NULL)
+   {
+      report("Error: Could not allocate memory for the snapshot\n");
+      return -1;
+   }
+
+   memcpy(snapshot, SNAPSHOT_MAGIC, 4);
+   put_u32(snapshot + 4, SNAPSHOT_VERSION);
+   put_u64(snapshot + 8, hash_program(runtime));
+   put_u32(snapshot + 16, (uint32_t)runtime->status);
+   put_u32(snapshot + 20, (uint32_t)runtime->next);
+   put_u32(snapshot + 24, (uint32_t)runtime->pc);
+   put_u32(snapshot + 28, (uint32_t)values);
+
+   unsigned char *at = snapshot + SNAPSHOT_HEADER_SIZE;
+   for (int v = 0; v < values; v++, at += sizeof(Value))
+   {
+      if (sizeof(Value) == 8)
+         put_u64(at, (uint64_t)runtime->intValues[v]);
+      else
+         put_u32(at, (uint32_t)runtime->intValues[v]);
+   }
+
+   // Set flags are packed 8 to a byte, padded out to whole words
+   memset(at, 0, (size_t)words * 8);
+   for (int v = 0; v < values; v++)
+   {
+      if (TEST_BIT(runtime->intValuesSet, v))
+         at[v >> 3] |= 1 << (v & 7);
+   }
+
+   *data = (char *)snapshot;
+   *len = size;
+   return 1;
+}
+
+// Restore a snapshot taken by a4_snapshot into a runtime compiled from the same source with the same passes
+// The runtime is left as it was when the snapshot is not one or was taken of a different program
+// Returns -1 then, after reporting why
+int a4_restore(Runtime *runtime, const char *data, size_t len)
+{
+   if (runtime == NULL || runtime->program == NULL || data == NULL)
+   {
+      return -1;
+   }
+
+   const unsigned char *snapshot = (const unsigned char *)data;
+   if (len < SNAPSHOT_HEADER_SIZE || memcmp(snapshot, SNAPSHOT_MAGIC, 4) != 0 || get_u32(snapshot + 4) != SNAPSHOT_VERSION)
+   {
+      report("Error: Not a snapshot\n");
+      return -1;
+   }
+
+   if (get_u64(snapshot + 8) != hash_program(runtime))
+   {
+      report("Error: Snapshot was taken of a different program\n");
+      return -1;
+   }
+
+   int status = (int)get_u32(snapshot + 16);
+   int next = (int)get_u32(snapshot + 20);
+   int pc = (int)get_u32(snapshot + 24);
+   int values = (int)get_u32(snapshot + 28);
+   int words = BITSET_WORDS(values);
+
+   // The hash covers the number of variables, so a matching snapshot only has to be the right size
+   if (values != runtime->intNamesLen || len != SNAPSHOT_HEADER_SIZE + (size_t)values * sizeof(Value) + (size_t)words * 8 ||
+       status < A4_READY || status > A4_DEADLINE || next < 0 || next >= runtime->programLen)
+   {
+      report("Error: Snapshot is damaged\n");
+      return -1;
+   }
+
+   const unsigned char *at = snapshot + SNAPSHOT_HEADER_SIZE;
+   for (int v = 0; v < values; v++, at += sizeof(Value))
+   {
+      runtime->intValues[v] = sizeof(Value) == 8 ? (Value)get_u64(at) : (Value)(int32_t)get_u32(at);
+   }
+
+   // Set flags bit by bit, the constant slots after the variables share the last word and stay set
+   for (int v = 0; v < values; v++)
+   {
+      if ((at[v >> 3] >> (v & 7)) & 1)
+         SET_BIT(runtime->intValuesSet, v);
+      else
+         CLEAR_BIT(runtime->intValuesSet, v);
+   }
+
+   runtime->status = status;
+   runtime->next = next;
+   runtime->pc = pc;
+   return 1;
+}
+
+# pragma endregion
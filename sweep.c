@@ -0,0 +1,720 @@
+/* Parameter sweeps, one program run once for every value of a variable
+        -the runs go in lockstep, SWEEP_LANES at a time, with every variable held as a vector of one value per run
+         so that arithmetic and comparisons work on all of them at once, assuming GCC or Clang vector extensions
+        -runs that are at the same instruction form a group that executes it together under a mask, an if that
+         splits a group parks the runs going the other way until the group reaches their instruction again, the
+         group is always the runs at the lowest instruction
+        -the swept variable takes its value from the sweep at its first set in the file instead of from the number
+         there, everything else runs as it would without the sweep
+        -output is kept per run and written out in sweep order, the same as running the program once per value,
+         compressed per run when the output is, see pack.c
+*/
+
+#include "a4.h"
+
+# pragma region Sweep Functions
+
+// One value or mask per run, the unsigned form is for arithmetic that wraps
+typedef Value Lanes __attribute__((vector_size(SWEEP_LANES * sizeof(Value))));
+typedef UnsignedValue UnsignedLanes __attribute__((vector_size(SWEEP_LANES * sizeof(Value))));
+
+// Words a vector is reduced in when looking at all of its lanes at once
+#define LANE_WORDS (sizeof(Lanes) / sizeof(uint64_t))
+
+// The lockstep loop is built a second time for AVX2 where GCC or Clang can pick between the two when the program
+// starts, otherwise vectors wider than the instruction set built for are split in halves
+#if defined(__x86_64__) && (defined(__clang__) || __GNUC__ >= 6)
+#define SWEEP_TARGETS __attribute__((target_clones("avx2", "default")))
+#else
+#define SWEEP_TARGETS
+#endif
+
+// Runs in lockstep, the group being the runs at instruction idx whose lanes are set in mask
+typedef struct
+{
+   Runtime *runtime;
+
+   // Two vectors per slot of the runtime, its values and a mask of the runs where it is set
+   Lanes *values;
+   Lanes *set;
+
+   // Slots set in every run, which need no set checks
+   uint64_t *complete;
+
+   // Value of the swept variable for every run, and the instruction of the set that takes it
+   Lanes sweep;
+   int sweepIndex;
+
+   // Instruction every run outside the group is parked at, -1 once it has finished
+   int pcs[SWEEP_LANES];
+
+   int idx;
+   Lanes mask;
+
+   // Lowest instruction a parked run is at, INT_MAX when none is
+   int resume;
+
+   // Run 0 writes straight to the runtime's output, the others collect theirs until the runs before them finish
+   Output *outputs[SWEEP_LANES];
+} Sweep;
+
+// Vectors are passed to functions by pointer, passing them by value depends on the instruction set built for
+
+// Whether any lane of a mask is set, a word at a time
+static inline int any_lane(const Lanes *mask)
+{
+   uint64_t words[LANE_WORDS];
+   memcpy(words, mask, sizeof(Lanes));
+   uint64_t any = 0;
+   for (size_t w = 0; w < LANE_WORDS; w++)
+   {
+      any |= words[w];
+   }
+   return any != 0;
+}
+
+// Whether every lane of a mask is set
+static inline int all_lanes(const Lanes *mask)
+{
+   uint64_t words[LANE_WORDS];
+   memcpy(words, mask, sizeof(Lanes));
+   uint64_t all = ~(uint64_t)0;
+   for (size_t w = 0; w < LANE_WORDS; w++)
+   {
+      all &= words[w];
+   }
+   return all == ~(uint64_t)0;
+}
+
+// Lanes of a where mask is set and of b elsewhere
+#define SELECT_LANES(mask, a, b) (((a) & (mask)) | ((b) & ~(mask)))
+
+// Mark a slot set in the runs of mask, and as needing no more checks once it is set in all of them
+static inline void set_lanes(Sweep *sweep, int slot, const Lanes *mask)
+{
+   sweep->set[slot] |= *mask;
+   if (all_lanes(&sweep->set[slot]))
+      SET_BIT(sweep->complete, slot);
+}
+
+// Report an error for one run, which then stops
+static void fail_lane(Sweep *sweep, int lane, const char *format, ...)
+{
+   char message[256];
+   va_list args;
+   va_start(args, format);
+   int n = vsnprintf(message, sizeof(message), format, args);
+   va_end(args);
+
+   if (n > (int)sizeof(message) - 1)
+      n = sizeof(message) - 1;
+   if (n > 0)
+      output_write(sweep->outputs[lane], message, n);
+
+   sweep->mask[lane] = 0;
+   sweep->pcs[lane] = -1;
+}
+
+// Report an unset slot for every run of the group where it is not set, returns 0 when no run is left in the group
+static int require_set(Sweep *sweep, int slot, const char *message)
+{
+   Lanes unset = sweep->mask & ~sweep->set[slot];
+   if (!any_lane(&unset))
+      return 1;
+
+   Instruction *ins = &sweep->runtime->program[sweep->idx];
+   Token name = sweep->runtime->intNames[slot];
+   for (int l = 0; l < SWEEP_LANES; l++)
+   {
+      if (unset[l])
+         fail_lane(sweep, l, message, ins->line_number, name.len, name.str);
+   }
+
+   return any_lane(&sweep->mask);
+}
+
+// Move the runs in lanes to instruction pc to wait for the group there, the caller takes them out of the group
+static void park_lanes(Sweep *sweep, const Lanes *lanes, int pc)
+{
+   for (int l = 0; l < SWEEP_LANES; l++)
+   {
+      if ((*lanes)[l])
+         sweep->pcs[l] = pc;
+   }
+
+   if (pc < sweep->resume)
+      sweep->resume = pc;
+}
+
+// Make the runs at the lowest instruction the group, returns 0 once every run has finished
+static int regroup(Sweep *sweep)
+{
+   for (int l = 0; l < SWEEP_LANES; l++)
+   {
+      if (sweep->mask[l])
+         sweep->pcs[l] = sweep->idx;
+   }
+
+   int lowest = INT_MAX;
+   for (int l = 0; l < SWEEP_LANES; l++)
+   {
+      if (sweep->pcs[l] >= 0 && sweep->pcs[l] < lowest)
+         lowest = sweep->pcs[l];
+   }
+
+   sweep->resume = INT_MAX;
+   for (int l = 0; l < SWEEP_LANES; l++)
+   {
+      int pc = sweep->pcs[l];
+      sweep->mask[l] = pc == lowest ? -1 : 0;
+      if (pc > lowest && pc < sweep->resume)
+         sweep->resume = pc;
+   }
+
+   sweep->idx = lowest;
+   return lowest != INT_MAX;
+}
+
+// Arithmetic for one run under the overflow policy as the interpreter does it, returns 0 when the run stopped
+static int lane_arithmetic(Sweep *sweep, int lane, Instruction *ins, int opcode, Value operand)
+{
+   Runtime *runtime = sweep->runtime;
+   Value *target = &sweep->values[ins->a][lane];
+   Value result;
+   int overflowed;
+   Value saturated;
+
+   switch (opcode)
+   {
+      case OP_ADD:
+         overflowed = __builtin_add_overflow(*target, operand, &result);
+         saturated = operand > 0 ? VALUE_MAX : VALUE_MIN;
+         break;
+      case OP_SUB:
+         overflowed = __builtin_sub_overflow(*target, operand, &result);
+         saturated = operand > 0 ? VALUE_MIN : VALUE_MAX;
+         break;
+      case OP_MULT:
+         overflowed = __builtin_mul_overflow(*target, operand, &result);
+         saturated = (*target < 0) != (operand < 0) ? VALUE_MIN : VALUE_MAX;
+         break;
+      default:
+         if (operand == 0)
+         {
+            fail_lane(sweep, lane, "Error at line %d: Division by zero\n", ins->line_number);
+            return 0;
+         }
+         overflowed = operand == -1 && *target == VALUE_MIN;
+         result = overflowed ? VALUE_MIN : *target / operand;
+         saturated = VALUE_MAX;
+         break;
+   }
+
+   if (overflowed && runtime->overflow == OVERFLOW_TRAP)
+   {
+      Token name = runtime->intNames[ins->a];
+      fail_lane(sweep, lane, "Error at line %d: Variable %.*s overflowed\n", ins->line_number, name.len, name.str);
+      return 0;
+   }
+
+   *target = overflowed && runtime->overflow == OVERFLOW_SATURATE ? saturated : result;
+   return 1;
+}
+
+// Arithmetic that does not wrap, or divides, one run of the group at a time
+// Returns 0 when no run is left in the group
+static int checked_arithmetic(Sweep *sweep, Instruction *ins, int opcode, const Lanes *operand)
+{
+   for (int l = 0; l < SWEEP_LANES; l++)
+   {
+      if (sweep->mask[l])
+         lane_arithmetic(sweep, l, ins, opcode, (*operand)[l]);
+   }
+   return any_lane(&sweep->mask);
+}
+
+// Report the runs of the group at a halt or trap and take them out of it, for good
+static void finish_lanes(Sweep *sweep, Instruction *ins)
+{
+   for (int l = 0; l < SWEEP_LANES; l++)
+   {
+      if (!sweep->mask[l])
+         continue;
+      if (ins->opcode != OP_TRAP)
+         sweep->pcs[l] = -1;
+      else if (ins->a == TRAP_INVALID_LINE)
+         fail_lane(sweep, l, "Error at line %d: Invalid line number %d\n", ins->line_number, ins->b);
+      else
+         fail_lane(sweep, l, "Error: Command at line %d not found\n", ins->b);
+   }
+   sweep->mask = (Lanes){0};
+}
+
+// Run the group, and every run parked along the way, until all runs have finished
+// The instruction and mask of the group live in locals, and are written back to the sweep around anything that
+// works on it, which is everything that is not a whole group going through a step that can not fail
+SWEEP_TARGETS
+static void run_lanes(Sweep *sweep)
+{
+   Runtime *runtime = sweep->runtime;
+   Instruction *program = runtime->program;
+   Lanes *values = sweep->values;
+   uint64_t *complete = sweep->complete;
+   int wrap = runtime->overflow == OVERFLOW_WRAP;
+   int sweepIndex = sweep->sweepIndex;
+
+   int idx = sweep->idx;
+   Lanes mask = sweep->mask;
+   Instruction *ins;
+
+   // A switch rather than threaded dispatch, as functions taking the addresses of labels can not be cloned and
+   // the AVX2 clone is worth far more
+   #define DISPATCH() goto dispatch
+
+   #define SAVE() (sweep->idx = idx, sweep->mask = mask)
+   #define LOAD() (idx = sweep->idx, mask = sweep->mask)
+
+   // Move on to the lowest runs once the group is empty or has caught up with parked ones, or stop
+   #define REGROUP() \
+      do { \
+         SAVE(); \
+         if (!regroup(sweep)) \
+            return; \
+         LOAD(); \
+         DISPATCH(); \
+      } while (0)
+
+   // Parked runs join the group once it reaches them
+   #define NEXT() \
+      do { \
+         if (idx >= sweep->resume) \
+            REGROUP(); \
+         DISPATCH(); \
+      } while (0)
+
+   // Set checks are left out of proven instructions, and only look at the runs once a slot is not set in all of
+   // them, the failing runs leave the group
+   #define REQUIRE(slot, message) \
+      do { \
+         if (!ins->proven && !TEST_BIT(complete, (slot))) \
+         { \
+            SAVE(); \
+            int left = require_set(sweep, (slot), (message)); \
+            LOAD(); \
+            if (!left) \
+               REGROUP(); \
+         } \
+      } while (0)
+
+   // Add, sub and mult wrap on whole vectors, the lanes outside the group adding 0 or keeping their value
+   #define ARITHMETIC(opcode, operand) \
+      do { \
+         if (wrap && (opcode) != OP_DIV) \
+         { \
+            UnsignedLanes x = (UnsignedLanes)values[ins->a]; \
+            UnsignedLanes y = (UnsignedLanes)((operand) & mask); \
+            if ((opcode) == OP_ADD) \
+               values[ins->a] = (Lanes)(x + y); \
+            else if ((opcode) == OP_SUB) \
+               values[ins->a] = (Lanes)(x - y); \
+            else \
+               values[ins->a] = SELECT_LANES(mask, (Lanes)(x * y), values[ins->a]); \
+         } \
+         else \
+         { \
+            Lanes by = (operand); \
+            SAVE(); \
+            int left = checked_arithmetic(sweep, ins, (opcode), &by); \
+            LOAD(); \
+            if (!left) \
+               REGROUP(); \
+         } \
+      } while (0)
+
+   // Go to target with the runs where holds and to other with the rest, which wait there when both are taken
+   #define BRANCH(holds, target, other) \
+      do { \
+         Lanes taken = (holds) & mask; \
+         Lanes rest = mask & ~taken; \
+         if (!any_lane(&taken)) \
+         { \
+            idx = (other); \
+         } \
+         else \
+         { \
+            if (any_lane(&rest)) \
+            { \
+               park_lanes(sweep, &rest, (other)); \
+               mask = taken; \
+            } \
+            idx = (target); \
+         } \
+         NEXT(); \
+      } while (0)
+
+   #define ARITHMETIC_HANDLERS(opcode) \
+      case opcode: \
+      { \
+         REQUIRE(ins->a, "Error at line %d: Variable %.*s is not set\n"); \
+         ARITHMETIC(opcode, (Lanes){0} + (Value)ins->b); \
+         idx++; \
+         NEXT(); \
+      } \
+      case opcode + OP_VAR_OFFSET: \
+      { \
+         REQUIRE(ins->a, "Error at line %d: Variable %.*s is not set\n"); \
+         REQUIRE(ins->b, "Error at line %d: Variable %.*s is not set\n"); \
+         ARITHMETIC(opcode, values[ins->b]); \
+         idx++; \
+         NEXT(); \
+      }
+
+   #define IF_HANDLER(op, compare) \
+      case op: \
+      { \
+         REQUIRE(ins->a, "Error at line %d: %.*s is not defined\n"); \
+         REQUIRE(ins->b, "Error at line %d: %.*s is not defined\n"); \
+         BRANCH(values[ins->a] compare values[ins->b], idx + 1, ins->target); \
+      }
+
+   #define BRANCH_HANDLER(op, compare) \
+      case op: \
+      { \
+         REQUIRE(ins->a, "Error at line %d: %.*s is not defined\n"); \
+         REQUIRE(ins->b, "Error at line %d: %.*s is not defined\n"); \
+         BRANCH(values[ins->a] compare values[ins->b], ins->target, idx + 2); \
+      }
+
+   // Runs where an operand of the if is not set run it on its own so the error comes from its line
+   #define ADD_BRANCH_HANDLER(op, compare) \
+      case op: \
+      { \
+         REQUIRE(ins->a, "Error at line %d: Variable %.*s is not set\n"); \
+         ARITHMETIC(OP_ADD, (Lanes){0} + (Value)ins->b); \
+         Instruction *next = &program[idx + 1]; \
+         if (!ins->proven && !(TEST_BIT(complete, next->a) && TEST_BIT(complete, next->b))) \
+         { \
+            Lanes unset = mask & ~(sweep->set[next->a] & sweep->set[next->b]); \
+            if (any_lane(&unset)) \
+            { \
+               park_lanes(sweep, &unset, idx + 1); \
+               mask &= ~unset; \
+            } \
+            if (!any_lane(&mask)) \
+               REGROUP(); \
+         } \
+         BRANCH(values[next->a] compare values[next->b], ins->target, idx + 3); \
+      }
+
+   for (;;)
+   {
+   dispatch:
+      ins = &program[idx];
+      switch (ins->opcode)
+      {
+      case OP_NOP:
+      {
+         idx++;
+         NEXT();
+      }
+      case OP_SET:
+      {
+         Lanes value = idx == sweepIndex ? sweep->sweep : (Lanes){0} + (Value)ins->b;
+         values[ins->a] = SELECT_LANES(mask, value, values[ins->a]);
+         set_lanes(sweep, ins->a, &mask);
+         idx++;
+         NEXT();
+      }
+      case OP_SET_VAR:
+      {
+         REQUIRE(ins->b, "Error at line %d: Variable %.*s is not set\n");
+         values[ins->a] = SELECT_LANES(mask, values[ins->b], values[ins->a]);
+         set_lanes(sweep, ins->a, &mask);
+         idx++;
+         NEXT();
+      }
+
+      ARITHMETIC_HANDLERS(OP_ADD)
+      ARITHMETIC_HANDLERS(OP_SUB)
+      ARITHMETIC_HANDLERS(OP_MULT)
+      ARITHMETIC_HANDLERS(OP_DIV)
+
+      case OP_PRINT:
+      {
+         REQUIRE(ins->a, "Error at line %d: Variable %.*s is not set\n");
+         REQUIRE(ins->b, "Error at line %d: Variable %.*s is not set\n");
+         for (int l = 0; l < SWEEP_LANES; l++)
+         {
+            if (mask[l])
+               output_print(sweep->outputs[l], values[ins->a][l], values[ins->b][l], ins->str.str, ins->str.len);
+         }
+         idx++;
+         NEXT();
+      }
+      case OP_GOTO:
+      {
+         idx = ins->target;
+         NEXT();
+      }
+
+      IF_HANDLER(OP_IF_EQ, ==)
+      IF_HANDLER(OP_IF_NE, !=)
+      IF_HANDLER(OP_IF_GT, >)
+      IF_HANDLER(OP_IF_GTE, >=)
+      IF_HANDLER(OP_IF_LT, <)
+      IF_HANDLER(OP_IF_LTE, <=)
+
+      BRANCH_HANDLER(OP_BRANCH_EQ, ==)
+      BRANCH_HANDLER(OP_BRANCH_NE, !=)
+      BRANCH_HANDLER(OP_BRANCH_GT, >)
+      BRANCH_HANDLER(OP_BRANCH_GTE, >=)
+      BRANCH_HANDLER(OP_BRANCH_LT, <)
+      BRANCH_HANDLER(OP_BRANCH_LTE, <=)
+
+      ADD_BRANCH_HANDLER(OP_ADD_BRANCH_EQ, ==)
+      ADD_BRANCH_HANDLER(OP_ADD_BRANCH_NE, !=)
+      ADD_BRANCH_HANDLER(OP_ADD_BRANCH_GT, >)
+      ADD_BRANCH_HANDLER(OP_ADD_BRANCH_GTE, >=)
+      ADD_BRANCH_HANDLER(OP_ADD_BRANCH_LT, <)
+      ADD_BRANCH_HANDLER(OP_ADD_BRANCH_LTE, <=)
+
+      // Halts, traps, and loops, which sweeps are never compiled with
+      case OP_HALT:
+      case OP_TRAP:
+      case OP_LOOP:
+      {
+         SAVE();
+         finish_lanes(sweep, ins);
+         LOAD();
+         REGROUP();
+      }
+      }
+   }
+
+   #undef DISPATCH
+   #undef SAVE
+   #undef LOAD
+   #undef REGROUP
+   #undef NEXT
+   #undef REQUIRE
+   #undef ARITHMETIC
+   #undef BRANCH
+   #undef ARITHMETIC_HANDLERS
+   #undef IF_HANDLER
+   #undef BRANCH_HANDLER
+   #undef ADD_BRANCH_HANDLER
+}
+
+// Instruction of the first set of a constant to the variable named name, the one the sweep replaces
+// Returns -1 when there is no such variable or set
+static int sweep_set(Runtime *runtime, const char *name)
+{
+   int slot = -1;
+   for (int v = 0; v < runtime->intNamesLen; v++)
+   {
+      if (token_equals(runtime->intNames[v], name))
+      {
+         slot = v;
+         break;
+      }
+   }
+
+   if (slot == -1)
+   {
+      report("Error: Variable %s is not defined\n", name);
+      return -1;
+   }
+
+   for (int i = 0; i < runtime->programLen; i++)
+   {
+      if (runtime->program[i].opcode == OP_SET && runtime->program[i].a == slot)
+         return i;
+   }
+
+   report("Error: Variable %s is never set to a number\n", name);
+   return -1;
+}
+
+// Split a sweep of the form <variable>=<values> into the variable's name and its values, a list of numbers and
+// ranges of numbers separated by commas, such as a=1,5..10,20; the name and values are allocated with malloc
+// Returns -1 after reporting an error when the sweep can not be read
+int parse_sweep(const char *spec, char **name, Value **values, int *count)
+{
+   const char *equals = strchr(spec, '=');
+   if (equals == NULL || equals == spec)
+   {
+      report("Error: A sweep is written <variable>=<values>\n");
+      return -1;
+   }
+
+   *name = strndup(spec, equals - spec);
+   *values = NULL;
+   *count = 0;
+   int capacity = 0;
+
+   const char *at = equals + 1;
+   while (*name != NULL)
+   {
+      char *end;
+      errno = 0;
+      long long from = strtoll(at, &end, 10);
+      long long to = from;
+      int valid = end != at && errno == 0;
+      if (valid && strncmp(end, "..", 2) == 0)
+      {
+         at = end + 2;
+         to = strtoll(at, &end, 10);
+         valid = end != at && errno == 0 && to >= from;
+      }
+
+      // Numbers in a sweep are as wide as the numbers in the source
+      valid = valid && (*end == ',' || *end == '\0') && from >= INT_MIN && to <= INT_MAX;
+      if (!valid || to - from >= MAX_SWEEP_VALUES - *count)
+      {
+         report(valid ? "Error: A sweep can have at most %d values\n" : "Error: Invalid sweep values %s\n",
+                valid ? MAX_SWEEP_VALUES : 0, equals + 1);
+         break;
+      }
+
+      int needed = *count + (int)(to - from + 1);
+      if (needed > capacity)
+      {
+         int grown = capacity > 0 ? capacity : 64;
+         while (grown < needed)
+            grown *= 2;
+         Value *grow = realloc(*values, sizeof(Value) * grown);
+         if (grow == NULL)
+         {
+            report("Error: Could not allocate memory for the sweep\n");
+            break;
+         }
+         *values = grow;
+         capacity = grown;
+      }
+
+      for (long long v = from; v <= to; v++)
+      {
+         (*values)[(*count)++] = (Value)v;
+      }
+
+      if (*end == '\0')
+         return 1;
+      at = end + 1;
+   }
+
+   if (*name == NULL)
+      report("Error: Could not allocate memory for the sweep\n");
+   free(*name);
+   free(*values);
+   *name = NULL;
+   *values = NULL;
+   *count = 0;
+   return -1;
+}
+
+// Run the program of a runtime once for every one of count values of the variable named name, in groups of
+// SWEEP_LANES runs in lockstep, writing the output of every run to the runtime's output in order
+// The program has to be compiled without constant propagation and loops, which would bake in the value
+// Returns -1 when the sweep can not be run
+int run_sweep(Runtime *runtime, const char *name, const Value *sweepValues, int count)
+{
+   if (runtime == NULL || runtime->program == NULL || runtime->output == NULL)
+   {
+      return -1;
+   }
+
+   Sweep sweep;
+   sweep.runtime = runtime;
+   sweep.sweepIndex = sweep_set(runtime, name);
+   if (sweep.sweepIndex == -1)
+      return -1;
+
+   int slots = runtime->intValuesLen > 0 ? runtime->intValuesLen : 1;
+   sweep.values = aligned_alloc(sizeof(Lanes), sizeof(Lanes) * slots);
+   sweep.set = aligned_alloc(sizeof(Lanes), sizeof(Lanes) * slots);
+   sweep.complete = malloc(sizeof(uint64_t) * BITSET_WORDS(slots));
+
+   // Runs after the first collect their output in memory
+   int failed = sweep.values == NULL || sweep.set == NULL || sweep.complete == NULL;
+   sweep.outputs[0] = runtime->output;
+   for (int l = 1; l < SWEEP_LANES; l++)
+   {
+      sweep.outputs[l] = malloc(sizeof(Output));
+      if (sweep.outputs[l] == NULL)
+      {
+         failed = 1;
+         continue;
+      }
+
+      init_output(sweep.outputs[l], -1);
+      if (runtime->output->pack != NULL && pack_output(sweep.outputs[l], 0) == -1)
+         failed = 1;
+   }
+
+   for (int first = 0; first < count && !failed; first += SWEEP_LANES)
+   {
+      // Lanes past the end of the sweep never run, and count as set so that slots can still be set in all runs
+      Lanes unused = (Lanes){0};
+      for (int l = 0; l < SWEEP_LANES; l++)
+      {
+         int live = first + l < count;
+         sweep.sweep[l] = live ? sweepValues[first + l] : 0;
+         sweep.pcs[l] = live ? runtime->entry : -1;
+         unused[l] = live ? 0 : -1;
+      }
+
+      memset(sweep.complete, 0, sizeof(uint64_t) * BITSET_WORDS(slots));
+      for (int s = 0; s < runtime->intValuesLen; s++)
+      {
+         sweep.values[s] = (Lanes){0} + runtime->intValues[s];
+         sweep.set[s] = unused;
+         if (TEST_BIT(runtime->intValuesSet, s))
+         {
+            sweep.set[s] = (Lanes){0} - 1;
+            SET_BIT(sweep.complete, s);
+         }
+      }
+
+      sweep.mask = (Lanes){0};
+      sweep.idx = runtime->entry;
+      if (regroup(&sweep))
+         run_lanes(&sweep);
+
+      // The first run has written its output already, the others follow it in order
+      flush_output(runtime->output);
+      for (int l = 1; l < SWEEP_LANES && first + l < count; l++)
+      {
+         Output *output = sweep.outputs[l];
+         if (output->pack != NULL)
+         {
+            pack_append(runtime->output, output);
+            continue;
+         }
+
+         flush_output(output);
+         if (output->memoryLen > 0)
+            output_write(runtime->output, output->memory, (int)output->memoryLen);
+         output->memoryLen = 0;
+      }
+      flush_output(runtime->output);
+   }
+
+   if (failed)
+      report("Error: Could not allocate memory for the sweep\n");
+
+   for (int l = 1; l < SWEEP_LANES; l++)
+   {
+      if (sweep.outputs[l] != NULL)
+      {
+         free(sweep.outputs[l]->pack);
+         free(sweep.outputs[l]->memory);
+      }
+      free(sweep.outputs[l]);
+   }
+   free(sweep.values);
+   free(sweep.set);
+   free(sweep.complete);
+   return failed ? -1 : 1;
+}
+
+# pragma endregion
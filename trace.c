@@ -0,0 +1,188 @@
+/* Execution traces
+        -every instruction run is recorded as a small binary event in a ring buffer, with the value of the variable
+         it writes before and after
+        -the ring is the trace file itself, mapped shared, so it holds the last events of a run even when the
+         interpreter is killed
+        -the file also names the variables and holds the text of every command, so a4trace can decode it without
+         the program, see a4trace.c
+*/
+
+#include "a4.h"
+
+# pragma region Trace Functions
+
+static size_t trace_round(size_t size)
+{
+   return (size + TRACE_ALIGN - 1) & ~(size_t)(TRACE_ALIGN - 1);
+}
+
+// Variable an instruction writes, -1 for none
+static int written_slot(Runtime *runtime, Instruction *ins)
+{
+   switch (ins->opcode)
+   {
+      case OP_SET:
+      case OP_ADD:
+      case OP_SUB:
+      case OP_MULT:
+      case OP_DIV:
+      case OP_SET_VAR:
+      case OP_ADD_VAR:
+      case OP_SUB_VAR:
+      case OP_MULT_VAR:
+      case OP_DIV_VAR:
+      case OP_ADD_BRANCH_EQ:
+      case OP_ADD_BRANCH_NE:
+      case OP_ADD_BRANCH_GT:
+      case OP_ADD_BRANCH_GTE:
+      case OP_ADD_BRANCH_LT:
+      case OP_ADD_BRANCH_LTE:
+         return ins->a;
+      case OP_LOOP:
+         // Only the variable of the instruction the loop replaced, a loop run in one step changes others too
+         return runtime->loops[ins->b].head.a;
+      default:
+         return -1;
+   }
+}
+
+// Command an instruction was compiled from as text, written to text when it is not NULL, returns its length
+// Instructions past the commands are the halts after the end of the program
+static int command_text(Runtime *runtime, int i, char *text)
+{
+   if (i >= runtime->commandsLen)
+   {
+      const char *halt = "end of program";
+      if (text != NULL)
+         memcpy(text, halt, strlen(halt));
+      return strlen(halt);
+   }
+
+   Command *command = &runtime->commands[i];
+   const char *name = command_type_to_string(command->command_type);
+   int len = strlen(name);
+   if (text != NULL)
+      memcpy(text, name, len);
+
+   for (int a = 0; a < 3 && command->args[a].str != NULL; a++)
+   {
+      if (text != NULL)
+      {
+         text[len] = ' ';
+         memcpy(text + len + 1, command->args[a].str, command->args[a].len);
+      }
+      len += 1 + command->args[a].len;
+   }
+
+   return len;
+}
+
+// Start tracing a compiled runtime to filename, keeping the last events events, rounded up to a power of two
+// The runtime needs its commands, so it can not be one loaded from the cache
+// Returns -1 when the file can not be set up
+int enable_trace(Runtime *runtime, const char *filename, long long events)
+{
+   if (runtime == NULL || runtime->program == NULL || runtime->commands == NULL)
+   {
+      return -1;
+   }
+
+   uint64_t capacity = 1;
+   while (capacity < (uint64_t)(events > 0 ? events : TRACE_EVENTS))
+      capacity *= 2;
+
+   int n = runtime->programLen;
+   Trace *trace = arena_alloc(&runtime->arena, sizeof(Trace));
+   int *writes = arena_alloc(&runtime->arena, sizeof(int) * n);
+   if (trace == NULL || writes == NULL)
+   {
+      report("Error: Could not allocate memory for the trace\n");
+      return -1;
+   }
+
+   size_t size = trace_round(sizeof(TraceHeader));
+   for (int v = 0; v < runtime->intNamesLen; v++)
+   {
+      size += sizeof(uint32_t) + runtime->intNames[v].len;
+   }
+   for (int i = 0; i < n; i++)
+   {
+      writes[i] = written_slot(runtime, &runtime->program[i]);
+      size += sizeof(TraceLine) + command_text(runtime, i, NULL);
+   }
+
+   size_t offset = trace_round(size);
+   size = offset + capacity * sizeof(TraceEvent);
+
+   int fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+   if (fd == -1)
+   {
+      report("Error: Could not open %s: %s\n", filename, strerror(errno));
+      return -1;
+   }
+
+   // The ring is left sparse until it is written
+   char *data = MAP_FAILED;
+   if (ftruncate(fd, size) == 0)
+      data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+   close(fd);
+   if (data == MAP_FAILED)
+   {
+      report("Error: Could not map %s: %s\n", filename, strerror(errno));
+      return -1;
+   }
+
+   TraceHeader *header = (TraceHeader *)data;
+   memcpy(header->magic, TRACE_MAGIC, 4);
+   header->version = TRACE_VERSION;
+   header->eventSize = sizeof(TraceEvent);
+   header->programLen = n;
+   header->intNamesLen = runtime->intNamesLen;
+   header->unused = 0;
+   header->events = offset;
+   header->capacity = capacity;
+   header->count = 0;
+
+   char *at = data + trace_round(sizeof(TraceHeader));
+   for (int v = 0; v < runtime->intNamesLen; v++)
+   {
+      Token name = runtime->intNames[v];
+      uint32_t len = name.len;
+      memcpy(at, &len, sizeof(len));
+      memcpy(at + sizeof(len), name.str, len);
+      at += sizeof(len) + len;
+   }
+
+   for (int i = 0; i < n; i++)
+   {
+      TraceLine line;
+      line.line = runtime->program[i].line_number;
+      line.commandType = i < runtime->commandsLen ? runtime->commands[i].command_type : END;
+      line.slot = writes[i];
+      line.textLen = command_text(runtime, i, at + sizeof(line));
+      memcpy(at, &line, sizeof(line));
+      at += sizeof(line) + line.textLen;
+   }
+
+   trace->header = header;
+   trace->events = (TraceEvent *)(data + offset);
+   trace->mask = capacity - 1;
+   trace->size = size;
+   trace->writes = writes;
+   runtime->trace = trace;
+   return 1;
+}
+
+// Unmap the trace file of a runtime, which then holds everything recorded
+void free_trace(Runtime *runtime)
+{
+   if (runtime == NULL || runtime->trace == NULL)
+   {
+      return;
+   }
+
+   munmap(runtime->trace->header, runtime->trace->size);
+   runtime->trace = NULL;
+}
+
+# pragma endregion
@@ -0,0 +1,247 @@
+/* Static verification of compiled programs
+        -proves that every variable an instruction reads is set on every path from the begin line to it, with a
+         forward data flow analysis of the variables that are definitely set before each instruction
+        -jump targets are checked to lie inside the program, compile_runtime has already turned gotos to lines
+         that are out of range or missing into traps
+        -every instruction whose reads are proven is marked, the interpreter, native code and sweeps leave out its
+         set checks and keep them for the instructions where the analysis is inconclusive
+        -a program with every instruction proven runs in a copy of the interpreter loop without any set checks
+*/
+
+#include "a4.h"
+
+# pragma region Verifier Functions
+
+// Largest number of instructions times bitset words the analysis keeps, bigger programs are left unverified
+#define MAX_VERIFY_WORDS (1 << 22)
+
+// Slots instruction i reads and reports an error for when they are not set, returns how many there are
+// The compare operands of a fused add/if/goto are read from the if after it
+static int read_slots(Runtime *runtime, Instruction *ins, int i, int reads[3])
+{
+   int op = ins->opcode;
+
+   if (op == OP_LOOP)
+      return read_slots(runtime, &runtime->loops[ins->b].head, i, reads);
+
+   if (op == OP_SET_VAR)
+   {
+      reads[0] = ins->b;
+      return 1;
+   }
+
+   if (op >= OP_ADD && op <= OP_DIV)
+   {
+      reads[0] = ins->a;
+      return 1;
+   }
+
+   if (op >= OP_ADD_BRANCH_EQ && op <= OP_ADD_BRANCH_LTE)
+   {
+      reads[0] = ins->a;
+      reads[1] = runtime->program[i + 1].a;
+      reads[2] = runtime->program[i + 1].b;
+      return 3;
+   }
+
+   if (op == OP_PRINT || (op >= OP_IF_EQ && op <= OP_IF_LTE) || (op >= OP_BRANCH_EQ && op <= OP_BRANCH_LTE) ||
+       (op >= OP_ADD_VAR && op <= OP_DIV_VAR))
+   {
+      reads[0] = ins->a;
+      reads[1] = ins->b;
+      return 2;
+   }
+
+   return 0;
+}
+
+// Instructions control can go to after instruction i, returns how many there are
+// next has room for 4, the most there are is a loop's exit followed by the 3 of a fused add and branch
+static int successors(Runtime *runtime, Instruction *ins, int i, int *next)
+{
+   int op = ins->opcode;
+
+   if (op == OP_HALT || op == OP_TRAP)
+      return 0;
+
+   if (op == OP_GOTO)
+   {
+      next[0] = ins->target;
+      return 1;
+   }
+
+   // A loop that can not be computed in one step runs the instruction it replaced
+   if (op == OP_LOOP)
+   {
+      Loop *loop = &runtime->loops[ins->b];
+      next[0] = loop->exit;
+      return 1 + successors(runtime, &loop->head, i, next + 1);
+   }
+
+   if (op >= OP_IF_EQ && op <= OP_IF_LTE)
+   {
+      next[0] = i + 1;
+      next[1] = ins->target;
+      return 2;
+   }
+
+   if (op >= OP_BRANCH_EQ && op <= OP_BRANCH_LTE)
+   {
+      next[0] = ins->target;
+      next[1] = i + 2;
+      return 2;
+   }
+
+   // An unset compare operand runs the if on its own
+   if (op >= OP_ADD_BRANCH_EQ && op <= OP_ADD_BRANCH_LTE)
+   {
+      next[0] = ins->target;
+      next[1] = i + 1;
+      next[2] = i + 3;
+      return 3;
+   }
+
+   next[0] = i + 1;
+   return 1;
+}
+
+// Mark every instruction of the compiled program of a runtime whose reads are proven to be set, and set
+// runtime->verified when that is all of them
+// Run once the program is optimized, the analysis is of the instructions execute_runtime runs
+// Returns 1 when the program was verified and 0 when some instructions run with their checks, which is never an error
+int verify_program(Runtime *runtime)
+{
+   if (runtime == NULL || runtime->program == NULL)
+   {
+      return 0;
+   }
+
+   // Nothing is proven until the analysis is done, flags in a cached image are not trusted
+   runtime->verified = 0;
+   for (int i = 0; i < runtime->programLen; i++)
+   {
+      runtime->program[i].proven = 0;
+   }
+   for (int l = 0; l < runtime->loopsLen; l++)
+   {
+      runtime->loops[l].head.proven = 0;
+   }
+
+   int n = runtime->programLen;
+   int vars = runtime->intNamesLen;
+   int words = vars > 0 ? BITSET_WORDS(vars) : 1;
+   if (runtime->entry < 0 || runtime->entry >= n || (long long)n * words > MAX_VERIFY_WORDS)
+   {
+      return 0;
+   }
+
+   // Variables definitely set before each instruction, only for the instructions reached so far
+   uint64_t *in = malloc(sizeof(uint64_t) * words * n);
+   uint64_t *out = malloc(sizeof(uint64_t) * words);
+   char *reached = calloc(n, 1);
+   char *queued = calloc(n, 1);
+   int *stack = malloc(sizeof(int) * n);
+   if (in == NULL || out == NULL || reached == NULL || queued == NULL || stack == NULL)
+   {
+      free(in);
+      free(out);
+      free(reached);
+      free(queued);
+      free(stack);
+      return 0;
+   }
+
+   // Variables start out unset, slots past them are not tracked as nothing ever sets them, constants are set from the
+   // start and the slots of undefined names in ifs never are
+   int valid = 1;
+   int top = 0;
+   memset(&in[(size_t)runtime->entry * words], 0, sizeof(uint64_t) * words);
+   reached[runtime->entry] = 1;
+   queued[runtime->entry] = 1;
+   stack[top++] = runtime->entry;
+
+   // A successor's set is the intersection of the sets leaving every instruction that goes to it
+   while (top > 0 && valid)
+   {
+      int i = stack[--top];
+      queued[i] = 0;
+
+      Instruction *ins = &runtime->program[i];
+      memcpy(out, &in[(size_t)i * words], sizeof(uint64_t) * words);
+      if ((ins->opcode == OP_SET || ins->opcode == OP_SET_VAR) && ins->a < vars)
+         SET_BIT(out, ins->a);
+
+      int next[4];
+      int count = successors(runtime, ins, i, next);
+      for (int k = 0; k < count; k++)
+      {
+         int s = next[k];
+         if (s < 0 || s >= n)
+         {
+            valid = 0;
+            break;
+         }
+
+         uint64_t *target = &in[(size_t)s * words];
+         int changed = 0;
+         if (!reached[s])
+         {
+            memcpy(target, out, sizeof(uint64_t) * words);
+            reached[s] = 1;
+            changed = 1;
+         }
+         else
+         {
+            for (int w = 0; w < words; w++)
+            {
+               uint64_t meet = target[w] & out[w];
+               changed |= meet != target[w];
+               target[w] = meet;
+            }
+         }
+
+         if (changed && !queued[s])
+         {
+            queued[s] = 1;
+            stack[top++] = s;
+         }
+      }
+   }
+
+   // An instruction is proven when every read is of a constant or of a variable set on every path to it
+   // Instructions that are never reached never run, so they have nothing to prove
+   int unproven = 0;
+   for (int i = 0; i < n && valid; i++)
+   {
+      Instruction *ins = &runtime->program[i];
+      int proven = 1;
+      if (reached[i])
+      {
+         int reads[3];
+         int count = read_slots(runtime, ins, i, reads);
+         for (int k = 0; k < count; k++)
+         {
+            int slot = reads[k];
+            if (slot < vars ? !TEST_BIT(&in[(size_t)i * words], slot) : !TEST_BIT(runtime->intValuesSet, slot))
+               proven = 0;
+         }
+      }
+
+      // A loop that can not be computed runs its head in place of itself, with the same reads
+      ins->proven = proven;
+      if (ins->opcode == OP_LOOP)
+         runtime->loops[ins->b].head.proven = proven;
+      unproven += !proven;
+   }
+
+   free(in);
+   free(out);
+   free(reached);
+   free(queued);
+   free(stack);
+
+   runtime->verified = valid && unproven == 0;
+   return runtime->verified;
+}
+
+# pragma endregion